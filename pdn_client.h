@@ -0,0 +1,1136 @@
+#ifndef PDN_CLIENT_H
+#define PDN_CLIENT_H
+
+/*
+A client that never waits for one request to finish before sending the next:
+
+1.  **Pipelining**: Every request gets an id from a per-connection counter and is sent straight away; many can
+be in flight on one connection at once. The server copies the id into its response (see pdn_protocol.h),
+which is how responses find their request no matter in which order they come back.
+2.  **Batched I/O**: submit() only appends the encoded frame to an outbound buffer. A writer thread sends
+whatever has piled up with one send(), and a reader thread receives responses in large chunks and splits them
+into frames, so the system call cost is paid per batch rather than per request.
+3.  **Completion**: Each request completes exactly once, either with the server's response or with a failure
+when the connection is lost or closed. The caller chooses between a callback, which runs on the reader
+thread and should be quick, and a std::future. Callbacks run without the client's lock, so they may submit
+follow-up requests, close the client or drop the last reference to it.
+4.  **Back-pressure**: At most `maxInFlight` requests and `maxInFlightBytes` of requests may be outstanding;
+submit() waits for room beyond that, so a client that produces faster than the server answers cannot grow
+without bound, and neither can what the server has to read and hold for it. These are the client's credits
+for the request direction; a request larger than the byte limit is sent once nothing else is outstanding.
+5.  **Connection Pool**: Several connections, to one or more servers, behind the same submit(). Each request
+goes to the less loaded of two connections picked at random ("power of two choices"), judged by their
+outstanding requests: nearly as good as always taking the least loaded one, without a shared counter every
+submit has to scan. A health thread pings every connection and evicts those that lost their connection, stop
+answering pings or whose pings take over `slowLatency` on average; their outstanding requests fail and the
+slot reconnects after a jittered, exponentially growing delay (see Backoff), so that a restarted server is not
+hit by every pool at once. A reconnected slot only gets traffic again once it answered a ping in
+time, so a server that is still slow is not handed a fresh batch of requests to fail. Requests that only mean
+something to one server, such as a snapshot's chunks, go through submitTo() with its endpoint instead.
+6.  **Write Batching**: Producers that write many small transactions hand them to a WriteBatcher, which
+collects them and sends one "batch" request once `maxBatchRecords` or `maxBatchBytes` is reached, or once the
+oldest has waited `linger`. The server parses one frame and answers once per batch with a sequence number per
+transaction, so frames, system calls and parsing are paid per batch. Each write still completes on its own.
+7.  **Transaction Cache**: An optional cache of per-key histories, kept coherent by the client's subscription
+rather than by expiry: every pushed transaction for a cached key is appended to it, and a delete empties it. A
+history read from the server comes with the sequence number it is complete up to, so a push the history
+already contains is told apart from one it does not, and pushes that arrive while the read is in flight are
+held back and applied once it lands. A hit is a hash lookup and a copy of the history; a push appends to it
+in place. Whenever the subscription is not delivering, the owner clears the cache and reads around it.
+
+    AsyncClient client;
+    client.connect("localhost", 8080);
+    client.submit(request, [](bool ok, const std::string& response) { ... });
+    std::future<Response> reply = client.submit(request);
+*/
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "pdn_protocol.h"
+
+/*
+**Async Client**
+*/
+
+// A connected TCP socket, or -1
+inline int connectTo(const std::string& host, int port) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) {
+        std::cerr << "Error: Cannot resolve " << host << std::endl;
+        return -1;
+    }
+
+    int fd = -1;
+    for (addrinfo* address = addresses; address != nullptr && fd == -1; address = address->ai_next) {
+        fd = ::socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd != -1 && ::connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    ::freeaddrinfo(addresses);
+    if (fd == -1) {
+        std::cerr << "Error: Connection to " << host << ":" << port << " refused" << std::endl;
+    }
+    return fd;
+}
+
+struct AsyncClientOptions {
+    size_t maxInFlight = 65536;         // Requests sent but not yet answered
+    size_t maxInFlightBytes = 64 << 20; // And their size
+    size_t receiveChunk = 256 << 10;    // Bytes asked for per recv()
+};
+
+struct Response {
+    bool ok = false; // False if the connection was lost before the response arrived
+    std::string payload;
+};
+
+class AsyncClient {
+public:
+    // Runs on the reader thread, or on the thread that closes the connection if it fails, never with the client's
+    // lock held: it may submit further requests, close the client or drop the last reference to it
+    using Callback = std::function<void(bool ok, const std::string& response)>;
+
+    explicit AsyncClient(AsyncClientOptions options = {}) : options(options), channel(std::make_shared<Channel>()) {}
+
+    ~AsyncClient() { close(); }
+
+    AsyncClient(const AsyncClient&) = delete;
+    AsyncClient& operator=(const AsyncClient&) = delete;
+
+    bool connect(const std::string& host, int port) {
+        int fd = connectTo(host, port);
+        return fd != -1 && adopt(fd);
+    }
+
+    // Takes over an already connected socket
+    bool adopt(int fd) {
+        if (reader.joinable() || writer.joinable()) {
+            std::cerr << "Error: Client is already connected" << std::endl;
+            return false;
+        }
+        // A fresh channel, since a thread let go of by close() may still hold on to the last one
+        channel = std::make_shared<Channel>();
+        channel->socket = fd;
+        channel->closed = false;
+        reader = std::thread([channel = channel, receiveChunk = options.receiveChunk] {
+            readLoop(*channel, receiveChunk);
+        });
+        writer = std::thread([channel = channel] { writeLoop(*channel); });
+        return true;
+    }
+
+    // Sends `request` and calls `done` once with its response. Safe to call from many threads at once. Returns
+    // false, after calling `done` with ok = false, if the connection is closed or the request is over
+    // kMaxFrameSize. From a callback on the reader thread it does not wait for room, since only that thread
+    // makes room; such follow-up requests may take the client past its limits.
+    bool submit(const std::string& request, Callback done) {
+        if (request.size() > kMaxFrameSize) {
+            std::cerr << "Error: Request of " << request.size() << " bytes exceeds the frame limit" << std::endl;
+            done(false, std::string());
+            return false;
+        }
+        Channel& state = *channel;
+        std::unique_lock<std::mutex> lock(state.mutex);
+        if (std::this_thread::get_id() != state.readerId) {
+            state.slotFree.wait(lock, [&] {
+                return state.closed ||
+                       (state.pending.size() < options.maxInFlight &&
+                        (state.pending.empty() || state.inFlightBytes + request.size() <= options.maxInFlightBytes));
+            });
+        }
+        if (state.closed) {
+            lock.unlock();
+            done(false, std::string());
+            return false;
+        }
+
+        uint64_t id = state.nextRequestId++;
+        state.pending.emplace(id, Pending{std::move(done), request.size()});
+        state.inFlightBytes += request.size();
+        bool wasIdle = state.outbound.empty();
+        appendFrame(state.outbound, request, id);
+        lock.unlock();
+        if (wasIdle) {
+            state.sendReady.notify_one();
+        }
+        return true;
+    }
+
+    std::future<Response> submit(const std::string& request) {
+        auto promise = std::make_shared<std::promise<Response>>();
+        std::future<Response> result = promise->get_future();
+        submit(request, [promise](bool ok, const std::string& payload) { promise->set_value(Response{ok, payload}); });
+        return result;
+    }
+
+    // Fails every outstanding request and waits for the I/O threads to exit. Called from a callback, it lets go
+    // of the thread the callback runs on instead, which exits on its own and closes the socket once it does.
+    void close() {
+        fail(*channel);
+        bool joined = finish(reader);
+        joined = finish(writer) && joined;
+        std::lock_guard<std::mutex> lock(channel->mutex);
+        channel->detached = channel->detached || !joined;
+        if (!channel->detached && channel->socket != -1) {
+            ::close(channel->socket);
+            channel->socket = -1;
+        }
+    }
+
+    size_t inFlight() const {
+        std::lock_guard<std::mutex> lock(channel->mutex);
+        return channel->pending.size();
+    }
+
+    // False once the connection failed or was closed
+    bool connected() const {
+        std::lock_guard<std::mutex> lock(channel->mutex);
+        return !channel->closed;
+    }
+
+private:
+    struct Pending {
+        Callback done;
+        size_t bytes; // Of the request
+    };
+
+    // The connection's state, shared with its I/O threads so that they can outlive the client when a callback
+    // destroys it
+    struct Channel {
+        ~Channel() {
+            if (socket != -1) {
+                ::close(socket);
+            }
+        }
+
+        mutable std::mutex mutex; // Guards everything below
+        std::condition_variable sendReady;
+        std::condition_variable slotFree;
+        int socket = -1;
+        std::thread::id readerId;
+        bool detached = false; // An I/O thread was let go of; the socket is closed once it exits
+        bool closed = true;
+        uint64_t nextRequestId = 1; // 0 is left for frames that answer no request
+        std::unordered_map<uint64_t, Pending> pending;
+        size_t inFlightBytes = 0;
+        std::string outbound;
+    };
+
+    // Joins `thread`, or detaches it if it is the calling one. Returns false if it was detached.
+    static bool finish(std::thread& thread) {
+        if (!thread.joinable()) {
+            return true;
+        }
+        if (thread.get_id() == std::this_thread::get_id()) {
+            thread.detach();
+            return false;
+        }
+        thread.join();
+        return true;
+    }
+
+    static void writeLoop(Channel& channel) {
+        std::string sending;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(channel.mutex);
+                channel.sendReady.wait(lock, [&] { return channel.closed || !channel.outbound.empty(); });
+                if (channel.closed) {
+                    return;
+                }
+                sending.swap(channel.outbound); // Everything submitted so far goes out with one send
+            }
+            if (!sendAll(channel.socket, sending.data(), sending.size())) {
+                std::cerr << "Error: Cannot send requests" << std::endl;
+                fail(channel);
+                return;
+            }
+            sending.clear();
+        }
+    }
+
+    static void readLoop(Channel& channel, size_t receiveChunk) {
+        {
+            std::lock_guard<std::mutex> lock(channel.mutex);
+            channel.readerId = std::this_thread::get_id();
+        }
+        FrameDecoder decoder;
+        std::string payload;
+        uint64_t id = 0;
+        while (true) {
+            char* buffer = decoder.prepare(receiveChunk);
+            ssize_t received = ::recv(channel.socket, buffer, receiveChunk, 0);
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received <= 0) {
+                break;
+            }
+            decoder.commit(static_cast<size_t>(received));
+
+            int status;
+            while ((status = decoder.next(payload, id)) == 1) {
+                Callback done;
+                {
+                    std::lock_guard<std::mutex> lock(channel.mutex);
+                    auto it = channel.pending.find(id);
+                    if (it == channel.pending.end()) {
+                        continue; // Not a response to anything outstanding, such as a subscription push
+                    }
+                    done = std::move(it->second.done);
+                    channel.inFlightBytes -= it->second.bytes;
+                    channel.pending.erase(it);
+                }
+                channel.slotFree.notify_all(); // Freed bytes may let several smaller requests through
+                done(true, payload);
+            }
+            if (status < 0) {
+                break;
+            }
+        }
+        fail(channel);
+    }
+
+    // Marks the connection closed, wakes everything waiting on it and fails what is still outstanding
+    static void fail(Channel& channel) {
+        std::unordered_map<uint64_t, Pending> failed;
+        {
+            std::lock_guard<std::mutex> lock(channel.mutex);
+            if (!channel.closed && channel.socket != -1) {
+                ::shutdown(channel.socket, SHUT_RDWR); // Unblocks the reader's recv()
+            }
+            channel.closed = true;
+            failed.swap(channel.pending);
+            channel.inFlightBytes = 0;
+            channel.outbound.clear();
+        }
+        channel.sendReady.notify_all();
+        channel.slotFree.notify_all();
+        for (auto& [id, request] : failed) {
+            request.done(false, std::string());
+        }
+    }
+
+    AsyncClientOptions options;
+    std::shared_ptr<Channel> channel;
+    std::thread reader;
+    std::thread writer;
+};
+
+/*
+**Reconnect Backoff**
+*/
+
+struct BackoffOptions {
+    std::chrono::milliseconds initial{100};
+    std::chrono::milliseconds max{30000};
+};
+
+// Exponential backoff with "equal jitter": the n-th wait is drawn uniformly from the upper half of
+// min(max, initial * 2^n). Clients that lost their server at the same moment therefore come back spread out
+// over an interval that widens with every failed attempt, instead of all at once.
+class Backoff {
+public:
+    explicit Backoff(BackoffOptions options = {}) : options(options), random(std::random_device{}()) {}
+
+    std::chrono::milliseconds next() {
+        int64_t ceiling = std::max<int64_t>(options.initial.count(), 1);
+        for (uint32_t i = 0; i < attempts && ceiling < options.max.count(); ++i) {
+            ceiling *= 2;
+        }
+        ceiling = std::min<int64_t>(ceiling, std::max<int64_t>(options.max.count(), 1));
+        attempts++;
+        std::uniform_int_distribution<int64_t> wait(ceiling / 2, ceiling);
+        return std::chrono::milliseconds(wait(random));
+    }
+
+    // After a success the next failure starts from `initial` again
+    void reset() { attempts = 0; }
+
+private:
+    BackoffOptions options;
+    std::minstd_rand random;
+    uint32_t attempts = 0;
+};
+
+/*
+**Connection Pool**
+*/
+
+struct Endpoint {
+    std::string host;
+    int port = 0;
+};
+
+struct ConnectionPoolOptions {
+    size_t connectionsPerEndpoint = 2;
+    std::chrono::milliseconds healthCheckInterval{1000};
+    std::chrono::milliseconds pingTimeout{2000};    // A ping unanswered for this long evicts the connection
+    std::chrono::milliseconds slowLatency{500};     // So does an average ping round trip above this
+    BackoffOptions reconnect{std::chrono::milliseconds(1000), std::chrono::milliseconds(30000)}; // Per slot
+    AsyncClientOptions client;
+};
+
+struct ConnectionPoolMetrics {
+    uint64_t connections = 0; // Slots connected and taking requests
+    uint64_t connects = 0;
+    uint64_t evictions = 0;
+    uint64_t rejected = 0; // Requests failed straight away because no connection was usable
+};
+
+class ConnectionPool {
+public:
+    using Callback = AsyncClient::Callback;
+
+    explicit ConnectionPool(std::vector<Endpoint> endpoints, ConnectionPoolOptions options = {})
+        : options(options) {
+        for (const auto& endpoint : endpoints) {
+            for (size_t i = 0; i < std::max<size_t>(options.connectionsPerEndpoint, 1); ++i) {
+                slots.push_back(std::make_unique<Slot>(options.reconnect));
+                slots.back()->endpoint = endpoint;
+            }
+        }
+    }
+
+    ~ConnectionPool() { stop(); }
+
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    // Connects every slot it can and starts the health checks. Returns false if no endpoint was reachable;
+    // the health thread keeps trying either way.
+    bool start() {
+        Clock::time_point now = Clock::now();
+        for (auto& slot : slots) {
+            reconnect(*slot, now, false);
+        }
+        stopping = false;
+        checker = std::thread([this] { checkLoop(); });
+        return metrics().connections > 0;
+    }
+
+    // Fails every outstanding request
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(checkMutex);
+            stopping = true;
+        }
+        checkWakeup.notify_all();
+        if (checker.joinable()) {
+            checker.join();
+        }
+        for (auto& slot : slots) {
+            evict(*slot, false);
+        }
+    }
+
+    // Sends `request` on the less loaded of two random connections. Same contract as AsyncClient::submit().
+    bool submit(const std::string& request, Callback done) {
+        Slot* slot = nullptr;
+        std::shared_ptr<AsyncClient> client = pick(slot);
+        if (client == nullptr) {
+            rejected.fetch_add(1, std::memory_order_relaxed);
+            done(false, std::string());
+            return false;
+        }
+        return send(*slot, *client, request, std::move(done));
+    }
+
+    std::future<Response> submit(const std::string& request) {
+        auto promise = std::make_shared<std::promise<Response>>();
+        std::future<Response> result = promise->get_future();
+        submit(request, [promise](bool ok, const std::string& payload) { promise->set_value(Response{ok, payload}); });
+        return result;
+    }
+
+    // Sends `request` on the less loaded connection to `endpoint`, for requests that only make sense to the
+    // server that answered earlier ones. Same contract as AsyncClient::submit().
+    bool submitTo(const Endpoint& endpoint, const std::string& request, Callback done) {
+        Slot* slot = nullptr;
+        std::shared_ptr<AsyncClient> client = pickFor(endpoint, slot);
+        if (client == nullptr) {
+            rejected.fetch_add(1, std::memory_order_relaxed);
+            done(false, std::string());
+            return false;
+        }
+        return send(*slot, *client, request, std::move(done));
+    }
+
+    std::future<Response> submitTo(const Endpoint& endpoint, const std::string& request) {
+        auto promise = std::make_shared<std::promise<Response>>();
+        std::future<Response> result = promise->get_future();
+        submitTo(endpoint, request,
+                 [promise](bool ok, const std::string& payload) { promise->set_value(Response{ok, payload}); });
+        return result;
+    }
+
+    ConnectionPoolMetrics metrics() const {
+        ConnectionPoolMetrics result;
+        for (const auto& slot : slots) {
+            if (usable(*slot) != nullptr) {
+                result.connections++;
+            }
+        }
+        result.connects = connects.load(std::memory_order_relaxed);
+        result.evictions = evictions.load(std::memory_order_relaxed);
+        result.rejected = rejected.load(std::memory_order_relaxed);
+        return result;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr const char* kPing = "{\"ping\":true}";
+
+    struct Slot {
+        explicit Slot(BackoffOptions reconnect) : backoff(reconnect) {}
+
+        Endpoint endpoint;
+        std::shared_ptr<AsyncClient> client;    // Null while evicted; only used through std::atomic_load/store
+        std::atomic<uint64_t> outstanding{0};
+        std::atomic<uint64_t> pingMicros{0};    // Moving average of ping round trips
+        std::atomic<bool> ready{false};         // Takes requests; false while on probation after a reconnect
+
+        // Health thread only
+        Backoff backoff;
+        Clock::time_point retryAt;
+        std::shared_ptr<std::atomic<bool>> pingAnswered; // Null while no ping is out
+        Clock::time_point pingSentAt;
+    };
+
+    // Null if no connection is usable; `slot` receives the one picked
+    std::shared_ptr<AsyncClient> pick(Slot*& slot) {
+        thread_local std::minstd_rand random(std::random_device{}());
+        size_t count = slots.size();
+        if (count == 0) {
+            return nullptr;
+        }
+
+        size_t first = random() % count;
+        size_t second = count == 1 ? first : (first + 1 + random() % (count - 1)) % count;
+        std::shared_ptr<AsyncClient> a = usable(*slots[first]);
+        std::shared_ptr<AsyncClient> b = usable(*slots[second]);
+        if (a != nullptr && (b == nullptr || slots[first]->outstanding.load(std::memory_order_relaxed) <=
+                                                 slots[second]->outstanding.load(std::memory_order_relaxed))) {
+            slot = slots[first].get();
+            return a;
+        }
+        if (b != nullptr) {
+            slot = slots[second].get();
+            return b;
+        }
+
+        // Both evicted: fall back to whichever connection is left
+        for (size_t i = 0; i < count; ++i) {
+            std::shared_ptr<AsyncClient> client = usable(*slots[(first + i) % count]);
+            if (client != nullptr) {
+                slot = slots[(first + i) % count].get();
+                return client;
+            }
+        }
+        return nullptr;
+    }
+
+    // Like pick(), among the connections to `endpoint`
+    std::shared_ptr<AsyncClient> pickFor(const Endpoint& endpoint, Slot*& slot) {
+        std::shared_ptr<AsyncClient> best;
+        for (auto& candidate : slots) {
+            if (candidate->endpoint.host != endpoint.host || candidate->endpoint.port != endpoint.port) {
+                continue;
+            }
+            std::shared_ptr<AsyncClient> client = usable(*candidate);
+            if (client != nullptr && (best == nullptr || candidate->outstanding.load(std::memory_order_relaxed) <
+                                                             slot->outstanding.load(std::memory_order_relaxed))) {
+                best = client;
+                slot = candidate.get();
+            }
+        }
+        return best;
+    }
+
+    static std::shared_ptr<AsyncClient> usable(const Slot& slot) {
+        return slot.ready.load(std::memory_order_acquire) ? std::atomic_load(&slot.client) : nullptr;
+    }
+
+    bool send(Slot& slot, AsyncClient& client, const std::string& request, Callback done) {
+        slot.outstanding.fetch_add(1, std::memory_order_relaxed);
+        return client.submit(request, [&slot, done = std::move(done)](bool ok, const std::string& response) {
+            slot.outstanding.fetch_sub(1, std::memory_order_relaxed);
+            done(ok, response);
+        });
+    }
+
+    void checkLoop() {
+        std::unique_lock<std::mutex> lock(checkMutex);
+        while (!stopping) {
+            checkWakeup.wait_for(lock, options.healthCheckInterval, [&] { return stopping; });
+            if (stopping) {
+                return;
+            }
+            lock.unlock();
+            Clock::time_point now = Clock::now();
+            for (auto& slot : slots) {
+                check(*slot, now);
+            }
+            lock.lock();
+        }
+    }
+
+    void check(Slot& slot, Clock::time_point now) {
+        std::shared_ptr<AsyncClient> client = std::atomic_load(&slot.client);
+        if (client == nullptr) {
+            if (now >= slot.retryAt) {
+                reconnect(slot, now, true);
+            }
+            return;
+        }
+
+        bool pingOverdue = slot.pingAnswered != nullptr && !slot.pingAnswered->load(std::memory_order_acquire) &&
+                           now - slot.pingSentAt > options.pingTimeout;
+        auto slowMicros = std::chrono::duration_cast<std::chrono::microseconds>(options.slowLatency).count();
+        bool slow = slot.pingMicros.load(std::memory_order_relaxed) > static_cast<uint64_t>(slowMicros);
+        if (!client->connected() || pingOverdue || slow) {
+            std::cerr << "Error: Evicting connection to " << slot.endpoint.host << ":" << slot.endpoint.port
+                      << (pingOverdue ? " (no answer to ping)" : slow ? " (too slow)" : " (connection lost)")
+                      << std::endl;
+            evict(slot, true);
+            slot.retryAt = now + slot.backoff.next();
+            return;
+        }
+
+        // Idle connections are kept honest by the ping, busy ones by their own traffic as well
+        if (slot.pingAnswered != nullptr && slot.pingAnswered->load(std::memory_order_acquire)) {
+            slot.ready.store(true, std::memory_order_release);
+            slot.backoff.reset();
+        }
+        if (slot.pingAnswered == nullptr || slot.pingAnswered->load(std::memory_order_acquire)) {
+            auto answered = std::make_shared<std::atomic<bool>>(false);
+            slot.pingAnswered = answered;
+            slot.pingSentAt = now;
+            // Only pings are timed: a response to a large read or a snapshot chunk says nothing about the
+            // connection being slow, and its size would push the average over `slowLatency`
+            send(slot, *client, kPing, [&slot, answered, now](bool ok, const std::string&) {
+                if (!ok) {
+                    return;
+                }
+                auto micros = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - now).count();
+                uint64_t sample = static_cast<uint64_t>(micros);
+                uint64_t average = slot.pingMicros.load(std::memory_order_relaxed);
+                slot.pingMicros.store(average == 0 ? sample : (average * 7 + sample) / 8, std::memory_order_relaxed);
+                answered->store(true, std::memory_order_release);
+            });
+        }
+    }
+
+    // Unless `probation` is false, the new connection gets no requests until it answered a ping
+    void reconnect(Slot& slot, Clock::time_point now, bool probation) {
+        int fd = connectTo(slot.endpoint.host, slot.endpoint.port);
+        if (fd == -1) {
+            slot.retryAt = now + slot.backoff.next();
+            return;
+        }
+        auto client = std::make_shared<AsyncClient>(options.client);
+        client->adopt(fd);
+        slot.pingMicros.store(0, std::memory_order_relaxed);
+        slot.pingAnswered = nullptr;
+        std::atomic_store(&slot.client, client);
+        slot.ready.store(!probation, std::memory_order_release);
+        connects.fetch_add(1, std::memory_order_relaxed);
+        if (probation) {
+            check(slot, now); // Sends the first ping
+        }
+    }
+
+    // Outstanding requests on the slot's connection fail; submits that already picked it fail too
+    void evict(Slot& slot, bool counted) {
+        slot.ready.store(false, std::memory_order_release);
+        std::shared_ptr<AsyncClient> client = std::atomic_exchange(&slot.client, std::shared_ptr<AsyncClient>());
+        if (client != nullptr) {
+            client->close();
+            if (counted) {
+                evictions.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    ConnectionPoolOptions options;
+    std::vector<std::unique_ptr<Slot>> slots;
+
+    std::thread checker;
+    std::mutex checkMutex;
+    std::condition_variable checkWakeup;
+    bool stopping = false;
+
+    std::atomic<uint64_t> connects{0};
+    std::atomic<uint64_t> evictions{0};
+    std::atomic<uint64_t> rejected{0};
+};
+
+/*
+**Write Batching**
+*/
+
+struct WriteBatchOptions {
+    std::chrono::milliseconds linger{5}; // Longest a write waits for others to join its batch
+    size_t maxBatchRecords = 1000;
+    size_t maxBatchBytes = 256 << 10; // Encoded size of the request; a larger single write goes out alone
+};
+
+struct WriteBatchMetrics {
+    uint64_t writes = 0;
+    uint64_t batches = 0;
+    uint64_t lingerFlushes = 0; // Batches sent because the linger ran out rather than because they were full
+
+    double averageBatchRecords() const {
+        return batches == 0 ? 0.0 : static_cast<double>(writes) / static_cast<double>(batches);
+    }
+};
+
+class WriteBatcher {
+public:
+    // Sends one request, like AsyncClient::submit() and ConnectionPool::submit()
+    using Send = std::function<bool(const std::string& request, AsyncClient::Callback done)>;
+    // Called once per write, with the sequence number the server assigned it
+    using Completion = std::function<void(bool stored, uint64_t sequence)>;
+
+    explicit WriteBatcher(Send send, WriteBatchOptions options = {}) : send(std::move(send)), options(options) {}
+
+    ~WriteBatcher() { stop(); }
+
+    WriteBatcher(const WriteBatcher&) = delete;
+    WriteBatcher& operator=(const WriteBatcher&) = delete;
+
+    void start() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!flusher.joinable()) {
+            stopping = false;
+            flusher = std::thread([this] { lingerLoop(); });
+        }
+    }
+
+    // Sends what is still buffered before returning
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        lingerExpired.notify_all();
+        if (flusher.joinable()) {
+            flusher.join();
+        }
+        flush();
+    }
+
+    // Buffers one transaction. A write that fills the batch sends it from the calling thread.
+    void write(const std::string& key, const std::string& data, Completion done) {
+        std::string entry = "{\"key\":";
+        appendJsonString(entry, key);
+        entry += ",\"data\":";
+        appendJsonString(entry, data);
+        entry += '}';
+
+        Batch overflowed;
+        Batch full;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!batch.completions.empty() && batch.request.size() + entry.size() + 2 > options.maxBatchBytes) {
+                overflowed = takeBatch(); // The new write would not fit, so it starts the next batch
+            }
+            if (batch.completions.empty()) {
+                batch.request = "{\"batch\":[";
+                batch.startedAt = Clock::now();
+                lingerExpired.notify_one();
+            } else {
+                batch.request += ',';
+            }
+            batch.request += entry;
+            batch.completions.push_back(std::move(done));
+            writes++;
+            if (batch.completions.size() >= options.maxBatchRecords ||
+                batch.request.size() + 2 >= options.maxBatchBytes) {
+                full = takeBatch();
+            }
+        }
+        if (!overflowed.completions.empty()) {
+            dispatch(std::move(overflowed));
+        }
+        if (!full.completions.empty()) {
+            dispatch(std::move(full));
+        }
+    }
+
+    std::future<uint64_t> write(const std::string& key, const std::string& data) {
+        auto promise = std::make_shared<std::promise<uint64_t>>();
+        std::future<uint64_t> result = promise->get_future();
+        write(key, data, [promise](bool stored, uint64_t sequence) { promise->set_value(stored ? sequence : 0); });
+        return result;
+    }
+
+    // Sends the buffered writes now instead of waiting for the linger
+    void flush() {
+        Batch pending;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending = takeBatch();
+        }
+        if (!pending.completions.empty()) {
+            dispatch(std::move(pending));
+        }
+    }
+
+    WriteBatchMetrics metrics() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        WriteBatchMetrics result;
+        result.writes = writes;
+        result.batches = batches;
+        result.lingerFlushes = lingerFlushes;
+        return result;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Batch {
+        std::string request;
+        std::vector<Completion> completions;
+        Clock::time_point startedAt;
+    };
+
+    // Sends a batch once its oldest write has waited `linger`, unless it filled up first
+    void lingerLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            if (batch.completions.empty()) {
+                lingerExpired.wait(lock);
+                continue;
+            }
+            Clock::time_point deadline = batch.startedAt + options.linger;
+            if (Clock::now() < deadline) {
+                lingerExpired.wait_until(lock, deadline);
+                continue;
+            }
+            Batch expired = takeBatch();
+            lingerFlushes++;
+            lock.unlock();
+            dispatch(std::move(expired));
+            lock.lock();
+        }
+    }
+
+    // Caller holds `mutex`
+    Batch takeBatch() {
+        Batch taken;
+        if (!batch.completions.empty()) {
+            batch.request += "]}";
+            std::swap(taken, batch);
+            batches++;
+        }
+        return taken;
+    }
+
+    void dispatch(Batch sent) {
+        auto completions = std::make_shared<std::vector<Completion>>(std::move(sent.completions));
+        send(sent.request, [completions](bool ok, const std::string& response) {
+            // The answer lists one sequence number per write in batch order, 0 for one that was not stored
+            const char* cursor = ok ? std::strstr(response.c_str(), "\"sequences\":[") : nullptr;
+            if (cursor != nullptr) {
+                cursor += std::strlen("\"sequences\":[");
+            }
+            for (auto& done : *completions) {
+                uint64_t sequence = 0;
+                if (cursor != nullptr) {
+                    char* end = nullptr;
+                    sequence = std::strtoull(cursor, &end, 10);
+                    cursor = *end == ',' ? end + 1 : nullptr;
+                }
+                done(sequence != 0, sequence);
+            }
+        });
+    }
+
+    // Appends `value` as a JSON string literal
+    static void appendJsonString(std::string& out, const std::string& value) {
+        out += '"';
+        for (char c : value) {
+            switch (c) {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned char>(c));
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+            }
+        }
+        out += '"';
+    }
+
+    Send send;
+    WriteBatchOptions options;
+    std::thread flusher;
+
+    mutable std::mutex mutex; // Guards everything below
+    std::condition_variable lingerExpired;
+    bool stopping = false;
+    Batch batch;
+    uint64_t writes = 0;
+    uint64_t batches = 0;
+    uint64_t lingerFlushes = 0;
+};
+
+/*
+**Transaction Cache**
+*/
+
+struct TransactionCacheOptions {
+    uint64_t capacityBytes = 64 << 20;
+    size_t shards = 16;
+    std::chrono::milliseconds maxAge{60000}; // Refetched after this, since the server expires transactions silently
+};
+
+struct TransactionCacheMetrics {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t fills = 0;
+    uint64_t appends = 0; // Pushed transactions applied to cached histories
+    uint64_t evictions = 0;
+    uint64_t usedBytes = 0;
+
+    double hitRatio() const {
+        uint64_t lookups = hits + misses;
+        return lookups == 0 ? 0.0 : static_cast<double>(hits) / static_cast<double>(lookups);
+    }
+};
+
+class TransactionCache {
+public:
+    explicit TransactionCache(TransactionCacheOptions options = {})
+        : options(options), shards(std::max<size_t>(options.shards, 1)) {}
+
+    TransactionCache(const TransactionCache&) = delete;
+    TransactionCache& operator=(const TransactionCache&) = delete;
+
+    // Copies the cached history of `key`, oldest first, to `history`. Returns false if it is not cached.
+    bool lookup(const std::string& key, std::vector<std::string>& history) {
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.entries.find(key);
+        if (found == shard.entries.end()) {
+            shard.misses++;
+            return false;
+        }
+        if (Clock::now() - found->second.filledAt > options.maxAge) {
+            erase(shard, found);
+            shard.misses++;
+            return false;
+        }
+        shard.order.splice(shard.order.begin(), shard.order, found->second.position);
+        shard.hits++;
+        history = found->second.history;
+        return true;
+    }
+
+    // Called before asking the server for `key`'s history, so pushes that cross the request are not lost.
+    // Returns false if a read of the key is already in flight; the caller then reads without filling.
+    bool beginFill(const std::string& key) {
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.inFlight.emplace(key, std::vector<Pushed>()).second;
+    }
+
+    // Installs what the server returned; `asOf` is the sequence number it said the history is complete up to
+    void fill(const std::string& key, std::vector<std::string> history, uint64_t asOf) {
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto pending = shard.inFlight.find(key);
+        if (pending == shard.inFlight.end()) {
+            return;
+        }
+        for (const auto& pushed : pending->second) {
+            if (pushed.sequence > asOf) {
+                appendTo(history, pushed);
+                asOf = pushed.sequence;
+            }
+        }
+        shard.inFlight.erase(pending);
+
+        auto found = shard.entries.find(key);
+        if (found != shard.entries.end()) {
+            erase(shard, found);
+        }
+        uint64_t bytes = sizeOf(key, history);
+        if (bytes > options.capacityBytes / shards.size()) {
+            return;
+        }
+        shard.order.push_front(key);
+        Entry& entry = shard.entries[key];
+        entry.history = std::move(history);
+        entry.asOf = asOf;
+        entry.bytes = bytes;
+        entry.filledAt = Clock::now();
+        entry.position = shard.order.begin();
+        shard.usedBytes += bytes;
+        shard.fills++;
+        makeRoom(shard);
+    }
+
+    // The read failed; forget the fill
+    void abandonFill(const std::string& key) {
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.inFlight.erase(key);
+    }
+
+    // Called with every transaction the subscription delivers, in sequence order
+    void apply(const std::string& key, uint64_t sequence, bool deleted, const std::string& data) {
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        Pushed pushed{sequence, deleted, data};
+        auto pending = shard.inFlight.find(key);
+        if (pending != shard.inFlight.end()) {
+            pending->second.push_back(pushed);
+        }
+
+        auto found = shard.entries.find(key);
+        if (found == shard.entries.end() || sequence <= found->second.asOf) {
+            return;
+        }
+
+        // Readers get copies, so the cached history is appended to in place
+        Entry& entry = found->second;
+        appendTo(entry.history, pushed);
+        uint64_t bytes = deleted ? sizeOf(key, entry.history) : entry.bytes + data.size() + sizeof(std::string);
+        shard.usedBytes = shard.usedBytes - entry.bytes + bytes;
+        entry.asOf = sequence;
+        entry.bytes = bytes;
+        shard.appends++;
+        makeRoom(shard);
+    }
+
+    // Forgets every history and every fill in flight. For when pushes may have been missed, since a history
+    // that misses one is stale until it ages out.
+    void clear() {
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.entries.clear();
+            shard.order.clear();
+            shard.inFlight.clear();
+            shard.usedBytes = 0;
+        }
+    }
+
+    TransactionCacheMetrics metrics() const {
+        TransactionCacheMetrics result;
+        for (const auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            result.hits += shard.hits;
+            result.misses += shard.misses;
+            result.fills += shard.fills;
+            result.appends += shard.appends;
+            result.evictions += shard.evictions;
+            result.usedBytes += shard.usedBytes;
+        }
+        return result;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Pushed {
+        uint64_t sequence;
+        bool deleted;
+        std::string data;
+    };
+
+    struct Entry {
+        std::vector<std::string> history;
+        uint64_t asOf = 0; // Every transaction of the key up to this sequence number is in `history`
+        uint64_t bytes = 0;
+        Clock::time_point filledAt;
+        std::list<std::string>::iterator position;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex; // Guards everything below
+        std::unordered_map<std::string, Entry> entries;
+        std::list<std::string> order; // Most recently used first
+        std::unordered_map<std::string, std::vector<Pushed>> inFlight; // Reads not yet filled, with pushes since
+        uint64_t usedBytes = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t fills = 0;
+        uint64_t appends = 0;
+        uint64_t evictions = 0;
+    };
+
+    Shard& shardFor(const std::string& key) { return shards[std::hash<std::string>()(key) % shards.size()]; }
+
+    static void appendTo(std::vector<std::string>& history, const Pushed& pushed) {
+        if (pushed.deleted) {
+            history.clear();
+        } else {
+            history.push_back(pushed.data);
+        }
+    }
+
+    static uint64_t sizeOf(const std::string& key, const std::vector<std::string>& history) {
+        uint64_t bytes = key.size() * 2 + sizeof(Entry);
+        for (const auto& data : history) {
+            bytes += data.size() + sizeof(std::string);
+        }
+        return bytes;
+    }
+
+    void erase(Shard& shard, std::unordered_map<std::string, Entry>::iterator found) {
+        shard.usedBytes -= found->second.bytes;
+        shard.order.erase(found->second.position);
+        shard.entries.erase(found);
+    }
+
+    void makeRoom(Shard& shard) {
+        while (shard.usedBytes > options.capacityBytes / shards.size() && !shard.order.empty()) {
+            erase(shard, shard.entries.find(shard.order.back()));
+            shard.evictions++;
+        }
+    }
+
+    TransactionCacheOptions options;
+    std::vector<Shard> shards;
+};
+
+#endif // PDN_CLIENT_H
@@ -0,0 +1,1424 @@
+#ifndef PDN_CONSENSUS_H
+#define PDN_CONSENSUS_H
+
+/*
+Replicas agree on one log of transactions with Multi-Paxos. Every replica is acceptor and learner; one of them
+at a time is the leader and the only proposer:
+
+1.  **Phase 1 Once**: A replica that has not heard from a leader for a randomised election timeout picks a
+ballot higher than any it has seen and sends one "prepare" for every slot from its first unapplied one on. A
+majority of promises makes it the leader for as long as nobody prepares a higher ballot. Values the promises
+report as accepted are proposed again under the new ballot, and holes are filled with no-ops, so nothing a
+previous leader may have gotten chosen is lost. A promise reports at most half a frame of values; a candidate
+told that more were left out, or that slots it has not applied were already forgotten, gives up the election
+and waits to be caught up by one that is not behind.
+2.  **One Round Trip per Transaction**: From then on the leader assigns each new value the next slot and sends
+one "accept" to every replica. A majority of acceptances makes it chosen. Rounds for different slots are
+pipelined over the same connections, so throughput is not bound by the round trip time.
+3.  **Stepping Down**: A rejection carrying a higher ballot means another replica took over, and a leader that
+has not heard from a majority within an election timeout may have been replaced without knowing it; either
+way it steps down. Its pending proposals end as Unknown rather than failed, since they may still be chosen.
+Promising a ballot or hearing from its leader puts off a replica's own election.
+4.  **Learning**: The leader sends "commit" for every chosen slot. Followers answer its heartbeats with their
+first unapplied slot, and one that fell behind gets the commits it missed, from memory or from the values its
+acceptor logged as chosen. Every replica applies chosen values strictly in slot order, and not past a value
+that failed to apply; that one is retried on the next tick.
+5.  **Durability**: An acceptor writes each promise and acceptance to its own log, with a CRC32C per entry,
+and syncs it before answering, so a restarted acceptor never goes back on its word. The first unapplied slot
+is logged once values are applied, along with the chosen values it had not accepted. A crash between applying
+and logging offers the last values again, which the state machine recognises by slot and skips.
+6.  **Trimming**: Heartbeats tell acceptors to forget what they accepted below the slot every replica applied,
+or below the last `maxKeptSlots` if a replica is down or far behind, and the log is rewritten once most of it
+is forgotten. A follower that needs forgotten slots is sent a snapshot of the leader's state in chunks,
+a few megabytes ahead of what it confirmed, and installs it in their place.
+
+Messages between replicas are binary (fixed-width little-endian integers, see pdn_storage.h) and travel in
+ordinary frames (see pdn_protocol.h), sent through a ConnectionPool per peer so reconnects and health checks
+come for free.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "pdn_client.h"
+#include "pdn_crc32c.h"
+#include "pdn_snapshot.h"
+#include "pdn_storage.h"
+
+/*
+**Acceptor**
+*/
+
+struct AcceptedValue {
+    uint64_t ballot = 0;
+    std::string value;
+};
+
+class PaxosAcceptor {
+public:
+    explicit PaxosAcceptor(std::string path) : path(std::move(path)) {}
+
+    ~PaxosAcceptor() {
+        if (fd != -1) {
+            ::close(fd);
+        }
+    }
+
+    PaxosAcceptor(const PaxosAcceptor&) = delete;
+    PaxosAcceptor& operator=(const PaxosAcceptor&) = delete;
+
+    // Replays the log; a torn last entry is cut off
+    bool open() {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd == -1) {
+            std::cerr << "Error: Cannot open " << path << std::endl;
+            return false;
+        }
+        off_t size = ::lseek(fd, 0, SEEK_END);
+        std::string contents(static_cast<size_t>(std::max<off_t>(size, 0)), '\0');
+        if (!contents.empty() && !readFully(fd, &contents[0], contents.size(), 0)) {
+            return false;
+        }
+
+        size_t offset = 0;
+        while (offset + kEntryHeaderSize <= contents.size()) {
+            const char* entry = contents.data() + offset;
+            uint32_t length = getFixed32(entry + 21);
+            if (offset + kEntryHeaderSize + length > contents.size() ||
+                crc32c(entry + 4, kEntryHeaderSize - 4 + length) != getFixed32(entry)) {
+                break;
+            }
+            replay(static_cast<EntryType>(entry[4]), getFixed64(entry + 5), getFixed64(entry + 13),
+                   std::string(entry + kEntryHeaderSize, length));
+            offset += kEntryHeaderSize + length;
+        }
+        if (offset != contents.size()) {
+            std::cerr << "Error: Truncating " << path << " after its last intact entry" << std::endl;
+            if (::ftruncate(fd, static_cast<off_t>(offset)) != 0) {
+                return false;
+            }
+        }
+        logBytes = offset;
+        return ::lseek(fd, static_cast<off_t>(offset), SEEK_SET) != -1;
+    }
+
+    // Promises to ignore every ballot below `ballot` and reports what was accepted from `fromSlot` on, as far
+    // as `maxBytes` of values (plus kReportOverhead per entry) go. `complete` says whether that was everything.
+    // Returns false, with `promised` set to the ballot already promised, if that is higher.
+    bool prepare(uint64_t ballot, uint64_t fromSlot, size_t maxBytes, uint64_t& promised,
+                 std::map<uint64_t, AcceptedValue>& reported, bool& complete) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (ballot < promisedBallot) {
+            promised = promisedBallot;
+            return false;
+        }
+        if (ballot > promisedBallot && !write(encodeEntry(EntryType::Promise, ballot, 0, std::string()))) {
+            promised = promisedBallot;
+            return false;
+        }
+        promisedBallot = promised = ballot;
+        complete = true;
+        size_t bytes = 0;
+        for (auto it = accepted.lower_bound(fromSlot); it != accepted.end(); ++it) {
+            bytes += kReportOverhead + it->second.value.size();
+            if (bytes > maxBytes) {
+                complete = false;
+                break;
+            }
+            reported.insert(*it);
+        }
+        return true;
+    }
+
+    // Accepts `value` for `slot` unless a higher ballot was promised. A slot that was trimmed is applied
+    // everywhere it matters, so it is acknowledged without being logged again.
+    bool accept(uint64_t ballot, uint64_t slot, const std::string& value, uint64_t& promised) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (slot < trimmedBelowSlot && ballot >= promisedBallot) {
+            promised = promisedBallot;
+            return true;
+        }
+        if (ballot < promisedBallot || !write(encodeEntry(EntryType::Accept, ballot, slot, value))) {
+            promised = promisedBallot;
+            return false;
+        }
+        promisedBallot = promised = ballot;
+        setAccepted(slot, AcceptedValue{ballot, value});
+        return true;
+    }
+
+    // Every slot below `slot` has been applied, the latest ones with the values in `applied`. A chosen value
+    // this acceptor never accepted, or accepted a different value in place of, is logged along with it, so the
+    // accepted values of applied slots are always the chosen ones and can be sent to followers that missed them.
+    void markApplied(uint64_t slot, const std::vector<std::pair<uint64_t, std::string>>& applied) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (slot <= appliedUpTo) {
+            return;
+        }
+        std::string entries;
+        std::vector<std::pair<uint64_t, AcceptedValue>> corrected;
+        for (const auto& [appliedSlot, value] : applied) {
+            auto it = accepted.find(appliedSlot);
+            if (appliedSlot >= trimmedBelowSlot && (it == accepted.end() || it->second.value != value)) {
+                AcceptedValue chosen{it == accepted.end() ? 0 : it->second.ballot, value};
+                entries += encodeEntry(EntryType::Chosen, chosen.ballot, appliedSlot, value);
+                corrected.emplace_back(appliedSlot, std::move(chosen));
+            }
+        }
+        entries += encodeEntry(EntryType::Applied, 0, slot, std::string());
+        if (!write(entries)) {
+            return;
+        }
+        for (auto& [correctedSlot, value] : corrected) {
+            setAccepted(correctedSlot, std::move(value));
+        }
+        appliedUpTo = slot;
+    }
+
+    // Everything below `slot` is now reflected in a checkpoint that was installed in place of replaying it.
+    // What this acceptor holds for those slots may never have been chosen, so it is dropped for good.
+    bool installCheckpoint(uint64_t slot) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (slot <= appliedUpTo) {
+            return true;
+        }
+        if (!write(encodeEntry(EntryType::Applied, 0, slot, std::string()) +
+                   encodeEntry(EntryType::Trimmed, 0, slot, std::string()))) {
+            return false;
+        }
+        appliedUpTo = slot;
+        forgetBelow(slot);
+        return true;
+    }
+
+    // The value chosen for `slot`, if it is applied and still kept
+    bool chosenValue(uint64_t slot, std::string& value) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (slot < trimmedBelowSlot || slot >= appliedUpTo) {
+            return false;
+        }
+        auto it = accepted.find(slot);
+        if (it == accepted.end()) {
+            return false;
+        }
+        value = it->second.value;
+        return true;
+    }
+
+    // Forgets what was accepted below `slot`, but never anything not applied yet. The log is rewritten once
+    // most of it is forgotten. Until then a restart brings the forgotten values back, which is harmless since
+    // they are chosen ones.
+    void trim(uint64_t slot) {
+        std::lock_guard<std::mutex> lock(mutex);
+        slot = std::min(slot, appliedUpTo);
+        if (slot <= trimmedBelowSlot) {
+            return;
+        }
+        forgetBelow(slot);
+        if (logBytes > 2 * liveBytes + kMinRewriteBytes) {
+            rewrite();
+        }
+    }
+
+    uint64_t promised() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return promisedBallot;
+    }
+
+    // First slot not yet applied, as of the last markApplied() that reached the disk
+    uint64_t firstUnapplied() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return appliedUpTo;
+    }
+
+    // Nothing accepted below this slot is kept
+    uint64_t trimmedBelow() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return trimmedBelowSlot;
+    }
+
+    // What prepare() counts for an entry besides its value: the slot, ballot and length that go with it
+    static constexpr size_t kReportOverhead = 20;
+
+private:
+    enum class EntryType : uint8_t {
+        Promise = 1,
+        Accept = 2,
+        Applied = 3,
+        Chosen = 4, // The value chosen for an applied slot, in place of what was accepted for it
+        Trimmed = 5
+    };
+
+    // crc(4) + type(1) + ballot(8) + slot(8) + valueLength(4); the crc covers everything after itself
+    static constexpr size_t kEntryHeaderSize = 25;
+
+    // The log is not rewritten for less than this, however little of it is still needed
+    static constexpr uint64_t kMinRewriteBytes = 4u << 20;
+
+    void replay(EntryType type, uint64_t ballot, uint64_t slot, std::string value) {
+        switch (type) {
+        case EntryType::Promise:
+            promisedBallot = std::max(promisedBallot, ballot);
+            break;
+        case EntryType::Accept:
+            promisedBallot = std::max(promisedBallot, ballot);
+            setAccepted(slot, AcceptedValue{ballot, std::move(value)});
+            break;
+        case EntryType::Applied:
+            appliedUpTo = std::max(appliedUpTo, slot);
+            break;
+        case EntryType::Chosen:
+            setAccepted(slot, AcceptedValue{ballot, std::move(value)});
+            break;
+        case EntryType::Trimmed:
+            forgetBelow(slot);
+            break;
+        }
+    }
+
+    void setAccepted(uint64_t slot, AcceptedValue value) {
+        auto [entry, inserted] = accepted.try_emplace(slot);
+        liveBytes += (inserted ? kEntryHeaderSize : 0) + value.value.size() - entry->second.value.size();
+        entry->second = std::move(value);
+    }
+
+    void forgetBelow(uint64_t slot) {
+        auto end = accepted.lower_bound(slot);
+        for (auto it = accepted.begin(); it != end; ++it) {
+            liveBytes -= kEntryHeaderSize + it->second.value.size();
+        }
+        accepted.erase(accepted.begin(), end);
+        trimmedBelowSlot = std::max(trimmedBelowSlot, slot);
+    }
+
+    static std::string encodeEntry(EntryType type, uint64_t ballot, uint64_t slot, const std::string& value) {
+        std::string entry;
+        putFixed32(entry, 0);
+        entry.push_back(static_cast<char>(type));
+        putFixed64(entry, ballot);
+        putFixed64(entry, slot);
+        putFixed32(entry, static_cast<uint32_t>(value.size()));
+        entry.append(value);
+        uint32_t crc = crc32c(entry.data() + 4, entry.size() - 4);
+        for (int i = 0; i < 4; ++i) {
+            entry[i] = static_cast<char>((crc >> (8 * i)) & 0xff);
+        }
+        return entry;
+    }
+
+    // Appends and syncs `entries`. Caller holds mutex. A partial write is cut off again, so the next entry
+    // does not follow torn bytes.
+    bool write(const std::string& entries) {
+        if (!writeFully(fd, entries.data(), entries.size()) || ::fdatasync(fd) != 0) {
+            std::cerr << "Error: Cannot write " << path << std::endl;
+            if (::ftruncate(fd, static_cast<off_t>(logBytes)) != 0 ||
+                ::lseek(fd, static_cast<off_t>(logBytes), SEEK_SET) == -1) {
+                std::cerr << "Error: Cannot truncate " << path << std::endl;
+            }
+            return false;
+        }
+        logBytes += entries.size();
+        return true;
+    }
+
+    // Replaces the log by one holding only what is still needed. Caller holds mutex.
+    void rewrite() {
+        std::string contents = encodeEntry(EntryType::Promise, promisedBallot, 0, std::string()) +
+                               encodeEntry(EntryType::Applied, 0, appliedUpTo, std::string()) +
+                               encodeEntry(EntryType::Trimmed, 0, trimmedBelowSlot, std::string());
+        for (const auto& [slot, value] : accepted) {
+            contents += encodeEntry(EntryType::Accept, value.ballot, slot, value.value);
+        }
+
+        std::string tmpPath = path + ".tmp";
+        int tmpFd = ::open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        bool ok = tmpFd != -1 && writeFully(tmpFd, contents.data(), contents.size()) && ::fdatasync(tmpFd) == 0;
+        if (!ok || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+            std::cerr << "Error: Cannot rewrite " << path << std::endl;
+            if (tmpFd != -1) {
+                ::close(tmpFd);
+            }
+            ::unlink(tmpPath.c_str());
+            return;
+        }
+        ::close(fd);
+        fd = tmpFd;
+        logBytes = contents.size();
+    }
+
+    std::string path;
+    int fd = -1;
+
+    mutable std::mutex mutex; // Guards everything below, and orders appends
+    uint64_t promisedBallot = 0;
+    uint64_t appliedUpTo = 1; // Slots start at 1
+    uint64_t trimmedBelowSlot = 1;
+    std::map<uint64_t, AcceptedValue> accepted;
+    uint64_t logBytes = 0;
+    uint64_t liveBytes = 0; // What a rewritten log would take for `accepted`
+};
+
+/*
+**Multi-Paxos**
+*/
+
+struct PaxosOptions {
+    std::chrono::milliseconds heartbeatInterval{100};
+    // Randomised between this and twice this. A leader that has not heard from a majority for this long steps down.
+    std::chrono::milliseconds electionTimeout{1000};
+    std::chrono::milliseconds retryInterval{500}; // Before a round without a majority is sent again
+    size_t maxCatchUpSlots = 256;                 // Commits sent to a lagging follower ahead of what it applied
+    uint64_t maxKeptSlots = 100000;               // Applied slots kept for a follower that is down or far behind
+    uint64_t snapshotWindowBytes = 4u << 20;      // Snapshot bytes sent to a follower ahead of what it confirmed
+};
+
+struct PaxosMetrics {
+    bool leader = false;
+    uint64_t ballot = 0;
+    uint64_t firstUnapplied = 0;
+    uint64_t elections = 0;
+    uint64_t stepDowns = 0; // Times this replica stopped leading, superseded or without a majority
+    uint64_t chosen = 0;
+    uint64_t retries = 0; // Phase-2 rounds sent again for lack of a majority
+    uint64_t snapshotsInstalled = 0;
+};
+
+// How a follower gets the state of slots every acceptor has already forgotten: the leader serves a snapshot of
+// its applied state in chunks, and the follower installs it instead of applying those slots one by one
+struct PaxosCheckpoint {
+    // Leader: a snapshot that covers every slot up to `info.sequence`, which must be at least `minSlot`
+    std::function<bool(uint64_t minSlot, SnapshotInfo& info)> current;
+    // Leader: up to `maxBytes` of the snapshot at `path` from `offset` on
+    std::function<bool(const std::string& path, uint64_t offset, uint64_t maxBytes, std::string& chunk)> read;
+    // Follower: brings the applied state up to `throughSlot` from the snapshot file at `path`
+    std::function<bool(const std::string& path, uint64_t throughSlot)> install;
+};
+
+enum class ProposalOutcome {
+    Applied,  // Chosen and applied here
+    Rejected, // Never proposed, since this replica is not the leader
+    Unknown   // Leadership was lost while it was pending; it may still be chosen under the next leader
+};
+
+class MultiPaxos {
+public:
+    // Called with every chosen value in slot order, a no-op as an empty value. Returns false if the value could
+    // not be applied; nothing after it is applied until it is, and it is offered again on the next tick. A crash
+    // between applying and logging that it was applied offers the last values again, so slots that were
+    // already applied have to be recognised and skipped.
+    using Apply = std::function<bool(uint64_t slot, const std::string& value)>;
+    // Called once with the outcome of a proposal, and the slot it was applied at
+    using Completion = std::function<void(ProposalOutcome outcome, uint64_t slot)>;
+
+    // `nodeId` must be unique among the replicas and below 256; `peers` are the other replicas
+    MultiPaxos(uint32_t nodeId, const std::vector<Endpoint>& peers, const std::string& acceptorLog, Apply apply,
+               PaxosCheckpoint checkpoint = {}, PaxosOptions options = {})
+        : nodeId(nodeId & kNodeMask), acceptor(acceptorLog), snapshotPath(acceptorLog + ".snapshot"),
+          apply(std::move(apply)), checkpoint(std::move(checkpoint)), options(options), random(std::random_device{}()),
+          peerStates(peers.size()) {
+        ConnectionPoolOptions poolOptions;
+        poolOptions.connectionsPerEndpoint = 1;
+        for (const auto& peer : peers) {
+            this->peers.push_back(std::make_unique<ConnectionPool>(std::vector<Endpoint>{peer}, poolOptions));
+        }
+    }
+
+    ~MultiPaxos() { stop(); }
+
+    MultiPaxos(const MultiPaxos&) = delete;
+    MultiPaxos& operator=(const MultiPaxos&) = delete;
+
+    bool start() {
+        if (!acceptor.open()) {
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            firstUnapplied = acceptor.firstUnapplied();
+            highestBallot = acceptor.promised();
+            lastHeard = Clock::now();
+            electionDeadline = lastHeard + randomElectionTimeout();
+            stopping = false;
+        }
+        for (auto& peer : peers) {
+            peer->start(); // Unreachable peers are retried by the pool
+        }
+        ticker = std::thread([this] { tickLoop(); });
+        snapshotSender = std::thread([this] { snapshotLoop(); });
+        return true;
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        tick.notify_all();
+        snapshotWanted.notify_all();
+        if (ticker.joinable()) {
+            ticker.join();
+        }
+        if (snapshotSender.joinable()) {
+            snapshotSender.join();
+        }
+        for (auto& peer : peers) {
+            peer->stop();
+        }
+        failProposals();
+    }
+
+    // Replicates `value`. Only the leader takes proposals; elsewhere `done` gets Rejected at once and the caller
+    // should go to leaderId(). A proposal the leader loses track of when it steps down gets Unknown: the value
+    // may still be chosen, so a caller that retries elsewhere has to be able to recognise a duplicate.
+    void propose(const std::string& value, Completion done) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!leader) {
+            lock.unlock();
+            done(ProposalOutcome::Rejected, 0);
+            return;
+        }
+        uint64_t slot = nextSlot++;
+        startRound(lock, slot, value, std::move(done));
+    }
+
+    bool isLeader() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return leader;
+    }
+
+    // The replica whose ballot is the highest seen, which is the leader unless an election is under way
+    uint32_t leaderId() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return static_cast<uint32_t>(highestBallot & kNodeMask);
+    }
+
+    // Answers a message from another replica. Anything that is not a Paxos message, such as a pool's ping, gets
+    // an empty answer.
+    std::string handle(const std::string& message) {
+        if (message.size() < kMessageHeaderSize) {
+            return std::string();
+        }
+        uint64_t ballot = getFixed64(message.data() + 1);
+        uint64_t slot = getFixed64(message.data() + 9);
+        std::string value = message.substr(kMessageHeaderSize);
+        switch (static_cast<MessageType>(message[0])) {
+        case MessageType::Prepare:
+            return onPrepare(ballot, slot);
+        case MessageType::Accept:
+            return onAccept(ballot, slot, value);
+        case MessageType::Commit:
+            learn(slot, std::move(value));
+            return encodeReply(true, ballot, 0);
+        case MessageType::Heartbeat:
+            return onHeartbeat(ballot, slot);
+        case MessageType::Snapshot:
+            return onSnapshotChunk(ballot, slot, value);
+        default:
+            return std::string();
+        }
+    }
+
+    PaxosMetrics metrics() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        PaxosMetrics result;
+        result.leader = leader;
+        result.ballot = ballot;
+        result.firstUnapplied = firstUnapplied;
+        result.elections = elections;
+        result.stepDowns = stepDowns;
+        result.chosen = chosenCount;
+        result.retries = retries;
+        result.snapshotsInstalled = snapshotsInstalled;
+        return result;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    enum class MessageType : uint8_t {
+        Prepare = 1,   // ballot, first slot asked about
+        Accept = 2,    // ballot, slot, value
+        Commit = 3,    // ballot, slot, chosen value
+        Heartbeat = 4, // ballot, slot below which acceptors may forget what they accepted
+        Snapshot = 5,  // ballot, last slot covered, then offset(8) + totalBytes(8) + a chunk of the snapshot
+    };
+
+    // type(1) + ballot(8) + slot(8), then the value
+    static constexpr size_t kMessageHeaderSize = 17;
+    // ok(1) + ballot(8) + slot(8). A promise carries the acceptor's trimmed slot in `slot`, then complete(1),
+    // count(4) and count times slot(8), ballot(8), length(4), value. A heartbeat reply carries the follower's
+    // first unapplied slot, then the snapshot it is receiving: last slot covered(8) + bytes received(8).
+    static constexpr size_t kReplyHeaderSize = 17;
+
+    // A ballot is a round number with the proposer's id in its low bits, so no two replicas share one
+    static constexpr uint64_t kNodeMask = 0xff;
+
+    // Chosen but not yet applied values wait here, as do recently applied ones a lagging follower may need
+    static constexpr size_t kChosenKept = 65536;
+
+    // Accepted values a promise reports at most, so that it fits a frame
+    static constexpr size_t kMaxPromiseBytes = kMaxFrameSize / 2;
+
+    static constexpr uint64_t kSnapshotChunkBytes = 1u << 20;
+
+    // Election timeouts a replica waits after giving up an election for being behind
+    static constexpr int kBehindBackoff = 10;
+
+    struct Round {
+        std::string value;
+        size_t acceptances = 0;
+        Clock::time_point sentAt;
+        uint64_t attempt = 0; // Replies from earlier attempts are ignored
+        Completion done;
+    };
+
+    struct Campaign {
+        uint64_t ballot = 0;
+        uint64_t fromSlot = 0;
+        size_t promises = 0;
+        size_t replies = 0;
+        std::map<uint64_t, AcceptedValue> accepted; // Highest-ballot value per slot among the promises
+        bool finished = false;
+    };
+
+    // What the leader knows about a follower
+    struct PeerState {
+        Clock::time_point answeredAt; // Last heartbeat it accepted
+        uint64_t firstUnapplied = 1;
+        // Commit catch-up: the last slot sent to it, and when it last made progress on what was outstanding
+        uint64_t commitsSentThrough = 0;
+        Clock::time_point commitsSentAt;
+        // Snapshot catch-up: what it reported receiving, and what was sent to it since
+        bool snapshotWanted = false;
+        uint64_t receivingThrough = 0;
+        uint64_t received = 0;
+        uint64_t sentThrough = 0;
+        uint64_t sentBytes = 0;
+        Clock::time_point sentAt;
+        SnapshotInfo sending; // Held until the follower moved past it, so a rebuild does not restart the transfer
+    };
+
+    // The snapshot a follower is receiving. Guarded by snapshotMutex.
+    struct IncomingSnapshot {
+        int fd = -1;
+        uint64_t through = 0;
+        uint64_t totalBytes = 0;
+        uint64_t received = 0;
+    };
+
+    size_t majority() const { return (peers.size() + 1) / 2 + 1; }
+
+    std::chrono::milliseconds randomElectionTimeout() {
+        std::uniform_int_distribution<int64_t> timeout(options.electionTimeout.count(),
+                                                       2 * options.electionTimeout.count());
+        return std::chrono::milliseconds(timeout(random));
+    }
+
+    static std::string encodeMessage(MessageType type, uint64_t ballot, uint64_t slot, const std::string& value) {
+        std::string message;
+        message.reserve(kMessageHeaderSize + value.size());
+        message.push_back(static_cast<char>(type));
+        putFixed64(message, ballot);
+        putFixed64(message, slot);
+        message.append(value);
+        return message;
+    }
+
+    static std::string encodeReply(bool ok, uint64_t ballot, uint64_t slot) {
+        std::string reply;
+        reply.push_back(ok ? 1 : 0);
+        putFixed64(reply, ballot);
+        putFixed64(reply, slot);
+        return reply;
+    }
+
+    // Sends `message` to every peer; `done` runs once per peer with its reply, or ok = false
+    void broadcast(const std::string& message, const std::function<void(bool ok, const std::string& reply)>& done) {
+        for (auto& peer : peers) {
+            peer->submit(message, [done](bool ok, const std::string& reply) {
+                done(ok && reply.size() >= kReplyHeaderSize, reply);
+            });
+        }
+    }
+
+    /*
+    Acceptor and learner side
+    */
+
+    std::string onPrepare(uint64_t ballot, uint64_t fromSlot) {
+        uint64_t promised = 0;
+        std::map<uint64_t, AcceptedValue> reported;
+        bool complete = true;
+        bool ok = acceptor.prepare(ballot, fromSlot, kMaxPromiseBytes, promised, reported, complete);
+        noteBallot(promised);
+        if (ok) {
+            postponeElection(); // Give the candidate time to collect the rest of its promises
+        }
+
+        std::string reply = encodeReply(ok, promised, acceptor.trimmedBelow());
+        reply.push_back(complete ? 1 : 0);
+        putFixed32(reply, static_cast<uint32_t>(reported.size()));
+        for (const auto& [slot, accepted] : reported) {
+            putFixed64(reply, slot);
+            putFixed64(reply, accepted.ballot);
+            putFixed32(reply, static_cast<uint32_t>(accepted.value.size()));
+            reply.append(accepted.value);
+        }
+        return reply;
+    }
+
+    std::string onAccept(uint64_t ballot, uint64_t slot, const std::string& value) {
+        uint64_t promised = 0;
+        bool ok = acceptor.accept(ballot, slot, value, promised);
+        noteBallot(promised);
+        if (ok) {
+            heardFromLeader(ballot);
+        }
+        return encodeReply(ok, promised, slot);
+    }
+
+    std::string onHeartbeat(uint64_t ballot, uint64_t trimBelow) {
+        uint64_t promised = acceptor.promised();
+        bool ok = ballot >= promised;
+        if (ok) {
+            noteBallot(ballot);
+            heardFromLeader(ballot);
+            acceptor.trim(trimBelow); // Never past what this replica applied itself
+        }
+        uint64_t unapplied;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            unapplied = firstUnapplied;
+        }
+        std::string reply = encodeReply(ok, ok ? ballot : promised, unapplied);
+        putFixed64(reply, receivingThrough.load(std::memory_order_relaxed));
+        putFixed64(reply, receivingBytes.load(std::memory_order_relaxed));
+        return reply;
+    }
+
+    // Another replica holds a higher ballot: whatever this one was leading or campaigning for is over, and it
+    // leaves that replica time to win its election before starting one of its own
+    void noteBallot(uint64_t seen) {
+        std::vector<Completion> pending;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (seen <= highestBallot) {
+                return;
+            }
+            highestBallot = seen;
+            electionDeadline = std::max(electionDeadline, Clock::now() + randomElectionTimeout());
+            if (leader && seen > ballot) {
+                std::cerr << "Error: Ballot " << ballot << " superseded by " << seen << ", stepping down" << std::endl;
+                pending = stepDown();
+            }
+        }
+        for (auto& done : pending) {
+            done(ProposalOutcome::Unknown, 0);
+        }
+    }
+
+    void heardFromLeader(uint64_t leaderBallot) {
+        if ((leaderBallot & kNodeMask) != nodeId) {
+            postponeElection();
+        }
+    }
+
+    // Never brings an election forward, so a replica holding back for being behind keeps holding back
+    void postponeElection() {
+        std::lock_guard<std::mutex> lock(mutex);
+        lastHeard = Clock::now();
+        electionDeadline = std::max(electionDeadline, lastHeard + randomElectionTimeout());
+    }
+
+    // Records a chosen value and applies everything that is now contiguous, in slot order
+    void learn(uint64_t slot, std::string value) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (slot < firstUnapplied || chosen.count(slot) != 0) {
+                return;
+            }
+            if (chosen.size() >= kChosenKept && slot > firstUnapplied + kChosenKept) {
+                return; // Too far ahead; the leader resends it once the gap is filled
+            }
+            chosen.emplace(slot, std::move(value));
+            chosenCount++;
+        }
+        applyReady();
+    }
+
+    // Applies chosen values from the first unapplied slot on until there is a gap or a value fails to apply.
+    // firstUnapplied only moves past values that were applied.
+    void applyReady() {
+        std::lock_guard<std::mutex> applyLock(applyMutex); // Keeps concurrent learners from applying out of order
+        std::vector<std::pair<uint64_t, std::string>> applied;
+        std::vector<std::pair<Completion, uint64_t>> completed;
+        while (true) {
+            uint64_t slot;
+            std::string value;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto next = chosen.find(firstUnapplied);
+                if (next == chosen.end()) {
+                    break;
+                }
+                slot = next->first;
+                value = next->second;
+            }
+            if (!apply(slot, value)) {
+                std::cerr << "Error: Cannot apply slot " << slot << ", retrying on the next tick" << std::endl;
+                break;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            firstUnapplied = slot + 1;
+            auto waiting = completions.find(slot);
+            if (waiting != completions.end()) {
+                completed.emplace_back(std::move(waiting->second), slot);
+                completions.erase(waiting);
+            }
+            // Applied values are only kept for followers that may still ask for them
+            while (chosen.size() > kChosenKept && chosen.begin()->first < firstUnapplied) {
+                chosen.erase(chosen.begin());
+            }
+            applied.emplace_back(slot, std::move(value));
+        }
+
+        if (!applied.empty()) {
+            acceptor.markApplied(applied.back().first + 1, applied);
+        }
+        for (auto& [done, doneSlot] : completed) {
+            done(ProposalOutcome::Applied, doneSlot);
+        }
+    }
+
+    // Receives the snapshot the leader sends a follower whose missing slots are forgotten everywhere. Chunks
+    // arrive in order over one connection; one that does not continue where the last left off is dropped, and
+    // the leader resends from what the next heartbeat reply reports.
+    std::string onSnapshotChunk(uint64_t leaderBallot, uint64_t through, const std::string& payload) {
+        uint64_t promised = acceptor.promised();
+        if (leaderBallot < promised || payload.size() < 16) {
+            return encodeReply(false, promised, 0);
+        }
+        heardFromLeader(leaderBallot);
+        uint64_t offset = getFixed64(payload.data());
+        uint64_t totalBytes = getFixed64(payload.data() + 8);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (through < firstUnapplied) {
+                return encodeReply(true, leaderBallot, 0); // Has all of it already
+            }
+        }
+
+        bool complete = false;
+        {
+            std::lock_guard<std::mutex> lock(snapshotMutex);
+            if (incoming.fd != -1 && incoming.through == through && incoming.totalBytes != totalBytes) {
+                closeIncoming(); // Another file for the same slot, from a rebuild; reporting 0 has it sent over
+            }
+            if (offset == 0 && (incoming.fd == -1 || incoming.through != through)) {
+                closeIncoming();
+                incoming.fd = ::open(snapshotPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (incoming.fd == -1) {
+                    std::cerr << "Error: Cannot create " << snapshotPath << std::endl;
+                    return encodeReply(false, leaderBallot, 0);
+                }
+                incoming.through = through;
+                incoming.totalBytes = totalBytes;
+            }
+            if (incoming.fd == -1 || incoming.through != through || offset != incoming.received) {
+                return encodeReply(true, leaderBallot, 0);
+            }
+            if (!writeFully(incoming.fd, payload.data() + 16, payload.size() - 16)) {
+                std::cerr << "Error: Cannot write " << snapshotPath << std::endl;
+                closeIncoming();
+                return encodeReply(false, leaderBallot, 0);
+            }
+            incoming.received += payload.size() - 16;
+            receivingThrough.store(incoming.through, std::memory_order_relaxed);
+            receivingBytes.store(incoming.received, std::memory_order_relaxed);
+            if (incoming.received >= incoming.totalBytes) {
+                complete = ::fdatasync(incoming.fd) == 0 && incoming.received == incoming.totalBytes;
+                closeIncoming();
+            }
+        }
+        if (complete) {
+            installSnapshot(through);
+        }
+        return encodeReply(true, leaderBallot, 0);
+    }
+
+    // Caller holds snapshotMutex
+    void closeIncoming() {
+        if (incoming.fd != -1) {
+            ::close(incoming.fd);
+        }
+        incoming = IncomingSnapshot();
+        receivingThrough.store(0, std::memory_order_relaxed);
+        receivingBytes.store(0, std::memory_order_relaxed);
+    }
+
+    void installSnapshot(uint64_t through) {
+        std::vector<Completion> pending;
+        {
+            std::lock_guard<std::mutex> applyLock(applyMutex);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (through < firstUnapplied) {
+                    return;
+                }
+            }
+            if (!checkpoint.install || !checkpoint.install(snapshotPath, through) ||
+                !acceptor.installCheckpoint(through + 1)) {
+                std::cerr << "Error: Cannot install snapshot through slot " << through << std::endl;
+                return;
+            }
+            std::cerr << "Installed snapshot through slot " << through << std::endl;
+            std::lock_guard<std::mutex> lock(mutex);
+            firstUnapplied = through + 1;
+            chosen.erase(chosen.begin(), chosen.lower_bound(firstUnapplied));
+            for (auto it = completions.begin(); it != completions.end() && it->first <= through;) {
+                pending.push_back(std::move(it->second));
+                it = completions.erase(it);
+            }
+            snapshotsInstalled++;
+        }
+        ::unlink(snapshotPath.c_str());
+        for (auto& done : pending) {
+            done(ProposalOutcome::Unknown, 0);
+        }
+        applyReady(); // Chosen values right after the snapshot may be waiting
+    }
+
+    /*
+    Leader side
+    */
+
+    void campaign() {
+        auto state = std::make_shared<Campaign>();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            state->ballot = ((highestBallot >> 8) + 1) << 8 | nodeId;
+            highestBallot = state->ballot;
+            ballot = state->ballot;
+            campaignBallot = state->ballot;
+            state->fromSlot = firstUnapplied;
+            elections++;
+            electionDeadline = Clock::now() + randomElectionTimeout();
+        }
+        std::cerr << "Starting election with ballot " << state->ballot << " from slot " << state->fromSlot
+                  << std::endl;
+
+        uint64_t promised = 0;
+        std::map<uint64_t, AcceptedValue> reported;
+        bool complete = true;
+        if (acceptor.prepare(state->ballot, state->fromSlot, kMaxPromiseBytes, promised, reported, complete)) {
+            onPromise(state, true, !complete, reported);
+        } else {
+            noteBallot(promised);
+            return;
+        }
+
+        broadcast(encodeMessage(MessageType::Prepare, state->ballot, state->fromSlot, std::string()),
+                  [this, state](bool ok, const std::string& reply) {
+                      std::map<uint64_t, AcceptedValue> accepted;
+                      bool complete = true;
+                      bool promisedToUs = ok && reply[0] == 1 && decodePromise(reply, accepted, complete);
+                      if (ok && reply[0] != 1) {
+                          noteBallot(getFixed64(reply.data() + 1));
+                      }
+                      // Slots the acceptor forgot, or did not report, may hold chosen values this replica lacks
+                      bool behind = promisedToUs && (getFixed64(reply.data() + 9) > state->fromSlot || !complete);
+                      onPromise(state, promisedToUs, behind, accepted);
+                  });
+    }
+
+    static bool decodePromise(const std::string& reply, std::map<uint64_t, AcceptedValue>& accepted, bool& complete) {
+        if (reply.size() < kReplyHeaderSize + 5) {
+            return false;
+        }
+        complete = reply[kReplyHeaderSize] == 1;
+        uint32_t count = getFixed32(reply.data() + kReplyHeaderSize + 1);
+        size_t offset = kReplyHeaderSize + 5;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (offset + 20 > reply.size()) {
+                return false;
+            }
+            uint64_t slot = getFixed64(reply.data() + offset);
+            uint64_t ballot = getFixed64(reply.data() + offset + 8);
+            uint32_t length = getFixed32(reply.data() + offset + 16);
+            offset += 20;
+            if (offset + length > reply.size()) {
+                return false;
+            }
+            accepted[slot] = AcceptedValue{ballot, reply.substr(offset, length)};
+            offset += length;
+        }
+        return true;
+    }
+
+    // A replica too far behind to know every value that may have been chosen gives up its election, and waits
+    // for one that is not to win and catch it up
+    void onPromise(const std::shared_ptr<Campaign>& state, bool promised, bool behind,
+                   const std::map<uint64_t, AcceptedValue>& accepted) {
+        std::unique_lock<std::mutex> lock(mutex);
+        state->replies++;
+        if (state->finished || campaignBallot != state->ballot || highestBallot != state->ballot) {
+            return;
+        }
+        if (behind) {
+            // Its prepare deposed the leader all the same; it holds back long enough for another to be elected
+            // and catch it up rather than deposing that one too
+            state->finished = true;
+            electionDeadline = Clock::now() + kBehindBackoff * randomElectionTimeout();
+            std::cerr << "Error: Too far behind to lead from slot " << state->fromSlot << ", election abandoned"
+                      << std::endl;
+            return;
+        }
+        if (promised) {
+            state->promises++;
+            for (const auto& [slot, value] : accepted) {
+                AcceptedValue& best = state->accepted[slot];
+                if (value.ballot >= best.ballot) {
+                    best = value;
+                }
+            }
+        }
+        if (state->promises < majority()) {
+            return;
+        }
+
+        // Elected: finish whatever earlier leaders may have gotten chosen, then take new proposals
+        state->finished = true;
+        leader = true;
+        Clock::time_point now = Clock::now();
+        for (auto& peer : peerStates) {
+            peer = PeerState();
+            peer.answeredAt = now; // A full election timeout to answer before this leader gives up
+        }
+        nextSlot = std::max({firstUnapplied, state->accepted.empty() ? 0 : state->accepted.rbegin()->first + 1,
+                             chosen.empty() ? 0 : chosen.rbegin()->first + 1});
+        std::cerr << "Elected leader with ballot " << ballot << ", proposals from slot " << nextSlot << std::endl;
+        for (uint64_t slot = firstUnapplied; slot < nextSlot; ++slot) {
+            if (chosen.count(slot) != 0) {
+                continue;
+            }
+            auto previous = state->accepted.find(slot);
+            startRound(lock, slot, previous != state->accepted.end() ? previous->second.value : std::string(), nullptr);
+            lock.lock();
+            if (!leader) {
+                return;
+            }
+        }
+        lock.unlock();
+        sendHeartbeats();
+    }
+
+    // Phase 2 for one slot. Called with `lock` held; returns with it released.
+    void startRound(std::unique_lock<std::mutex>& lock, uint64_t slot, const std::string& value, Completion done) {
+        Round& round = rounds[slot];
+        round.value = value;
+        round.acceptances = 0;
+        round.sentAt = Clock::now();
+        round.attempt++;
+        if (done) {
+            completions[slot] = std::move(done);
+        }
+        uint64_t roundBallot = ballot;
+        uint64_t attempt = round.attempt;
+        lock.unlock();
+
+        uint64_t promised = 0;
+        if (acceptor.accept(roundBallot, slot, value, promised)) {
+            onAccepted(slot, roundBallot, attempt);
+        } else {
+            noteBallot(promised);
+            return;
+        }
+        broadcast(encodeMessage(MessageType::Accept, roundBallot, slot, value),
+                  [this, slot, roundBallot, attempt](bool ok, const std::string& reply) {
+                      if (!ok) {
+                          return; // Retried by the ticker if no majority comes together
+                      }
+                      if (reply[0] == 1) {
+                          onAccepted(slot, roundBallot, attempt);
+                      } else {
+                          noteBallot(getFixed64(reply.data() + 1));
+                      }
+                  });
+    }
+
+    void onAccepted(uint64_t slot, uint64_t roundBallot, uint64_t attempt) {
+        std::string value;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto round = rounds.find(slot);
+            if (!leader || ballot != roundBallot || round == rounds.end() || round->second.attempt != attempt ||
+                ++round->second.acceptances != majority()) {
+                return;
+            }
+            value = std::move(round->second.value);
+            rounds.erase(round);
+        }
+
+        // Chosen: tell the followers, then apply locally
+        broadcast(encodeMessage(MessageType::Commit, roundBallot, slot, value), [](bool, const std::string&) {});
+        learn(slot, std::move(value));
+    }
+
+    // Heartbeats also tell acceptors what they may forget: everything below the slot every replica applied,
+    // unless that is more than `maxKeptSlots` back, in which case the laggard gets a snapshot
+    void sendHeartbeats() {
+        uint64_t heartbeatBallot;
+        uint64_t trimBelow;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!leader) {
+                return;
+            }
+            heartbeatBallot = ballot;
+            trimBelow = firstUnapplied;
+            for (const auto& peer : peerStates) {
+                trimBelow = std::min(trimBelow, peer.firstUnapplied);
+            }
+            if (firstUnapplied > options.maxKeptSlots) {
+                trimBelow = std::max(trimBelow, firstUnapplied - options.maxKeptSlots);
+            }
+        }
+        acceptor.trim(trimBelow);
+
+        std::string message = encodeMessage(MessageType::Heartbeat, heartbeatBallot, trimBelow, std::string());
+        for (size_t i = 0; i < peers.size(); ++i) {
+            peers[i]->submit(message, [this, i](bool ok, const std::string& reply) {
+                if (!ok || reply.size() < kReplyHeaderSize) {
+                    return;
+                }
+                if (reply[0] != 1) {
+                    noteBallot(getFixed64(reply.data() + 1));
+                    return;
+                }
+                uint64_t receivingThrough = 0;
+                uint64_t received = 0;
+                if (reply.size() >= kReplyHeaderSize + 16) {
+                    receivingThrough = getFixed64(reply.data() + kReplyHeaderSize);
+                    received = getFixed64(reply.data() + kReplyHeaderSize + 8);
+                }
+                catchUp(i, getFixed64(reply.data() + 9), receivingThrough, received);
+            });
+        }
+    }
+
+    // Follower `peer` accepted a heartbeat and reported `followerUnapplied` as its first unapplied slot. Sends it
+    // the commits it is missing, from memory or from the acceptor, at most `maxCatchUpSlots` ahead of that slot,
+    // or has the snapshot sender catch it up if those slots are forgotten. Commits already on their way are not
+    // sent again unless the follower made no progress on them within `retryInterval`.
+    void catchUp(size_t peer, uint64_t followerUnapplied, uint64_t receivingThrough, uint64_t received) {
+        std::vector<std::string> messages;
+        bool needsSnapshot = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            PeerState& state = peerStates[peer];
+            Clock::time_point now = Clock::now();
+            bool progressed = followerUnapplied > state.firstUnapplied;
+            state.answeredAt = now;
+            state.firstUnapplied = followerUnapplied;
+            if (!leader) {
+                return;
+            }
+            if (!state.sending.path.empty() && followerUnapplied > state.sending.sequence) {
+                state.sending = SnapshotInfo(); // Installed; the file may go once the checkpoint replaced it
+            }
+
+            uint64_t from = followerUnapplied;
+            if (state.commitsSentThrough >= followerUnapplied) {
+                if (progressed) {
+                    state.commitsSentAt = now;
+                }
+                if (now - state.commitsSentAt < options.retryInterval) {
+                    from = state.commitsSentThrough + 1;
+                }
+            }
+            uint64_t end = std::min(firstUnapplied, followerUnapplied + options.maxCatchUpSlots);
+            for (uint64_t slot = from; slot < end; ++slot) {
+                std::string value;
+                auto kept = chosen.find(slot);
+                if (kept != chosen.end()) {
+                    value = kept->second;
+                } else if (!acceptor.chosenValue(slot, value)) {
+                    needsSnapshot = messages.empty();
+                    break;
+                }
+                messages.push_back(encodeMessage(MessageType::Commit, ballot, slot, value));
+            }
+            if (!messages.empty()) {
+                if (from == followerUnapplied) {
+                    state.commitsSentAt = now; // Progress is measured from the first send of what is outstanding
+                }
+                state.commitsSentThrough = from + messages.size() - 1;
+            }
+            if (needsSnapshot) {
+                state.snapshotWanted = true;
+                state.receivingThrough = receivingThrough;
+                state.received = received;
+            }
+        }
+        if (needsSnapshot) {
+            snapshotWanted.notify_one();
+        }
+        for (const auto& message : messages) {
+            peers[peer]->submit(message, [](bool, const std::string&) {});
+        }
+    }
+
+    // Snapshot sender thread. Building a snapshot can take a while, so it is kept off the ticker and off the
+    // pools' reader threads.
+    void snapshotLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            snapshotWanted.wait(lock, [&] {
+                return stopping || std::any_of(peerStates.begin(), peerStates.end(),
+                                               [](const PeerState& peer) { return peer.snapshotWanted; });
+            });
+            if (stopping) {
+                return;
+            }
+            for (size_t i = 0; i < peerStates.size(); ++i) {
+                if (peerStates[i].snapshotWanted) {
+                    peerStates[i].snapshotWanted = false;
+                    lock.unlock();
+                    sendSnapshot(i);
+                    lock.lock();
+                }
+            }
+        }
+    }
+
+    // Sends the follower the next chunks of the current snapshot, at most `snapshotWindowBytes` ahead of what it
+    // confirmed. Chunks already on their way are not sent again unless the follower made no progress on them
+    // within `retryInterval`.
+    void sendSnapshot(size_t peer) {
+        if (!checkpoint.current || !checkpoint.read) {
+            std::cerr << "Error: A follower needs a snapshot, but there is no checkpoint to send" << std::endl;
+            return;
+        }
+        // The follower carries on from the slot after the snapshot, which has to be one that is still kept. The
+        // snapshot it is already receiving is finished unless that no longer holds, even if a newer one exists.
+        uint64_t minSlot = acceptor.trimmedBelow() - 1;
+        SnapshotInfo info;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (peerStates[peer].sending.sequence >= minSlot) {
+                info = peerStates[peer].sending;
+            }
+        }
+        if (info.path.empty() && !checkpoint.current(minSlot, info)) {
+            return;
+        }
+
+        uint64_t sendBallot;
+        uint64_t offset;
+        uint64_t end;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!leader) {
+                return;
+            }
+            PeerState& state = peerStates[peer];
+            Clock::time_point now = Clock::now();
+            uint64_t confirmed = state.receivingThrough == info.sequence ? state.received : 0;
+            offset = confirmed;
+            if (state.sentThrough == info.sequence && state.sentBytes > confirmed &&
+                now - state.sentAt < options.retryInterval) {
+                offset = state.sentBytes;
+            }
+            end = std::min(info.bytes, confirmed + options.snapshotWindowBytes);
+            if (offset >= end) {
+                return;
+            }
+            if (offset == confirmed) {
+                state.sentAt = now; // Progress is measured from the first send of what is outstanding
+            }
+            state.sentThrough = info.sequence;
+            state.sentBytes = end;
+            state.sending = info;
+            sendBallot = ballot;
+        }
+
+        std::string header;
+        while (offset < end) {
+            std::string chunk;
+            if (!checkpoint.read(info.path, offset, std::min(kSnapshotChunkBytes, end - offset), chunk) ||
+                chunk.empty()) {
+                std::lock_guard<std::mutex> lock(mutex);
+                peerStates[peer].sentBytes = offset; // Gone; the next heartbeat starts over from a current one
+                peerStates[peer].sending = SnapshotInfo();
+                return;
+            }
+            header.clear();
+            putFixed64(header, offset);
+            putFixed64(header, info.bytes);
+            peers[peer]->submit(encodeMessage(MessageType::Snapshot, sendBallot, info.sequence, header + chunk),
+                                [](bool, const std::string&) {});
+            offset += chunk.size();
+        }
+    }
+
+    // Sends phase 2 again for rounds that have not reached a majority within `retryInterval`
+    void retryRounds() {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!leader) {
+            return;
+        }
+        Clock::time_point now = Clock::now();
+        std::vector<std::pair<uint64_t, std::string>> stale;
+        for (const auto& [slot, round] : rounds) {
+            if (now - round.sentAt > options.retryInterval) {
+                stale.emplace_back(slot, round.value);
+            }
+        }
+        for (const auto& [slot, value] : stale) {
+            retries++;
+            startRound(lock, slot, value, nullptr);
+            lock.lock();
+            if (!leader) {
+                return;
+            }
+        }
+    }
+
+    // A leader cut off from a majority cannot get anything chosen, and a majority elsewhere may already have
+    // elected another, so it stops taking proposals after an election timeout without hearing from one
+    void checkQuorum() {
+        std::vector<Completion> pending;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!leader) {
+                return;
+            }
+            Clock::time_point now = Clock::now();
+            size_t answering = 1; // This replica
+            for (const auto& peer : peerStates) {
+                if (now - peer.answeredAt <= options.electionTimeout) {
+                    answering++;
+                }
+            }
+            if (answering >= majority()) {
+                return;
+            }
+            std::cerr << "Error: No majority answered within the election timeout, stepping down" << std::endl;
+            pending = stepDown();
+        }
+        for (auto& done : pending) {
+            done(ProposalOutcome::Unknown, 0);
+        }
+    }
+
+    // Caller holds mutex. Pending proposals are handed back for the caller to complete as Unknown once it let
+    // go of the lock: values already accepted somewhere may yet be chosen under the next leader.
+    std::vector<Completion> stepDown() {
+        leader = false;
+        stepDowns++;
+        electionDeadline = Clock::now() + randomElectionTimeout();
+        std::vector<Completion> pending;
+        for (auto& [slot, done] : completions) {
+            pending.push_back(std::move(done));
+        }
+        completions.clear();
+        rounds.clear();
+        for (auto& peer : peerStates) {
+            peer.sending = SnapshotInfo(); // Lets go of snapshots only a leader sends
+        }
+        return pending;
+    }
+
+    void failProposals() {
+        std::vector<Completion> pending;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (leader) {
+                pending = stepDown();
+            }
+        }
+        for (auto& done : pending) {
+            done(ProposalOutcome::Unknown, 0);
+        }
+    }
+
+    void tickLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            tick.wait_for(lock, options.heartbeatInterval, [&] { return stopping; });
+            if (stopping) {
+                return;
+            }
+            bool leading = leader;
+            bool electionDue = !leader && Clock::now() >= electionDeadline;
+            lock.unlock();
+            applyReady(); // Retries a value that failed to apply
+            if (leading) {
+                checkQuorum();
+                sendHeartbeats();
+                retryRounds();
+            } else if (electionDue) {
+                campaign();
+            }
+            lock.lock();
+        }
+    }
+
+    uint32_t nodeId;
+    PaxosAcceptor acceptor;
+    std::string snapshotPath; // Where a follower receives a snapshot
+    Apply apply;
+    PaxosCheckpoint checkpoint;
+    PaxosOptions options;
+    std::vector<std::unique_ptr<ConnectionPool>> peers;
+
+    std::thread ticker;
+    std::thread snapshotSender;
+    std::condition_variable tick;
+    std::condition_variable snapshotWanted;
+    std::mutex applyMutex; // Held while applying, outside `mutex`
+
+    std::mutex snapshotMutex; // Guards `incoming`
+    IncomingSnapshot incoming;
+    std::atomic<uint64_t> receivingThrough{0}; // Copies of `incoming` for heartbeat replies
+    std::atomic<uint64_t> receivingBytes{0};
+
+    mutable std::mutex mutex; // Guards everything below
+    std::minstd_rand random;  // For election timeouts
+    bool stopping = false;
+    bool leader = false;
+    uint64_t ballot = 0;         // This replica's current ballot, as leader or candidate
+    uint64_t campaignBallot = 0; // Ballot of the latest election this replica started
+    uint64_t highestBallot = 0;  // Highest ballot seen anywhere
+    uint64_t nextSlot = 1;       // Next slot the leader hands out
+    uint64_t firstUnapplied = 1;
+    Clock::time_point lastHeard;
+    Clock::time_point electionDeadline;
+    std::vector<PeerState> peerStates;           // Same order as `peers`; only meaningful while leading
+    std::map<uint64_t, Round> rounds;            // Phase 2 under way
+    std::map<uint64_t, Completion> completions;  // Proposals waiting to be applied
+    std::map<uint64_t, std::string> chosen;      // Chosen values, applied or waiting for a gap to fill
+    uint64_t elections = 0;
+    uint64_t stepDowns = 0;
+    uint64_t chosenCount = 0;
+    uint64_t retries = 0;
+    uint64_t snapshotsInstalled = 0;
+};
+
+#endif // PDN_CONSENSUS_H
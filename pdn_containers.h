@@ -0,0 +1,778 @@
+#ifndef PDN_CONTAINERS_H
+#define PDN_CONTAINERS_H
+
+/*
+In-memory containers used by the transaction store. They are tuned for the way the store uses them: many
+ingest threads appending to many different keys, and readers looking up one key's history at a time.
+
+1.  **Concurrent Hash Map**: Keys are spread over independent shards by the high bits of their hash. Each
+shard is an open-addressing table with linear probing and its own lock, so threads that touch different
+shards never contend. Every slot stores the key's precomputed 64-bit hash next to the key, and probes compare
+hashes before they ever compare strings.
+2.  **Arena**: Payload bytes are copied into large chunks with a bump pointer and referred to by a small
+(chunk, offset, length) handle instead of a heap-allocated std::string per transaction. Allocation is one
+atomic add in the common case and a malloc only once per chunk. Memory is never freed piecemeal: the whole
+arena, and with it every chunk, is released at once when the data it holds leaves memory. An arena that has
+used up its kMaxChunks chunks hands out failed handles, and its owner moves on to a fresh one.
+3.  **MPSC Ring**: A bounded multi-producer, single-consumer queue. Producers claim a slot with one
+compare-and-swap on the tail and publish it through that slot's own sequence counter, so they never wait for
+each other or for a lock. The consumer drains whatever is ready in one batch.
+4.  **Epoch-Based Reclamation**: Structures that readers walk without locks, such as the list of segments, are
+replaced rather than modified: a writer publishes a new version through an atomic pointer and retires the old
+one. A retired object is only freed once every reader that might still be looking at it has left its read
+section, which readers announce by entering and leaving an epoch. Reading costs two stores to a slot of the
+reader's own, never a lock or a shared counter.
+5.  **Small History**: Most keys only ever see a transaction or two, so a key's history keeps its first entries
+inside the object itself, with no allocation at all. Only when it outgrows that does it move to a chain of
+chunks carved from the same arena as the payloads, each twice the size of the one before, so a long history
+costs a handful of bump allocations and is released together with the arena.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Heap bytes owned by a string: nothing while it fits in the small-string buffer, otherwise its allocation
+inline size_t stringHeapBytes(const std::string& value) {
+    const char* data = value.data();
+    const char* self = reinterpret_cast<const char*>(&value);
+    bool isInline = data >= self && data < self + sizeof(value);
+    return isInline ? 0 : value.capacity() + 1;
+}
+
+/*
+**Concurrent Hash Map**
+*/
+
+template <typename Value>
+class ConcurrentHashMap {
+public:
+    explicit ConcurrentHashMap(size_t shardCount = 64, size_t initialSlotsPerShard = 16) {
+        size_t count = 1;
+        while (count < shardCount) {
+            count <<= 1;
+        }
+        shards = std::vector<Shard>(count);
+        shardBits = 0;
+        while ((size_t(1) << shardBits) < count) {
+            shardBits++;
+        }
+
+        size_t slots = 8;
+        while (slots < initialSlotsPerShard) {
+            slots <<= 1;
+        }
+        for (auto& shard : shards) {
+            shard.slots.resize(slots);
+        }
+        tableBytes.store(sizeof(Shard) * shards.size() + sizeof(Slot) * slots * shards.size(), std::memory_order_relaxed);
+    }
+
+    ConcurrentHashMap(const ConcurrentHashMap&) = delete;
+    ConcurrentHashMap& operator=(const ConcurrentHashMap&) = delete;
+
+    // Calls fn(Value&) under the shard lock, inserting a default-constructed Value first if `key` is new.
+    // `hash` must be hashKey(key); callers usually have it already.
+    template <typename Fn>
+    void upsert(const std::string& key, uint64_t hash, Fn&& fn) {
+        Shard& shard = shardFor(hash);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if ((shard.count + 1) * 4 > shard.slots.size() * 3) {
+            grow(shard);
+        }
+
+        size_t index = probe(shard, key, hash);
+        Slot& slot = shard.slots[index];
+        if (!slot.occupied) {
+            slot.occupied = true;
+            slot.hash = hash;
+            slot.key = key;
+            slot.value = Value();
+            shard.count++;
+            tableBytes.fetch_add(stringHeapBytes(slot.key), std::memory_order_relaxed);
+        }
+        fn(slot.value);
+    }
+
+    // Calls fn(const Value&) under the shard lock if `key` is present. Returns whether it was.
+    template <typename Fn>
+    bool find(const std::string& key, uint64_t hash, Fn&& fn) const {
+        const Shard& shard = shardFor(hash);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        const Slot& slot = shard.slots[probe(shard, key, hash)];
+        if (!slot.occupied) {
+            return false;
+        }
+        fn(slot.value);
+        return true;
+    }
+
+    bool erase(const std::string& key, uint64_t hash) {
+        Shard& shard = shardFor(hash);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        size_t index = probe(shard, key, hash);
+        if (!shard.slots[index].occupied) {
+            return false;
+        }
+
+        tableBytes.fetch_sub(stringHeapBytes(shard.slots[index].key), std::memory_order_relaxed);
+
+        // Backward-shift deletion: pull later entries of the probe chain into the hole so no tombstones are needed
+        size_t mask = shard.slots.size() - 1;
+        size_t hole = index;
+        for (size_t next = (hole + 1) & mask; shard.slots[next].occupied; next = (next + 1) & mask) {
+            size_t home = homeSlot(shard, shard.slots[next].hash);
+            if (((next - home) & mask) >= ((next - hole) & mask)) {
+                shard.slots[hole] = std::move(shard.slots[next]);
+                hole = next;
+            }
+        }
+        shard.slots[hole] = Slot();
+        shard.count--;
+        return true;
+    }
+
+    // Visits every entry, one shard at a time. Entries added concurrently may or may not be seen.
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        for (const auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (const auto& slot : shard.slots) {
+                if (slot.occupied) {
+                    fn(slot.key, slot.value);
+                }
+            }
+        }
+    }
+
+    // Bytes of slot tables and out-of-line keys. Memory owned by the values is not included.
+    uint64_t memoryBytes() const { return tableBytes.load(std::memory_order_relaxed); }
+
+    size_t size() const {
+        size_t total = 0;
+        for (const auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total += shard.count;
+        }
+        return total;
+    }
+
+private:
+    struct Slot {
+        uint64_t hash = 0;
+        bool occupied = false;
+        std::string key;
+        Value value{};
+    };
+
+    // Padded to a cache line so neighbouring shard locks do not false-share
+    struct alignas(64) Shard {
+        mutable std::mutex mutex;
+        std::vector<Slot> slots;
+        size_t count = 0;
+    };
+
+    Shard& shardFor(uint64_t hash) {
+        return shards[shardBits == 0 ? 0 : hash >> (64 - shardBits)];
+    }
+
+    const Shard& shardFor(uint64_t hash) const {
+        return shards[shardBits == 0 ? 0 : hash >> (64 - shardBits)];
+    }
+
+    // The low bits pick the slot; the high bits already picked the shard
+    static size_t homeSlot(const Shard& shard, uint64_t hash) {
+        return static_cast<size_t>(hash) & (shard.slots.size() - 1);
+    }
+
+    // Index of the slot holding `key`, or of the empty slot where it would go
+    static size_t probe(const Shard& shard, const std::string& key, uint64_t hash) {
+        size_t mask = shard.slots.size() - 1;
+        for (size_t index = homeSlot(shard, hash);; index = (index + 1) & mask) {
+            const Slot& slot = shard.slots[index];
+            if (!slot.occupied || (slot.hash == hash && slot.key == key)) {
+                return index;
+            }
+        }
+    }
+
+    void grow(Shard& shard) {
+        tableBytes.fetch_add(sizeof(Slot) * shard.slots.size(), std::memory_order_relaxed);
+        std::vector<Slot> old(shard.slots.size() * 2);
+        old.swap(shard.slots);
+        for (auto& slot : old) {
+            if (slot.occupied) {
+                size_t mask = shard.slots.size() - 1;
+                size_t index = homeSlot(shard, slot.hash);
+                while (shard.slots[index].occupied) {
+                    index = (index + 1) & mask;
+                }
+                shard.slots[index] = std::move(slot);
+            }
+        }
+    }
+
+    std::vector<Shard> shards;
+    unsigned shardBits = 0;
+    std::atomic<uint64_t> tableBytes{0};
+};
+
+/*
+**Arena**
+*/
+
+class Arena {
+public:
+    struct Handle {
+        uint32_t chunk = 0;
+        uint32_t offset = 0;
+        uint32_t length = 0;
+
+        // Returned once the arena has no room for another chunk; there is nothing to view
+        bool failed() const { return chunk == kNoChunk; }
+    };
+
+    // Upper bound on chunks per arena; at the default chunk size that is 4 GiB of payload
+    static constexpr size_t kMaxChunks = 4096;
+
+    static constexpr uint32_t kNoChunk = UINT32_MAX;
+
+    explicit Arena(size_t chunkBytes = 1u << 20) : chunkBytes(chunkBytes), directory(new std::atomic<Chunk*>[kMaxChunks]) {
+        for (size_t i = 0; i < kMaxChunks; ++i) {
+            directory[i].store(nullptr, std::memory_order_relaxed);
+        }
+        reserved.store(kMaxChunks * sizeof(std::atomic<Chunk*>), std::memory_order_relaxed);
+    }
+
+    ~Arena() {
+        for (size_t i = 0; i < chunkCount; ++i) {
+            delete directory[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // Copies `length` bytes into the arena. Safe to call from many threads at once.
+    Handle store(const char* data, size_t length) {
+        Handle handle;
+        if (char* out = claim(length, handle)) {
+            std::memcpy(out, data, length);
+        }
+        return handle;
+    }
+
+    Handle store(std::string_view bytes) { return store(bytes.data(), bytes.size()); }
+
+    // Copies `prefix` and then `bytes` under one handle, so a small header can be kept with its payload
+    Handle store(std::string_view prefix, std::string_view bytes) {
+        Handle handle;
+        if (char* out = claim(prefix.size() + bytes.size(), handle)) {
+            std::memcpy(out, prefix.data(), prefix.size());
+            std::memcpy(out + prefix.size(), bytes.data(), bytes.size());
+        }
+        return handle;
+    }
+
+    // Uninitialised memory for `length` bytes, aligned to `alignment` (a power of two), for structures that are
+    // built in place. It stays valid for the lifetime of the arena. Safe to call from many threads at once.
+    // Null once the arena has no room for another chunk.
+    void* allocate(size_t length, size_t alignment = alignof(std::max_align_t)) {
+        Handle handle;
+        char* claimed = claim(length + alignment - 1, handle);
+        if (claimed == nullptr) {
+            return nullptr;
+        }
+        auto address = reinterpret_cast<uintptr_t>(claimed);
+        return reinterpret_cast<void*>((address + alignment - 1) & ~uintptr_t(alignment - 1));
+    }
+
+    // The handle must come from this arena, and the store() that produced it must happen-before this call
+    std::string_view view(Handle handle) const {
+        const Chunk* chunk = directory[handle.chunk].load(std::memory_order_acquire);
+        return std::string_view(chunk->data.get() + handle.offset, handle.length);
+    }
+
+    // Bytes allocated by the arena: the chunk directory and every chunk, used or not
+    uint64_t reservedBytes() const { return reserved.load(std::memory_order_relaxed); }
+
+private:
+    struct Chunk {
+        Chunk(uint32_t index, size_t capacity) : index(index), capacity(capacity), data(new char[capacity]) {}
+
+        uint32_t index;
+        uint64_t capacity;
+        std::unique_ptr<char[]> data;
+        std::atomic<uint64_t> used{0};
+    };
+
+    // Reserves `length` bytes, fills in `handle` and returns where they start. Null, with a failed handle, once
+    // all kMaxChunks chunks are taken.
+    char* claim(size_t length, Handle& handle) {
+        if (length > chunkBytes / 4) {
+            // Large requests get a chunk of their own rather than wasting the tail of the current one
+            Chunk* chunk = addChunk(length);
+            if (chunk == nullptr) {
+                handle = Handle{kNoChunk, 0, 0};
+                return nullptr;
+            }
+            handle = Handle{chunk->index, 0, static_cast<uint32_t>(length)};
+            return chunk->data.get();
+        }
+
+        while (true) {
+            Chunk* chunk = current.load(std::memory_order_acquire);
+            if (chunk != nullptr) {
+                uint64_t offset = chunk->used.fetch_add(length, std::memory_order_relaxed);
+                if (offset + length <= chunk->capacity) {
+                    handle = Handle{chunk->index, static_cast<uint32_t>(offset), static_cast<uint32_t>(length)};
+                    return chunk->data.get() + offset;
+                }
+            }
+
+            // Full: the first thread to get here installs a fresh chunk, the others just retry
+            std::lock_guard<std::mutex> lock(growMutex);
+            if (current.load(std::memory_order_relaxed) == chunk) {
+                Chunk* fresh = addChunkLocked(chunkBytes);
+                if (fresh == nullptr) {
+                    handle = Handle{kNoChunk, 0, 0};
+                    return nullptr;
+                }
+                current.store(fresh, std::memory_order_release);
+            }
+        }
+    }
+
+    Chunk* addChunk(size_t capacity) {
+        std::lock_guard<std::mutex> lock(growMutex);
+        return addChunkLocked(capacity);
+    }
+
+    Chunk* addChunkLocked(size_t capacity) {
+        if (chunkCount == kMaxChunks) {
+            return nullptr;
+        }
+        auto* chunk = new Chunk(static_cast<uint32_t>(chunkCount), capacity);
+        directory[chunkCount++].store(chunk, std::memory_order_release);
+        reserved.fetch_add(sizeof(Chunk) + capacity, std::memory_order_relaxed);
+        return chunk;
+    }
+
+    size_t chunkBytes;
+    std::unique_ptr<std::atomic<Chunk*>[]> directory;
+    std::atomic<Chunk*> current{nullptr};
+    std::mutex growMutex;
+    size_t chunkCount = 0;
+    std::atomic<uint64_t> reserved{0};
+};
+
+/*
+**MPSC Ring**
+*/
+
+// Each cell's sequence tells who may touch it next: equal to a producer's ticket means free for that producer,
+// ticket + 1 means filled and ready for the consumer.
+template <typename T>
+class MpscRing {
+public:
+    explicit MpscRing(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        cells = std::unique_ptr<Cell[]>(new Cell[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscRing(const MpscRing&) = delete;
+    MpscRing& operator=(const MpscRing&) = delete;
+
+    // Returns false without waiting if the ring is full. Safe to call from many threads at once.
+    bool tryPush(T&& value) {
+        size_t ticket = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[ticket & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            auto lag = static_cast<std::ptrdiff_t>(sequence - ticket);
+            if (lag == 0) {
+                if (tail.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.sequence.store(ticket + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (lag < 0) {
+                return false; // The consumer has not freed this cell yet
+            } else {
+                ticket = tail.load(std::memory_order_relaxed); // Another producer took it
+            }
+        }
+    }
+
+    // Moves up to `maxCount` ready values to the end of `out`. Consumer thread only.
+    size_t popBatch(std::vector<T>& out, size_t maxCount) {
+        size_t count = 0;
+        while (count < maxCount) {
+            Cell& cell = cells[head & mask];
+            if (cell.sequence.load(std::memory_order_acquire) != head + 1) {
+                break;
+            }
+            out.push_back(std::move(cell.value));
+            cell.value = T();
+            cell.sequence.store(head + mask + 1, std::memory_order_release);
+            head++;
+            count++;
+        }
+        return count;
+    }
+
+    // Consumer thread only
+    bool empty() const {
+        return cells[head & mask].sequence.load(std::memory_order_acquire) != head + 1;
+    }
+
+private:
+    // Padded so producers filling neighbouring cells do not false-share
+    struct alignas(64) Cell {
+        std::atomic<size_t> sequence{0};
+        T value{};
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask = 0;
+    alignas(64) std::atomic<size_t> tail{0};
+    alignas(64) size_t head = 0; // Written by the consumer only
+};
+
+/*
+**Epoch-Based Reclamation**
+*/
+
+// Process-wide reclamation domain. The global epoch only advances once every thread inside a read section has
+// seen the current value, so an object retired in epoch r is unreachable for everyone by epoch r + 2.
+class EpochManager {
+public:
+    // Marks the calling thread as reading for its lifetime. Nests freely.
+    class Guard {
+    public:
+        Guard() { EpochManager::instance().enter(); }
+        ~Guard() { EpochManager::instance().exit(); }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    static EpochManager& instance() {
+        static EpochManager manager;
+        return manager;
+    }
+
+    EpochManager(const EpochManager&) = delete;
+    EpochManager& operator=(const EpochManager&) = delete;
+
+    // Frees `object` once no reader can still hold a pointer to it. Callers must have unlinked it already.
+    template <typename T>
+    void retire(T* object) {
+        if (object == nullptr) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(retireMutex);
+        retired.push_back({globalEpoch.load(std::memory_order_seq_cst), [object] { delete object; }});
+        collectLocked();
+    }
+
+    // Frees whatever has become safe to free. retire() does this too; call it to drain after the last retire.
+    void collect() {
+        std::lock_guard<std::mutex> lock(retireMutex);
+        collectLocked();
+    }
+
+    // Objects waiting for their readers to leave
+    size_t pendingCount() const {
+        std::lock_guard<std::mutex> lock(retireMutex);
+        return retired.size();
+    }
+
+private:
+    // One per thread that ever read; slots are recycled when threads exit, never freed
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch{0}; // 0 while the thread is outside any read section
+        std::atomic<bool> claimed{false};
+        Slot* next = nullptr;
+    };
+
+    struct ThreadState {
+        Slot* slot = nullptr;
+        size_t depth = 0;
+
+        ~ThreadState() {
+            if (slot != nullptr) {
+                slot->epoch.store(0, std::memory_order_release);
+                slot->claimed.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    struct Retired {
+        uint64_t epoch;
+        std::function<void()> free;
+    };
+
+    EpochManager() = default;
+
+    ~EpochManager() {
+        for (auto& entry : retired) {
+            entry.free();
+        }
+        for (Slot* slot = slots.load(std::memory_order_acquire); slot != nullptr;) {
+            Slot* next = slot->next;
+            delete slot;
+            slot = next;
+        }
+    }
+
+    static ThreadState& threadState() {
+        thread_local ThreadState state;
+        return state;
+    }
+
+    void enter() {
+        ThreadState& state = threadState();
+        if (state.depth++ > 0) {
+            return;
+        }
+        if (state.slot == nullptr) {
+            state.slot = claimSlot();
+        }
+        // The announcement has to be visible before any shared pointer is loaded
+        state.slot->epoch.store(globalEpoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void exit() {
+        ThreadState& state = threadState();
+        if (--state.depth == 0) {
+            state.slot->epoch.store(0, std::memory_order_release);
+        }
+    }
+
+    Slot* claimSlot() {
+        for (Slot* slot = slots.load(std::memory_order_acquire); slot != nullptr; slot = slot->next) {
+            bool expected = false;
+            if (!slot->claimed.load(std::memory_order_relaxed) &&
+                slot->claimed.compare_exchange_strong(expected, true, std::memory_order_acq_rel)) {
+                return slot;
+            }
+        }
+        auto* slot = new Slot();
+        slot->claimed.store(true, std::memory_order_relaxed);
+        slot->next = slots.load(std::memory_order_relaxed);
+        while (!slots.compare_exchange_weak(slot->next, slot, std::memory_order_release, std::memory_order_relaxed)) {
+        }
+        return slot;
+    }
+
+    // Caller holds retireMutex
+    void collectLocked() {
+        uint64_t epoch = globalEpoch.load(std::memory_order_seq_cst);
+        bool everyoneCaughtUp = true;
+        for (Slot* slot = slots.load(std::memory_order_acquire); slot != nullptr; slot = slot->next) {
+            uint64_t seen = slot->epoch.load(std::memory_order_seq_cst);
+            if (seen != 0 && seen != epoch) {
+                everyoneCaughtUp = false;
+                break;
+            }
+        }
+        if (everyoneCaughtUp) {
+            globalEpoch.store(++epoch, std::memory_order_seq_cst);
+        }
+
+        auto safe = std::partition(retired.begin(), retired.end(), [&](const Retired& entry) {
+            return entry.epoch + 2 > epoch;
+        });
+        std::vector<Retired> freeing(std::make_move_iterator(safe), std::make_move_iterator(retired.end()));
+        retired.erase(safe, retired.end());
+        for (auto& entry : freeing) {
+            entry.free();
+        }
+    }
+
+    std::atomic<uint64_t> globalEpoch{1};
+    std::atomic<Slot*> slots{nullptr};
+    mutable std::mutex retireMutex;
+    std::vector<Retired> retired;
+};
+
+// Append-only array with one writer (serialised by the caller) and any number of lock-free readers. Growing
+// copies into a larger buffer and retires the old one, so a reader inside an EpochManager::Guard can keep
+// using what it loaded. T must be trivially copyable.
+template <typename T>
+class SnapshotVector {
+public:
+    SnapshotVector() = default;
+
+    ~SnapshotVector() { delete buffer.load(std::memory_order_relaxed); }
+
+    SnapshotVector(const SnapshotVector&) = delete;
+    SnapshotVector& operator=(const SnapshotVector&) = delete;
+
+    // Writer only
+    void push_back(const T& value) {
+        size_t size = count.load(std::memory_order_relaxed);
+        Buffer* current = buffer.load(std::memory_order_relaxed);
+        if (current == nullptr || size == current->capacity) {
+            auto* grown = new Buffer(current == nullptr ? 16 : current->capacity * 2);
+            if (current != nullptr) {
+                std::memcpy(grown->items.get(), current->items.get(), size * sizeof(T));
+            }
+            buffer.store(grown, std::memory_order_release);
+            EpochManager::instance().retire(current);
+            current = grown;
+        }
+        current->items[size] = value;
+        count.store(size + 1, std::memory_order_release);
+    }
+
+    // A consistent prefix of the array. The pointer stays valid while the caller holds an EpochManager::Guard.
+    std::pair<const T*, size_t> snapshot() const {
+        size_t size = count.load(std::memory_order_acquire);
+        Buffer* current = buffer.load(std::memory_order_acquire);
+        return {current != nullptr ? current->items.get() : nullptr, size};
+    }
+
+private:
+    struct Buffer {
+        explicit Buffer(size_t capacity) : capacity(capacity), items(new T[capacity]) {}
+
+        size_t capacity;
+        std::unique_ptr<T[]> items;
+    };
+
+    std::atomic<Buffer*> buffer{nullptr};
+    std::atomic<size_t> count{0};
+};
+
+/*
+**Small History**
+*/
+
+// A growing sequence of entries: the first InlineCount in the object, the rest in arena chunks. T must be
+// trivially copyable. Not thread-safe; in the store it is guarded by the hash map's shard lock.
+template <typename T, size_t InlineCount>
+class SmallHistory {
+public:
+    SmallHistory() = default;
+
+    size_t size() const { return count; }
+
+    bool empty() const { return count == 0; }
+
+    // Once promoted the entries are copied to a chunk of `arena`, which must outlive this history. Returns
+    // false, and leaves the history as it was, if the arena has no room left for the chunk it needs.
+    bool push_back(const T& value, Arena& arena) {
+        if (count < InlineCount) {
+            storage.items[count++] = value;
+            return true;
+        }
+        if (count == InlineCount && !promote(arena)) {
+            return false;
+        }
+        Chunk* last = storage.chain.last;
+        if (last->size == last->capacity) {
+            Chunk* grown = newChunk(arena, std::min<uint32_t>(last->capacity * 2, kMaxChunkEntries));
+            if (grown == nullptr) {
+                return false;
+            }
+            last->next = grown;
+            storage.chain.last = grown;
+            last = grown;
+        }
+        last->items()[last->size++] = value;
+        count++;
+        return true;
+    }
+
+    // Back to inline storage. Chunks already taken stay in the arena until it is released.
+    void clear() { count = 0; }
+
+    // Calls fn(const T&) for every entry, oldest first
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        if (count <= InlineCount) {
+            for (uint32_t i = 0; i < count; ++i) {
+                fn(storage.items[i]);
+            }
+            return;
+        }
+        for (const Chunk* chunk = storage.chain.first; chunk != nullptr; chunk = chunk->next) {
+            for (uint32_t i = 0; i < chunk->size; ++i) {
+                fn(chunk->items()[i]);
+            }
+        }
+    }
+
+private:
+    static_assert(std::is_trivially_copyable<T>::value, "entries are copied bytewise into arena chunks");
+    static_assert(InlineCount > 0, "a history holds at least one entry inline");
+
+    // Large enough to amortise the header, small enough to stay out of the arena's dedicated-chunk path
+    static constexpr uint32_t kMaxChunkEntries = 256;
+
+    struct Chunk {
+        Chunk* next;
+        uint32_t size;
+        uint32_t capacity;
+
+        T* items() { return reinterpret_cast<T*>(this + 1); }
+        const T* items() const { return reinterpret_cast<const T*>(this + 1); }
+    };
+
+    static_assert(alignof(T) <= alignof(Chunk), "entries follow the chunk header directly");
+
+    struct Chain {
+        Chunk* first;
+        Chunk* last;
+    };
+
+    // The inline entries and the chain share the same bytes; `count` says which is live
+    union Storage {
+        Storage() : chain{nullptr, nullptr} {}
+
+        T items[InlineCount];
+        Chain chain;
+    };
+
+    static Chunk* newChunk(Arena& arena, uint32_t capacity) {
+        void* memory = arena.allocate(sizeof(Chunk) + capacity * sizeof(T), alignof(Chunk));
+        return memory != nullptr ? new (memory) Chunk{nullptr, 0, capacity} : nullptr;
+    }
+
+    bool promote(Arena& arena) {
+        Chunk* chunk = newChunk(arena, 2 * InlineCount);
+        if (chunk == nullptr) {
+            return false;
+        }
+        std::memcpy(static_cast<void*>(chunk->items()), storage.items, InlineCount * sizeof(T));
+        chunk->size = InlineCount;
+        storage.chain = Chain{chunk, chunk};
+        return true;
+    }
+
+    Storage storage;
+    uint32_t count = 0;
+};
+
+#endif // PDN_CONTAINERS_H
@@ -0,0 +1,196 @@
+#ifndef PDN_CRC32C_H
+#define PDN_CRC32C_H
+
+/*
+Every stored record and every frame sent over the network carries a CRC32C (Castagnoli) checksum. On x86-64
+CPUs with SSE4.2 the checksum is computed with the `crc32` instruction, eight bytes at a time. Because that
+instruction has a latency of three cycles but a throughput of one per cycle, long buffers are split into three
+interleaved streams whose partial checksums are then merged with a carry-less multiply (PCLMUL). Other CPUs
+fall back to a slicing-by-8 table implementation. The implementation is picked once, at first use.
+
+    uint32_t crc = crc32c(data, length);        // Checksum of one buffer
+    crc = crc32c(moreData, moreLength, crc);     // Extend it with the next one
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define PDN_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+namespace crc32c_detail {
+
+constexpr uint32_t kPolynomial = 0x82f63b78; // Reflected Castagnoli polynomial
+
+struct Tables {
+    uint32_t slice[8][256];
+
+    Tables() {
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t crc = n;
+            for (int k = 0; k < 8; ++k) {
+                crc = crc & 1 ? (crc >> 1) ^ kPolynomial : crc >> 1;
+            }
+            slice[0][n] = crc;
+        }
+        for (uint32_t n = 0; n < 256; ++n) {
+            for (int k = 1; k < 8; ++k) {
+                slice[k][n] = (slice[k - 1][n] >> 8) ^ slice[0][slice[k - 1][n] & 0xff];
+            }
+        }
+    }
+};
+
+inline const Tables& tables() {
+    static const Tables instance;
+    return instance;
+}
+
+// Slicing-by-8 on the raw (not inverted) register
+inline uint32_t extendSoftware(uint32_t crc, const uint8_t* data, size_t length) {
+    const Tables& t = tables();
+    while (length > 0 && (reinterpret_cast<uintptr_t>(data) & 7) != 0) {
+        crc = (crc >> 8) ^ t.slice[0][(crc ^ *data++) & 0xff];
+        length--;
+    }
+    while (length >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        word ^= crc;
+        crc = t.slice[7][word & 0xff] ^ t.slice[6][(word >> 8) & 0xff] ^ t.slice[5][(word >> 16) & 0xff] ^
+              t.slice[4][(word >> 24) & 0xff] ^ t.slice[3][(word >> 32) & 0xff] ^
+              t.slice[2][(word >> 40) & 0xff] ^ t.slice[1][(word >> 48) & 0xff] ^ t.slice[0][word >> 56];
+        data += 8;
+        length -= 8;
+    }
+    while (length > 0) {
+        crc = (crc >> 8) ^ t.slice[0][(crc ^ *data++) & 0xff];
+        length--;
+    }
+    return crc;
+}
+
+// a * b modulo the polynomial, in the reflected representation where bit 31 is x^0
+inline uint32_t multiplyModP(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t m = 1u << 31; m != 0; m >>= 1) {
+        if (a & m) {
+            product ^= b;
+        }
+        b = b & 1 ? (b >> 1) ^ kPolynomial : b >> 1;
+    }
+    return product;
+}
+
+// x^n modulo the polynomial
+inline uint32_t xPowerModP(uint64_t n) {
+    uint32_t result = 1u << 31;
+    uint32_t square = 1u << 30; // x^1
+    while (n != 0) {
+        if (n & 1) {
+            result = multiplyModP(result, square);
+        }
+        square = multiplyModP(square, square);
+        n >>= 1;
+    }
+    return result;
+}
+
+#ifdef PDN_X86_SIMD
+
+// Bytes per stream in one round of the three-way interleaved loop
+constexpr size_t kStreamBytes = 1024;
+
+struct ShiftConstants {
+    uint64_t oneStream;  // Moves a checksum past kStreamBytes zero bytes
+    uint64_t twoStreams; // ... and past 2 * kStreamBytes
+
+    // Carry-less multiplication leaves the product one bit high and the crc32 instruction used for reduction
+    // multiplies by x^32, hence the -33
+    ShiftConstants()
+        : oneStream(xPowerModP(8 * kStreamBytes - 33)), twoStreams(xPowerModP(16 * kStreamBytes - 33)) {}
+};
+
+__attribute__((target("sse4.2,pclmul"))) inline uint32_t shift(uint32_t crc, uint64_t constant) {
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(static_cast<int>(crc)),
+                                           _mm_cvtsi64_si128(static_cast<long long>(constant)), 0);
+    return static_cast<uint32_t>(_mm_crc32_u64(0, static_cast<uint64_t>(_mm_cvtsi128_si64(product))));
+}
+
+__attribute__((target("sse4.2,pclmul"))) inline uint32_t extendHardware(uint32_t crc, const uint8_t* data,
+                                                                         size_t length) {
+    static const ShiftConstants constants;
+
+    while (length > 0 && (reinterpret_cast<uintptr_t>(data) & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+        length--;
+    }
+
+    uint64_t crc0 = crc;
+    while (length >= 3 * kStreamBytes) {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        const uint8_t* end = data + kStreamBytes;
+        do {
+            uint64_t word0, word1, word2;
+            std::memcpy(&word0, data, 8);
+            std::memcpy(&word1, data + kStreamBytes, 8);
+            std::memcpy(&word2, data + 2 * kStreamBytes, 8);
+            crc0 = _mm_crc32_u64(crc0, word0);
+            crc1 = _mm_crc32_u64(crc1, word1);
+            crc2 = _mm_crc32_u64(crc2, word2);
+            data += 8;
+        } while (data < end);
+
+        crc0 = shift(static_cast<uint32_t>(crc0), constants.twoStreams) ^
+               shift(static_cast<uint32_t>(crc1), constants.oneStream) ^ crc2;
+        data += 2 * kStreamBytes;
+        length -= 3 * kStreamBytes;
+    }
+
+    while (length >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc0 = _mm_crc32_u64(crc0, word);
+        data += 8;
+        length -= 8;
+    }
+
+    crc = static_cast<uint32_t>(crc0);
+    while (length > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+        length--;
+    }
+    return crc;
+}
+
+#endif // PDN_X86_SIMD
+
+using ExtendFunction = uint32_t (*)(uint32_t, const uint8_t*, size_t);
+
+inline ExtendFunction pickImplementation() {
+#ifdef PDN_X86_SIMD
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) {
+        return extendHardware;
+    }
+#endif
+    return extendSoftware;
+}
+
+} // namespace crc32c_detail
+
+// Extends `crc` (the checksum of everything before `data`) with `length` more bytes
+inline uint32_t crc32c(const void* data, size_t length, uint32_t crc = 0) {
+    static const crc32c_detail::ExtendFunction extend = crc32c_detail::pickImplementation();
+    return ~extend(~crc, static_cast<const uint8_t*>(data), length);
+}
+
+// The table-driven path, whatever the CPU supports
+inline uint32_t crc32cSoftware(const void* data, size_t length, uint32_t crc = 0) {
+    return ~crc32c_detail::extendSoftware(~crc, static_cast<const uint8_t*>(data), length);
+}
+
+#endif // PDN_CRC32C_H
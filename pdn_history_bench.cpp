@@ -0,0 +1,142 @@
+/*
+Measures what a hot segment pays per key for its transaction histories, comparing the SmallHistory the store
+uses (see pdn_containers.h) with the std::vector of entries it replaced:
+
+1.  **Workload**: `appends` hot entries are added to a ConcurrentHashMap under
+keys drawn from a Zipf distribution over `keys` names. s=0 is uniform, larger s puts more of the appends on
+fewer keys and so makes histories longer.
+2.  **Memory**: Heap in use is read with mallinfo2() before the map is built and after, so it covers slots,
+out-of-line keys, vector buffers and arena chunks alike. It is divided by the number of distinct keys.
+3.  **Time**: Wall time of the appends divided by their number, on one thread.
+
+Build and run next to the sources:
+
+    g++ -O2 -std=c++17 -pthread pdn_history_bench.cpp -o pdn_history_bench
+    ./pdn_history_bench [appends] [keys]
+
+The vector held 24-byte entries, an expiry next to the payload's handle. The store keeps the expiry in the
+arena in front of the payload instead, so its entry is the 12-byte handle and three of them fit in a slot
+with the chain pointers; the inline run pays the 8 arena bytes per entry as well. With s=0 the uniform draw
+gives 864k of the 1M keys about 2.3 appends each, nearly all of which stay inline. Every byte a slot grows is
+paid for each empty slot too, which is why the inline layout is not simply made larger. A history that
+outgrows its inline entries chains chunks of 6, 12, 24... entries and, unlike the vector, never copies them.
+Under skew most keys see one append and the hot keys' long histories fill their chunks, so the inline layout
+wins by more. It appends faster at low skew, since most histories never allocate.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <malloc.h>
+
+#include "pdn_containers.h"
+#include "pdn_storage.h"
+
+// The hot entry the vector held: the expiry next to the payload's handle
+struct VectorEntry {
+    uint64_t expiresAt;
+    Arena::Handle data;
+};
+
+struct VectorHistory {
+    std::vector<VectorEntry> entries;
+    bool tombstoned = false;
+
+    void append(Arena&) { entries.push_back(VectorEntry{0, Arena::Handle{}}); }
+};
+
+// The store's hot entry, see TieredStore: the expiry goes to the arena ahead of the payload
+struct InlineEntry {
+    Arena::Handle data;
+};
+
+struct InlineHistory : SmallHistory<InlineEntry, 3> {
+    bool tombstoned = false;
+
+    void append(Arena& arena) { push_back(InlineEntry{arena.store(kExpiry, sizeof(kExpiry))}, arena); }
+
+    static constexpr char kExpiry[8] = {};
+};
+
+struct BenchResult {
+    size_t distinctKeys = 0;
+    double bytesPerKey = 0;
+    double nanosPerAppend = 0;
+};
+
+static size_t heapInUse() {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+// Key indexes drawn from Zipf(s) over [0, keys), by inverting the cumulative weights
+static std::vector<uint32_t> zipfKeys(size_t appends, size_t keys, double s, uint64_t seed) {
+    std::vector<double> cumulative(keys);
+    double total = 0;
+    for (size_t i = 0; i < keys; ++i) {
+        total += 1.0 / std::pow(static_cast<double>(i + 1), s);
+        cumulative[i] = total;
+    }
+    std::mt19937_64 random(seed);
+    std::uniform_real_distribution<double> uniform(0.0, total);
+    std::vector<uint32_t> drawn(appends);
+    for (auto& key : drawn) {
+        key = static_cast<uint32_t>(std::lower_bound(cumulative.begin(), cumulative.end(), uniform(random)) -
+                                    cumulative.begin());
+    }
+    return drawn;
+}
+
+template <typename History>
+static BenchResult run(const std::vector<std::string>& names, const std::vector<uint64_t>& hashes,
+                       const std::vector<uint32_t>& drawn) {
+    BenchResult result;
+    size_t before = heapInUse();
+    {
+        ConcurrentHashMap<History> map;
+        Arena arena;
+
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t key : drawn) {
+            map.upsert(names[key], hashes[key], [&](History& history) { history.append(arena); });
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+
+        result.distinctKeys = map.size();
+        result.bytesPerKey = static_cast<double>(heapInUse() - before) / static_cast<double>(result.distinctKeys);
+        result.nanosPerAppend =
+            static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) /
+            static_cast<double>(drawn.size());
+    }
+    return result;
+}
+
+int main(int argc, char** argv) {
+    size_t appends = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 2000000;
+    size_t keys = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1000000;
+
+    std::vector<std::string> names(keys);
+    std::vector<uint64_t> hashes(keys);
+    for (size_t i = 0; i < keys; ++i) {
+        names[i] = "account/" + std::to_string(i) + "/balance";
+        hashes[i] = hashKey(names[i]);
+    }
+
+    std::cout << "skew   keys   vector B/key  ns/append   inline-3 B/key  ns/append" << std::endl;
+    for (double s : {0.0, 0.8, 1.1}) {
+        std::vector<uint32_t> drawn = zipfKeys(appends, keys, s, 42);
+        BenchResult vector = run<VectorHistory>(names, hashes, drawn);
+        BenchResult inlined = run<InlineHistory>(names, hashes, drawn);
+        std::printf("s=%.1f  %4zuk  %12.0f  %9.0f  %15.0f  %9.0f\n", s, vector.distinctKeys / 1000,
+                    vector.bytesPerKey, vector.nanosPerAppend, inlined.bytesPerKey, inlined.nanosPerAppend);
+    }
+    return 0;
+}
@@ -0,0 +1,333 @@
+#ifndef PDN_MESSAGES_H
+#define PDN_MESSAGES_H
+
+/*
+Messages a node holds are scanned far more often than they are looked up one by one: "everything sent to this
+user", "everything between these two users since yesterday". Those scans only ever look at the sender, the
+recipient and the time, so messages are stored in columns rather than as one struct per message:
+
+1.  **User Directory**: User names are interned once into dense 32-bit ids, so a sender or recipient costs four
+bytes per message and comparing two of them is a single integer compare instead of a string compare.
+2.  **Message Blocks**: A block holds up to a few thousand messages as parallel columns: sender ids, recipient
+ids, timestamps, and the end offset of each payload in one contiguous payload blob. A filter over a column walks
+one dense array and never touches a payload it does not return.
+3.  **Vectorised Filters**: On x86-64 CPUs with AVX2 a filter compares eight ids (or four timestamps) per
+instruction and turns the comparison mask directly into matching row numbers. Other CPUs use a plain loop. The
+implementation is picked once, at first use, like the CRC32C one.
+
+    MessageStore store;
+    store.add("Alice", "Bob", timestamp, "Hello, Bob!");
+    for (const auto& message : store.messagesTo("Bob")) { ... }
+*/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#ifndef PDN_X86_SIMD
+#define PDN_X86_SIMD 1
+#endif
+#include <immintrin.h>
+#endif
+
+struct Message {
+    std::string sender;
+    std::string recipient;
+    uint64_t timestamp = 0; // Milliseconds since the epoch
+    std::string data;
+};
+
+/*
+**User Directory**
+*/
+
+class UserDirectory {
+public:
+    static constexpr uint32_t kUnknown = UINT32_MAX;
+
+    // The id of `name`, assigning the next free one if it has none yet
+    uint32_t intern(const std::string& name) {
+        auto [it, inserted] = ids.emplace(name, static_cast<uint32_t>(names.size()));
+        if (inserted) {
+            names.push_back(name);
+        }
+        return it->second;
+    }
+
+    // kUnknown if `name` never sent or received a message, which lets a scan be skipped altogether
+    uint32_t find(const std::string& name) const {
+        auto it = ids.find(name);
+        return it != ids.end() ? it->second : kUnknown;
+    }
+
+    const std::string& name(uint32_t id) const { return names[id]; }
+
+private:
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<std::string> names;
+};
+
+/*
+**Vectorised Filters**
+*/
+
+namespace message_detail {
+
+// Append the positions of matching rows in [0, count) to `rows`
+using SelectEqualFunction = void (*)(const uint32_t*, size_t, uint32_t, std::vector<uint32_t>&);
+using SelectRangeFunction = void (*)(const uint64_t*, size_t, uint64_t, uint64_t, std::vector<uint32_t>&);
+
+inline void selectEqualScalar(const uint32_t* column, size_t count, uint32_t value, std::vector<uint32_t>& rows) {
+    for (size_t i = 0; i < count; ++i) {
+        if (column[i] == value) {
+            rows.push_back(static_cast<uint32_t>(i));
+        }
+    }
+}
+
+inline void selectRangeScalar(const uint64_t* column, size_t count, uint64_t low, uint64_t high,
+                              std::vector<uint32_t>& rows) {
+    for (size_t i = 0; i < count; ++i) {
+        if (column[i] >= low && column[i] <= high) {
+            rows.push_back(static_cast<uint32_t>(i));
+        }
+    }
+}
+
+#ifdef PDN_X86_SIMD
+
+// Appends base + the index of every set bit of `mask`, lowest first
+inline void appendMaskRows(uint32_t mask, size_t base, std::vector<uint32_t>& rows) {
+    while (mask != 0) {
+        rows.push_back(static_cast<uint32_t>(base + __builtin_ctz(mask)));
+        mask &= mask - 1;
+    }
+}
+
+__attribute__((target("avx2"))) inline void selectEqualAvx2(const uint32_t* column, size_t count, uint32_t value,
+                                                            std::vector<uint32_t>& rows) {
+    __m256i needle = _mm256_set1_epi32(static_cast<int>(value));
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i ids = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(column + i));
+        auto mask = static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(ids, needle))));
+        appendMaskRows(mask, i, rows);
+    }
+    for (; i < count; ++i) {
+        if (column[i] == value) {
+            rows.push_back(static_cast<uint32_t>(i));
+        }
+    }
+}
+
+// AVX2 only compares signed 64-bit integers, so both sides are shifted by 2^63 to compare them as unsigned
+__attribute__((target("avx2"))) inline void selectRangeAvx2(const uint64_t* column, size_t count, uint64_t low,
+                                                            uint64_t high, std::vector<uint32_t>& rows) {
+    const __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+    __m256i below = _mm256_set1_epi64x(static_cast<long long>(low ^ (uint64_t(1) << 63)));
+    __m256i above = _mm256_set1_epi64x(static_cast<long long>(high ^ (uint64_t(1) << 63)));
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i values =
+            _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(column + i)), bias);
+        __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi64(below, values), _mm256_cmpgt_epi64(values, above));
+        auto mask = static_cast<uint32_t>(~_mm256_movemask_pd(_mm256_castsi256_pd(outside)) & 0xf);
+        appendMaskRows(mask, i, rows);
+    }
+    for (; i < count; ++i) {
+        if (column[i] >= low && column[i] <= high) {
+            rows.push_back(static_cast<uint32_t>(i));
+        }
+    }
+}
+
+#endif // PDN_X86_SIMD
+
+struct Filters {
+    SelectEqualFunction selectEqual = selectEqualScalar;
+    SelectRangeFunction selectRange = selectRangeScalar;
+
+    Filters() {
+#ifdef PDN_X86_SIMD
+        if (__builtin_cpu_supports("avx2")) {
+            selectEqual = selectEqualAvx2;
+            selectRange = selectRangeAvx2;
+        }
+#endif
+    }
+};
+
+inline const Filters& filters() {
+    static const Filters instance;
+    return instance;
+}
+
+} // namespace message_detail
+
+/*
+**Message Blocks**
+*/
+
+class MessageBlock {
+public:
+    static constexpr size_t kCapacity = 4096; // Rows per block; the id columns of a full block are 16 KiB each
+
+    MessageBlock() {
+        senders.reserve(kCapacity);
+        recipients.reserve(kCapacity);
+        timestamps.reserve(kCapacity);
+        payloadEnds.reserve(kCapacity);
+    }
+
+    // Whether one more message with a payload of `length` bytes can go into this block
+    bool fits(size_t length) const { return size() < kCapacity && payloads.size() + length <= UINT32_MAX; }
+
+    size_t size() const { return senders.size(); }
+
+    // The caller checks fits() first
+    void append(uint32_t sender, uint32_t recipient, uint64_t timestamp, std::string_view data) {
+        senders.push_back(sender);
+        recipients.push_back(recipient);
+        timestamps.push_back(timestamp);
+        payloads.append(data.data(), data.size());
+        payloadEnds.push_back(static_cast<uint32_t>(payloads.size()));
+        newest = std::max(newest, timestamp);
+        oldest = senders.size() == 1 ? timestamp : std::min(oldest, timestamp);
+    }
+
+    // Row numbers of the messages whose column matches, in insertion order, appended to `rows`
+    void selectSender(uint32_t id, std::vector<uint32_t>& rows) const {
+        message_detail::filters().selectEqual(senders.data(), senders.size(), id, rows);
+    }
+
+    void selectRecipient(uint32_t id, std::vector<uint32_t>& rows) const {
+        message_detail::filters().selectEqual(recipients.data(), recipients.size(), id, rows);
+    }
+
+    void selectTimeRange(uint64_t fromMillis, uint64_t toMillis, std::vector<uint32_t>& rows) const {
+        if (size() == 0 || toMillis < oldest || fromMillis > newest) {
+            return;
+        }
+        message_detail::filters().selectRange(timestamps.data(), timestamps.size(), fromMillis, toMillis, rows);
+    }
+
+    uint32_t sender(uint32_t row) const { return senders[row]; }
+
+    uint32_t recipient(uint32_t row) const { return recipients[row]; }
+
+    uint64_t timestamp(uint32_t row) const { return timestamps[row]; }
+
+    std::string_view payload(uint32_t row) const {
+        uint32_t begin = row == 0 ? 0 : payloadEnds[row - 1];
+        return std::string_view(payloads.data() + begin, payloadEnds[row] - begin);
+    }
+
+private:
+    std::vector<uint32_t> senders;
+    std::vector<uint32_t> recipients;
+    std::vector<uint64_t> timestamps;
+    std::vector<uint32_t> payloadEnds; // Payload i spans [payloadEnds[i - 1], payloadEnds[i]) of `payloads`
+    std::string payloads;
+    uint64_t oldest = 0; // Lets a time filter skip the whole block
+    uint64_t newest = 0;
+};
+
+// Messages in blocks of up to MessageBlock::kCapacity, oldest block first. Not thread-safe.
+class MessageStore {
+public:
+    void add(const std::string& sender, const std::string& recipient, uint64_t timestamp, std::string_view data) {
+        if (blocks.empty() || !blocks.back()->fits(data.size())) {
+            blocks.push_back(std::make_unique<MessageBlock>());
+        }
+        blocks.back()->append(users.intern(sender), users.intern(recipient), timestamp, data);
+    }
+
+    void add(const Message& message) { add(message.sender, message.recipient, message.timestamp, message.data); }
+
+    std::vector<Message> messagesTo(const std::string& recipient) const {
+        std::vector<Message> result;
+        uint32_t id = users.find(recipient);
+        if (id == UserDirectory::kUnknown) {
+            return result;
+        }
+        std::vector<uint32_t> rows;
+        for (const auto& block : blocks) {
+            rows.clear();
+            block->selectRecipient(id, rows);
+            collect(*block, rows, result);
+        }
+        return result;
+    }
+
+    // Messages from `sender` to `recipient` sent between `fromMillis` and `toMillis`, both inclusive
+    std::vector<Message> conversation(const std::string& sender, const std::string& recipient,
+                                      uint64_t fromMillis = 0, uint64_t toMillis = UINT64_MAX) const {
+        std::vector<Message> result;
+        uint32_t senderId = users.find(sender);
+        uint32_t recipientId = users.find(recipient);
+        if (senderId == UserDirectory::kUnknown || recipientId == UserDirectory::kUnknown) {
+            return result;
+        }
+
+        // The vectorised scan narrows the block down by recipient; the other predicates only see the survivors
+        std::vector<uint32_t> rows;
+        for (const auto& block : blocks) {
+            rows.clear();
+            block->selectRecipient(recipientId, rows);
+            size_t kept = 0;
+            for (uint32_t row : rows) {
+                uint64_t timestamp = block->timestamp(row);
+                if (block->sender(row) == senderId && timestamp >= fromMillis && timestamp <= toMillis) {
+                    rows[kept++] = row;
+                }
+            }
+            rows.resize(kept);
+            collect(*block, rows, result);
+        }
+        return result;
+    }
+
+    // Messages sent between `fromMillis` and `toMillis`, both inclusive
+    std::vector<Message> messagesBetween(uint64_t fromMillis, uint64_t toMillis) const {
+        std::vector<Message> result;
+        std::vector<uint32_t> rows;
+        for (const auto& block : blocks) {
+            rows.clear();
+            block->selectTimeRange(fromMillis, toMillis, rows);
+            collect(*block, rows, result);
+        }
+        return result;
+    }
+
+    size_t size() const {
+        size_t total = 0;
+        for (const auto& block : blocks) {
+            total += block->size();
+        }
+        return total;
+    }
+
+private:
+    // Materialises the selected rows; only here are payloads and names touched
+    void collect(const MessageBlock& block, const std::vector<uint32_t>& rows, std::vector<Message>& result) const {
+        for (uint32_t row : rows) {
+            Message message;
+            message.sender = users.name(block.sender(row));
+            message.recipient = users.name(block.recipient(row));
+            message.timestamp = block.timestamp(row);
+            message.data = std::string(block.payload(row));
+            result.push_back(std::move(message));
+        }
+    }
+
+    UserDirectory users;
+    std::vector<std::unique_ptr<MessageBlock>> blocks;
+};
+
+#endif // PDN_MESSAGES_H
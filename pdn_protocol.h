@@ -0,0 +1,212 @@
+#ifndef PDN_PROTOCOL_H
+#define PDN_PROTOCOL_H
+
+/*
+Messages between clients, servers and consensus peers are sent as length-prefixed frames, so a reader always
+knows where one message ends and the next begins, and can tell when a message was damaged in transit:
+
+    [payload length (4 bytes)] [CRC32C (4 bytes)] [request id (8 bytes)] [payload]
+
+All integers are little-endian and the checksum covers the request id and the payload. A frame whose checksum
+does not match is reported as an error and the connection should be dropped, since the byte stream can no
+longer be trusted.
+
+The request id lets a client keep many requests in flight on one connection: the server copies it from each
+request into the response, which may arrive in any order. Frames nobody asked for, such as subscription
+pushes, carry id 0.
+
+Streams the server pushes without being asked are flow controlled with credits. The receiver grants a number
+of frames and a number of bytes, and grants more as it consumes what it got; the sender only sends while it
+holds credit of both kinds and subtracts every frame it sends. Neither side therefore buffers more than the
+receiver granted, however fast the sender is. Requests and responses need no credits: a client can only
+have a bounded number of requests, and request bytes, outstanding (see pdn_client.h).
+*/
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "pdn_crc32c.h"
+#include "pdn_storage.h"
+
+constexpr size_t kFrameHeaderSize = 16;
+constexpr uint32_t kMaxFrameSize = 16u << 20;
+
+// Frames and bytes a receiver is still willing to take. Bytes are counted as whole frames, header included.
+struct FlowCredits {
+    static constexpr uint64_t kUnlimited = UINT64_MAX;
+
+    uint64_t frames = kUnlimited;
+    uint64_t bytes = kUnlimited;
+
+    bool exhausted() const { return frames == 0 || bytes == 0; }
+
+    // A frame may overdraw the bytes, since a record is never split; the sender then waits for the next grant
+    void spend(uint64_t frameBytes) {
+        if (frames != kUnlimited) {
+            frames--;
+        }
+        if (bytes != kUnlimited) {
+            bytes = frameBytes >= bytes ? 0 : bytes - frameBytes;
+        }
+    }
+
+    void grant(const FlowCredits& more) {
+        frames = more.frames >= kUnlimited - frames ? kUnlimited : frames + more.frames;
+        bytes = more.bytes >= kUnlimited - bytes ? kUnlimited : bytes + more.bytes;
+    }
+};
+
+// Appends one frame to `out`, so many frames can go out with a single send(). A payload over kMaxFrameSize is
+// refused, since every reader would drop the connection over it; nothing is appended then.
+inline bool appendFrame(std::string& out, const std::string& payload, uint64_t requestId = 0) {
+    if (payload.size() > kMaxFrameSize) {
+        std::cerr << "Error: Frame of " << payload.size() << " bytes exceeds the limit, not sent" << std::endl;
+        return false;
+    }
+    std::string id;
+    putFixed64(id, requestId);
+    putFixed32(out, static_cast<uint32_t>(payload.size()));
+    putFixed32(out, crc32c(payload.data(), payload.size(), crc32c(id.data(), id.size())));
+    out.append(id);
+    out.append(payload);
+    return true;
+}
+
+// Empty if the payload is over kMaxFrameSize
+inline std::string encodeFrame(const std::string& payload, uint64_t requestId = 0) {
+    std::string frame;
+    frame.reserve(kFrameHeaderSize + payload.size());
+    appendFrame(frame, payload, requestId);
+    return frame;
+}
+
+// Checks a frame's checksum against its header; `header` is kFrameHeaderSize bytes
+inline bool frameIntact(const char* header, const char* payload, size_t length) {
+    return crc32c(payload, length, crc32c(header + 8, 8)) == getFixed32(header + 4);
+}
+
+inline bool sendAll(int socket, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = ::send(socket, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        length -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+// Returns true once `length` bytes arrived, false if the peer closed the connection or an error occurred
+inline bool recvAll(int socket, char* data, size_t length) {
+    while (length > 0) {
+        ssize_t received = ::recv(socket, data, length, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        data += received;
+        length -= static_cast<size_t>(received);
+    }
+    return true;
+}
+
+inline bool sendFrame(int socket, const std::string& payload, uint64_t requestId = 0) {
+    std::string frame = encodeFrame(payload, requestId);
+    return !frame.empty() && sendAll(socket, frame.data(), frame.size());
+}
+
+// Returns the number of bytes consumed including the header, 0 if the connection was closed, or -1 on error
+// or checksum mismatch. `requestId`, if given, receives the id the frame carries.
+inline int recvFrame(int socket, std::string& payload, uint64_t* requestId = nullptr) {
+    char header[kFrameHeaderSize];
+    if (!recvAll(socket, header, kFrameHeaderSize)) {
+        return 0;
+    }
+
+    uint32_t length = getFixed32(header);
+    if (length > kMaxFrameSize) {
+        std::cerr << "Error: Frame of " << length << " bytes exceeds the limit" << std::endl;
+        return -1;
+    }
+
+    payload.resize(length);
+    if (length > 0 && !recvAll(socket, &payload[0], length)) {
+        return -1;
+    }
+    if (!frameIntact(header, payload.data(), payload.size())) {
+        std::cerr << "Error: Frame checksum mismatch" << std::endl;
+        return -1;
+    }
+    if (requestId != nullptr) {
+        *requestId = getFixed64(header + 8);
+    }
+    return static_cast<int>(kFrameHeaderSize + length);
+}
+
+// Splits a byte stream read in large chunks into frames, so a busy connection costs one recv() per chunk rather
+// than two per frame
+class FrameDecoder {
+public:
+    // Room for at least `minimum` more bytes; write into it and then call commit() with what was written
+    char* prepare(size_t minimum) {
+        if (begin == end) {
+            begin = end = 0;
+        }
+        if (buffer.size() - end < minimum && begin > 0) {
+            std::memmove(buffer.data(), buffer.data() + begin, end - begin); // Compact before growing
+            end -= begin;
+            begin = 0;
+        }
+        if (buffer.size() - end < minimum) {
+            buffer.resize(end + minimum);
+        }
+        return buffer.data() + end;
+    }
+
+    void commit(size_t length) { end += length; }
+
+    // 1 with the next complete frame, 0 if more bytes are needed, -1 if the stream is damaged
+    int next(std::string& payload, uint64_t& requestId) {
+        size_t available = end - begin;
+        if (available < kFrameHeaderSize) {
+            return 0;
+        }
+        const char* header = buffer.data() + begin;
+        uint32_t length = getFixed32(header);
+        if (length > kMaxFrameSize) {
+            std::cerr << "Error: Frame of " << length << " bytes exceeds the limit" << std::endl;
+            return -1;
+        }
+        if (available < kFrameHeaderSize + length) {
+            return 0;
+        }
+        if (!frameIntact(header, header + kFrameHeaderSize, length)) {
+            std::cerr << "Error: Frame checksum mismatch" << std::endl;
+            return -1;
+        }
+        requestId = getFixed64(header + 8);
+        payload.assign(header + kFrameHeaderSize, length);
+        begin += kFrameHeaderSize + length;
+        return 1;
+    }
+
+private:
+    std::vector<char> buffer;
+    size_t begin = 0; // Start of the first frame not returned yet
+    size_t end = 0;   // End of the bytes received so far
+};
+
+#endif // PDN_PROTOCOL_H
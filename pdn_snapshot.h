@@ -0,0 +1,445 @@
+#ifndef PDN_SNAPSHOT_H
+#define PDN_SNAPSHOT_H
+
+/*
+A new consumer does not have to replay the whole history over the socket. It starts from a snapshot file
+instead, and syncs incrementally from the snapshot's sequence number on:
+
+1.  **Format**: A snapshot holds every transaction that was live at its sequence number, in sequence order and
+in the record format of the segment log (see pdn_storage.h), so each record carries its own CRC32C. Deleted
+transactions and tombstones are left out. After the records comes an index of (key hash, offset) pairs sorted
+by hash, then a fixed-size footer. Nothing is compressed, so the file can be used in place.
+2.  **Mapping**: SnapshotFile maps the file read-only and checks the footer and the index checksum, which is
+all opening costs no matter how large the file is. Records are checksummed as they are read, and looking up
+a key is a binary search over the index. Pages the consumer never touches are never read from disk.
+3.  **Building**: SnapshotManager writes a snapshot in two passes over the store, the first to find the last
+tombstone of every deleted key and the second to write the survivors. Only the index entries and the
+tombstones are held in memory. One snapshot is shared by every consumer that asks within `maxAge` of it being
+built, so a crowd of new consumers costs one build. Builds run on a thread of their own; consumers are handed
+the previous snapshot meanwhile, or told to ask again if there is none yet. Co-located consumers map the file under the absolute path
+they are given and link it next to their cursor; remote ones download it in chunks first.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pdn_crc32c.h"
+#include "pdn_storage.h"
+
+constexpr uint32_t kSnapshotMagic = 0x50444e53; // "PDNS"
+
+// indexOffset(8) + recordCount(8) + indexCrc(4) + sequence(8) + createdAt(8) + magic(4)
+constexpr size_t kSnapshotFooterSize = 40;
+
+// keyHash(8) + offset(8)
+constexpr size_t kSnapshotIndexEntrySize = 16;
+
+/*
+**Snapshot Files**
+*/
+
+class SnapshotFile {
+public:
+    SnapshotFile() = default;
+
+    ~SnapshotFile() { unmap(); }
+
+    SnapshotFile(const SnapshotFile&) = delete;
+    SnapshotFile& operator=(const SnapshotFile&) = delete;
+
+    // Maps `path` and checks its footer and index. The file may be unlinked once this returned.
+    bool open(const std::string& path) {
+        unmap();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat info;
+        if (::fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(kSnapshotFooterSize)) {
+            ::close(fd);
+            return false;
+        }
+        void* mapped = ::mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd); // The mapping keeps the file alive
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        data = static_cast<const char*>(mapped);
+        size = static_cast<size_t>(info.st_size);
+
+        if (!loadFooter()) {
+            std::cerr << "Error: Corrupt snapshot " << path << std::endl;
+            unmap();
+            return false;
+        }
+        // The records are read front to back when the consumer walks them
+        ::madvise(const_cast<char*>(data), indexOffset, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    bool isOpen() const { return data != nullptr; }
+
+    // Every transaction up to this sequence number is reflected in the snapshot
+    uint64_t sequence() const { return snapshotSequence; }
+
+    uint64_t recordCount() const { return records; }
+
+    // Calls `visit` with every live transaction in sequence order. Stops early, returning false, at a record that
+    // fails its checksum.
+    bool forEach(const std::function<void(const Record&)>& visit) const {
+        uint64_t now = nowMillis();
+        Record record;
+        for (size_t offset = 0; offset < indexOffset;) {
+            size_t consumed = decode(offset, record);
+            if (consumed == 0) {
+                return false;
+            }
+            if (record.expiresAt == 0 || record.expiresAt > now) {
+                visit(record);
+            }
+            offset += consumed;
+        }
+        return true;
+    }
+
+    // Every live transaction of `key` in the snapshot, oldest first
+    std::vector<std::string> history(const std::string& key) const {
+        uint64_t hash = hashKey(key);
+        uint64_t now = nowMillis();
+        std::vector<std::string> result;
+        Record record;
+        for (size_t i = lowerBound(hash); i < records && entryHash(i) == hash; ++i) {
+            if (decode(entryOffset(i), record) != 0 && record.key == key &&
+                (record.expiresAt == 0 || record.expiresAt > now)) {
+                result.push_back(std::move(record.data));
+            }
+        }
+        return result;
+    }
+
+private:
+    bool loadFooter() {
+        const char* footer = data + size - kSnapshotFooterSize;
+        indexOffset = getFixed64(footer);
+        records = getFixed64(footer + 8);
+        snapshotSequence = getFixed64(footer + 20);
+        if (getFixed32(footer + 36) != kSnapshotMagic || indexOffset > size - kSnapshotFooterSize ||
+            records > size / kSnapshotIndexEntrySize || (size - kSnapshotFooterSize - indexOffset) != records * kSnapshotIndexEntrySize) {
+            return false;
+        }
+        return crc32c(data + indexOffset, records * kSnapshotIndexEntrySize) == getFixed32(footer + 16);
+    }
+
+    size_t decode(size_t offset, Record& record) const {
+        bool corrupt = false;
+        size_t consumed = decodeRecord(data + offset, indexOffset - offset, record, corrupt);
+        if (consumed == 0) {
+            std::cerr << "Error: Corrupt snapshot record at offset " << offset << std::endl;
+        }
+        return consumed;
+    }
+
+    uint64_t entryHash(size_t i) const { return getFixed64(data + indexOffset + i * kSnapshotIndexEntrySize); }
+
+    uint64_t entryOffset(size_t i) const { return getFixed64(data + indexOffset + i * kSnapshotIndexEntrySize + 8); }
+
+    size_t lowerBound(uint64_t hash) const {
+        size_t low = 0;
+        size_t high = records;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (entryHash(middle) < hash) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return low;
+    }
+
+    void unmap() {
+        if (data != nullptr) {
+            ::munmap(const_cast<char*>(data), size);
+            data = nullptr;
+            size = 0;
+        }
+    }
+
+    const char* data = nullptr;
+    size_t size = 0;
+    size_t indexOffset = 0;
+    uint64_t records = 0;
+    uint64_t snapshotSequence = 0;
+};
+
+/*
+**Building Snapshots**
+*/
+
+struct SnapshotOptions {
+    std::string directory = "pdn-snapshots";
+    std::chrono::milliseconds maxAge{600000}; // A snapshot is reused by every consumer that asks within this
+    size_t recordsPerRead = 1000;
+};
+
+// Deletes a snapshot file once nothing holds it any more
+struct SnapshotLease {
+    explicit SnapshotLease(std::string path) : path(std::move(path)) {}
+    ~SnapshotLease() { ::unlink(path.c_str()); }
+
+    SnapshotLease(const SnapshotLease&) = delete;
+    SnapshotLease& operator=(const SnapshotLease&) = delete;
+
+    std::string path;
+};
+
+struct SnapshotInfo {
+    std::string path;
+    uint64_t sequence = 0;
+    uint64_t bytes = 0;
+    // Keeps the file, and readChunk() serving it, after a newer snapshot replaced it, for as long as a copy of
+    // this info is held. Holders let go once they are done with the file.
+    std::shared_ptr<const SnapshotLease> lease;
+};
+
+class SnapshotManager {
+public:
+    // The directory is made absolute here, since the paths handed out are opened by other processes
+    explicit SnapshotManager(TieredStore& store, SnapshotOptions options = {}) : store(store), options(options) {
+        std::error_code error;
+        std::filesystem::path directory = std::filesystem::absolute(this->options.directory, error);
+        if (!error) {
+            this->options.directory = directory.lexically_normal().string();
+        }
+    }
+
+    // Waits for a build in progress, which gives up early
+    ~SnapshotManager() {
+        stopping.store(true);
+        if (builder.joinable()) {
+            builder.join();
+        }
+    }
+
+    SnapshotManager(const SnapshotManager&) = delete;
+    SnapshotManager& operator=(const SnapshotManager&) = delete;
+
+    // The latest snapshot, if it reaches `minSequence`. A new one is built if there is none that does or the
+    // latest is older than `maxAge`, on a thread of its own, so neither this call nor readChunk() waits for it;
+    // until it is done an old snapshot is still handed out. Returns false while there is none to hand out, in
+    // which case the caller asks again later.
+    bool current(SnapshotInfo& info, uint64_t minSequence = 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        bool usable = !latest.path.empty() && latest.sequence >= minSequence;
+        if (!usable || std::chrono::steady_clock::now() - builtAt > options.maxAge) {
+            startBuild();
+        }
+        if (!usable) {
+            return false;
+        }
+        info = latest;
+        return true;
+    }
+
+    // Up to `maxBytes` of the snapshot at `path` from `offset` on, for consumers that cannot map it in place.
+    // The current snapshot is served, and older ones for as long as someone holds their lease.
+    bool readChunk(const std::string& path, uint64_t offset, uint64_t maxBytes, std::string& chunk) {
+        std::shared_ptr<const SnapshotLease> lease;
+        uint64_t bytes = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = served.find(path);
+            if (found != served.end()) {
+                lease = found->second.lease.lock();
+                bytes = found->second.bytes;
+            }
+        }
+        if (lease == nullptr || offset > bytes) {
+            return false;
+        }
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+        chunk.resize(std::min(maxBytes, bytes - offset));
+        bool ok = chunk.empty() || readFully(fd, &chunk[0], chunk.size(), offset);
+        ::close(fd);
+        return ok;
+    }
+
+private:
+    // Called with the mutex held. The previous builder has finished once `building` is false.
+    void startBuild() {
+        if (building) {
+            return;
+        }
+        if (builder.joinable()) {
+            builder.join();
+        }
+        building = true;
+        builder = std::thread([this] {
+            SnapshotInfo built;
+            bool ok = build(built);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (ok) {
+                // The previous file is unlinked once its last holder lets go. Consumers that mapped it keep
+                // their mapping after that.
+                built.lease = std::make_shared<const SnapshotLease>(built.path);
+                latest = built;
+                builtAt = std::chrono::steady_clock::now();
+                for (auto it = served.begin(); it != served.end();) {
+                    it = it->second.lease.expired() ? served.erase(it) : std::next(it);
+                }
+                served[built.path] = Served{built.lease, built.bytes};
+            }
+            building = false;
+        });
+    }
+
+    bool build(SnapshotInfo& info) {
+        std::error_code error;
+        std::filesystem::create_directories(options.directory, error);
+        uint64_t sequence = store.lastSequence();
+        // Unique per build, so a rebuild at the same sequence number never replaces a file that is still held
+        std::string path = options.directory + "/snapshot-" + std::to_string(sequence) + "-" +
+                           std::to_string(nowMillis()) + ".pdns";
+        std::string tmpPath = path + ".tmp";
+
+        // Pass 1: the last tombstone of every deleted key. Anything of the key before it is left out.
+        std::unordered_map<std::string, uint64_t> deletedUpTo;
+        bool scanned = scan(sequence, [&](const Record& record) {
+            if (record.type == RecordType::Tombstone) {
+                deletedUpTo[record.key] = record.sequence;
+            }
+            return true;
+        });
+        if (!scanned) {
+            return false;
+        }
+
+        // Pass 2: the survivors, in sequence order, remembering where each one went
+        int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            std::cerr << "Error: Cannot create snapshot " << tmpPath << std::endl;
+            return false;
+        }
+        std::vector<std::pair<uint64_t, uint64_t>> index; // (key hash, offset)
+        std::string buffer;
+        uint64_t written = 0;
+        bool ok = scan(sequence, [&](const Record& record) {
+            if (record.type == RecordType::Tombstone) {
+                return true;
+            }
+            auto deleted = deletedUpTo.find(record.key);
+            if (deleted != deletedUpTo.end() && record.sequence < deleted->second) {
+                return true;
+            }
+            index.emplace_back(hashKey(record.key), written + buffer.size());
+            encodeRecord(record, buffer);
+            if (buffer.size() >= kWriteChunk) {
+                if (!writeFully(fd, buffer.data(), buffer.size())) {
+                    return false;
+                }
+                written += buffer.size();
+                buffer.clear();
+            }
+            return true;
+        });
+
+        // Sorting by (hash, offset) keeps each key's records in sequence order within its run
+        std::sort(index.begin(), index.end());
+        uint64_t indexOffset = written + buffer.size();
+        size_t indexStart = buffer.size();
+        for (const auto& entry : index) {
+            putFixed64(buffer, entry.first);
+            putFixed64(buffer, entry.second);
+        }
+        uint32_t indexCrc = crc32c(buffer.data() + indexStart, buffer.size() - indexStart);
+        putFixed64(buffer, indexOffset);
+        putFixed64(buffer, index.size());
+        putFixed32(buffer, indexCrc);
+        putFixed64(buffer, sequence);
+        putFixed64(buffer, nowMillis());
+        putFixed32(buffer, kSnapshotMagic);
+        ok = ok && writeFully(fd, buffer.data(), buffer.size()) && ::fsync(fd) == 0;
+        written += buffer.size();
+        ::close(fd);
+        if (!ok || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+            std::cerr << "Error: Cannot write snapshot " << path << std::endl;
+            ::unlink(tmpPath.c_str());
+            return false;
+        }
+
+        info.path = path;
+        info.sequence = sequence;
+        info.bytes = written;
+        return true;
+    }
+
+    // Calls `visit` with every record up to `lastSequence`, tombstones included, until it returns false. Also
+    // fails if the log could not be read all the way to `lastSequence`, since a snapshot that stops short would
+    // lose the transactions in between for good.
+    bool scan(uint64_t lastSequence, const std::function<bool(const Record&)>& visit) {
+        for (uint64_t next = 1; next <= lastSequence;) {
+            if (stopping.load()) {
+                return false;
+            }
+            uint64_t resumeAt = next;
+            std::vector<Record> page = store.scanSince(next, options.recordsPerRead, resumeAt);
+            for (const auto& record : page) {
+                if (record.sequence > lastSequence) {
+                    return true;
+                }
+                if (!visit(record)) {
+                    return false;
+                }
+            }
+            if (resumeAt <= next) {
+                std::cerr << "Error: Snapshot scan stopped at sequence " << next << " of " << lastSequence
+                          << std::endl;
+                return false;
+            }
+            next = resumeAt;
+        }
+        return true;
+    }
+
+    static constexpr size_t kWriteChunk = 1 << 20;
+
+    TieredStore& store;
+    SnapshotOptions options;
+
+    std::atomic<bool> stopping{false};
+    std::thread builder;
+
+    struct Served {
+        std::weak_ptr<const SnapshotLease> lease;
+        uint64_t bytes = 0;
+    };
+
+    std::mutex mutex; // Guards everything below
+    bool building = false;
+    SnapshotInfo latest;
+    std::chrono::steady_clock::time_point builtAt;
+    std::unordered_map<std::string, Served> served; // By path; the latest and any older ones still held
+};
+
+#endif // PDN_SNAPSHOT_H
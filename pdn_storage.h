@@ -0,0 +1,2744 @@
+#ifndef PDN_STORAGE_H
+#define PDN_STORAGE_H
+
+/*
+The server has to keep every transaction it accepts, but it must not let superseded or expired data pile up
+on disk forever. The storage layer is organised as an append-only log split into segments:
+
+1.  **Segment Log**: New records are appended to a single active segment file. Once the file reaches a size
+limit it is sealed and a new active segment is opened. Sealed segments are never modified again.
+2.  **Compaction**: A background thread merges runs of adjacent sealed segments of similar size into one,
+dropping records that have expired. Merged outputs only take part again once
+enough segments of their own size have piled up next to them, so a record is rewritten a logarithmic number
+of times rather than once per merge. Its I/O goes through a token bucket and the thread runs at
+lowered CPU and I/O priority, so compaction never starves foreground appends.
+3.  **Tiered Storage**: The most recent segments are also kept uncompressed in memory, since that is where
+almost all reads land. Older segments live only on disk, and compaction rewrites them as block-compressed
+"cold" files whose blocks are decompressed lazily when a read needs them. The memory footprint is bounded by
+one global budget no matter how much history is retained.
+
+Every record and every cold block carries a CRC32C checksum (see pdn_crc32c.h). Checksums are verified
+whenever a segment is read, and on startup the newest raw segment is scanned and truncated after its last
+intact record, which discards a write torn by a crash.
+
+4.  **Retention**: History is bounded by age, by total size and by per-key TTLs. Age and size limits drop
+whole segments, oldest first, and a segment whose every record has expired is dropped as a unit too. Expired
+records inside live segments are filtered out lazily by readers and removed for good by compaction, so no
+cleanup ever has to stop the world.
+
+5.  **Ingest Queue**: Connection threads do not write to the store themselves. They push transactions into a
+lock-free ring per shard, and one writer thread per shard drains its ring and persists everything it found
+with a single log write and a single fdatasync(), so the log lock and the system calls are paid once per
+batch. A transaction is only acknowledged once its batch is synced.
+
+Each sealed segment has a bloom filter over its keys that stays resident in memory, so looking up the history
+of a key only opens the segments that may actually contain it.
+
+Segment files are named `seg-<first>-<last>.log` (or `.cold` once compressed), where `first` and `last` are the ids of the segments the
+file covers. A freshly rolled segment covers only itself; a compacted one covers all of its inputs. That makes
+recovery after a crash in the middle of a compaction trivial: any segment whose range is contained in another
+segment's range is a leftover input and is deleted.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "pdn_containers.h"
+#include "pdn_crc32c.h"
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+/*
+**Record Format**
+*/
+
+enum class RecordType : uint8_t {
+    Append = 1,
+    Tombstone = 2 // Deletes every earlier record of the same key
+};
+
+struct Record {
+    RecordType type = RecordType::Append;
+    uint64_t sequence = 0;  // Position in the global order of appends, assigned by SegmentLog::append
+    uint64_t timestamp = 0; // Server ingest time in milliseconds, also assigned by SegmentLog::append
+    uint64_t expiresAt = 0; // Unix time in milliseconds, 0 means the record never expires
+    std::string key;
+    std::string data;
+};
+
+// crc(4) + type(1) + sequence(8) + timestamp(8) + expiresAt(8) + keyLength(4) + dataLength(4); the crc covers
+// everything after itself
+constexpr size_t kRecordHeaderSize = 37;
+
+// Anything larger is taken to be a corrupt length field rather than a real record
+constexpr size_t kMaxRecordSize = 256u << 20;
+
+// What a record counts against a read's byte budget. Readers that send records on in another encoding pass
+// the encoded size, so a page that fits its budget also fits whatever it is sent in.
+using RecordSize = std::function<uint64_t(const Record&)>;
+
+inline uint64_t nowMillis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+inline void putFixed32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+}
+
+inline void putFixed64(std::string& out, uint64_t value) {
+    for (int i = 0; i < 8; ++i) {
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+}
+
+inline uint32_t getFixed32(const char* in) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value |= static_cast<uint32_t>(static_cast<uint8_t>(in[i])) << (8 * i);
+    }
+    return value;
+}
+
+inline uint64_t getFixed64(const char* in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value |= static_cast<uint64_t>(static_cast<uint8_t>(in[i])) << (8 * i);
+    }
+    return value;
+}
+
+// Stable 64-bit hash of a key (MurmurHash64A). Bloom filters are persisted, so this must not change.
+inline uint64_t hashKey(const std::string& key) {
+    const uint64_t m = 0xc6a4a7935bd1e995ull;
+    const int r = 47;
+    uint64_t h = 0x8445d61a4e774912ull ^ (key.size() * m);
+
+    const char* data = key.data();
+    const char* end = data + (key.size() & ~size_t(7));
+    for (; data != end; data += 8) {
+        uint64_t k = getFixed64(data);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    size_t tail = key.size() & 7;
+    if (tail != 0) {
+        uint64_t k = 0;
+        for (size_t i = 0; i < tail; ++i) {
+            k |= static_cast<uint64_t>(static_cast<uint8_t>(data[i])) << (8 * i);
+        }
+        h ^= k;
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// Rewrites the sequence number and timestamp of an encoded record of `length` bytes and recomputes its checksum
+inline void stampRecord(char* encoded, size_t length, uint64_t sequence, uint64_t timestamp) {
+    for (int i = 0; i < 8; ++i) {
+        encoded[5 + i] = static_cast<char>((sequence >> (8 * i)) & 0xff);
+        encoded[13 + i] = static_cast<char>((timestamp >> (8 * i)) & 0xff);
+    }
+    uint32_t crc = crc32c(encoded + 4, length - 4);
+    for (int i = 0; i < 4; ++i) {
+        encoded[i] = static_cast<char>((crc >> (8 * i)) & 0xff);
+    }
+}
+
+inline void encodeRecord(const Record& record, std::string& out) {
+    size_t start = out.size();
+    putFixed32(out, 0);
+    out.push_back(static_cast<char>(record.type));
+    putFixed64(out, 0);
+    putFixed64(out, 0);
+    putFixed64(out, record.expiresAt);
+    putFixed32(out, static_cast<uint32_t>(record.key.size()));
+    putFixed32(out, static_cast<uint32_t>(record.data.size()));
+    out.append(record.key);
+    out.append(record.data);
+    stampRecord(&out[start], out.size() - start, record.sequence, record.timestamp);
+}
+
+// Returns the number of bytes consumed, or 0 if `in` does not hold a complete record. A record that is
+// complete but fails its checksum also returns 0 and sets `corrupt`.
+inline size_t decodeRecord(const char* in, size_t length, Record& record, bool& corrupt) {
+    corrupt = false;
+    if (length < kRecordHeaderSize) {
+        return 0;
+    }
+
+    uint32_t keyLength = getFixed32(in + 29);
+    uint32_t dataLength = getFixed32(in + 33);
+    size_t total = kRecordHeaderSize + size_t(keyLength) + size_t(dataLength);
+    if (total > kMaxRecordSize) {
+        corrupt = true;
+        return 0;
+    }
+    if (length < total) {
+        return 0;
+    }
+    if (crc32c(in + 4, total - 4) != getFixed32(in)) {
+        corrupt = true;
+        return 0;
+    }
+
+    record.type = static_cast<RecordType>(in[4]);
+    record.sequence = getFixed64(in + 5);
+    record.timestamp = getFixed64(in + 13);
+    record.expiresAt = getFixed64(in + 21);
+    record.key.assign(in + kRecordHeaderSize, keyLength);
+    record.data.assign(in + kRecordHeaderSize + keyLength, dataLength);
+    return total;
+}
+
+inline bool endsWith(const std::string& value, const std::string& suffix) {
+    return value.size() >= suffix.size() && value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+inline bool readFully(int fd, char* data, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t bytesRead = ::pread(fd, data, length, static_cast<off_t>(offset));
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            return false;
+        }
+        data += bytesRead;
+        length -= static_cast<size_t>(bytesRead);
+        offset += static_cast<uint64_t>(bytesRead);
+    }
+    return true;
+}
+
+inline bool writeFully(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = ::write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        length -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+/*
+**Bloom Filters**
+
+A blocked bloom filter: the upper half of the key hash picks one 64-byte block (a single cache line) and the
+lower half sets one bit in each of the block's eight 64-bit words. A probe therefore touches exactly one cache
+line, and with AVX2 all eight bit positions are computed and tested with a handful of vector instructions.
+At 10 bits per key the false positive rate is about 1%.
+*/
+
+class BloomFilter {
+public:
+    static constexpr size_t kBlockBytes = 64;
+    static constexpr size_t kDefaultBitsPerKey = 10;
+
+    explicit BloomFilter(size_t keyCount, size_t bitsPerKey = kDefaultBitsPerKey)
+        : blocks(std::max<size_t>(1, (keyCount * bitsPerKey + kBlockBytes * 8 - 1) / (kBlockBytes * 8))) {}
+
+    // Restores a filter written by serialize(); `length` must be a non-zero multiple of kBlockBytes
+    BloomFilter(const char* data, size_t length) : blocks(length / kBlockBytes) {
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            for (size_t w = 0; w < 8; ++w) {
+                blocks[i].words[w] = getFixed64(data + i * kBlockBytes + w * 8);
+            }
+        }
+    }
+
+    void add(uint64_t hash) {
+        Block& block = blocks[blockIndex(hash)];
+        uint32_t low = static_cast<uint32_t>(hash);
+        for (size_t w = 0; w < 8; ++w) {
+            block.words[w] |= uint64_t(1) << ((low * kSalts[w]) >> 26);
+        }
+    }
+
+    // False means the key is definitely absent
+    bool mayContain(uint64_t hash) const {
+        static const bool useAvx2 = supportsAvx2();
+        const Block& block = blocks[blockIndex(hash)];
+        uint32_t low = static_cast<uint32_t>(hash);
+#ifdef PDN_X86_SIMD
+        if (useAvx2) {
+            return probeAvx2(block, low);
+        }
+#endif
+        for (size_t w = 0; w < 8; ++w) {
+            if ((block.words[w] & (uint64_t(1) << ((low * kSalts[w]) >> 26))) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void serialize(std::string& out) const {
+        for (const auto& block : blocks) {
+            for (uint64_t word : block.words) {
+                putFixed64(out, word);
+            }
+        }
+    }
+
+    size_t sizeBytes() const { return blocks.size() * kBlockBytes; }
+
+private:
+    struct alignas(kBlockBytes) Block {
+        uint64_t words[8] = {};
+    };
+
+    static constexpr uint32_t kSalts[8] = {0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d,
+                                           0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31};
+
+    size_t blockIndex(uint64_t hash) const {
+        return static_cast<size_t>(((hash >> 32) * blocks.size()) >> 32);
+    }
+
+    static bool supportsAvx2() {
+#ifdef PDN_X86_SIMD
+        return __builtin_cpu_supports("avx2");
+#else
+        return false;
+#endif
+    }
+
+#ifdef PDN_X86_SIMD
+    __attribute__((target("avx2"))) static bool probeAvx2(const Block& block, uint32_t low) {
+        const __m256i salts = _mm256_setr_epi32(static_cast<int>(kSalts[0]), static_cast<int>(kSalts[1]),
+                                                static_cast<int>(kSalts[2]), static_cast<int>(kSalts[3]),
+                                                static_cast<int>(kSalts[4]), static_cast<int>(kSalts[5]),
+                                                static_cast<int>(kSalts[6]), static_cast<int>(kSalts[7]));
+        __m256i shifts = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(static_cast<int>(low)), salts), 26);
+
+        const __m256i ones = _mm256_set1_epi64x(1);
+        __m256i lowMask = _mm256_sllv_epi64(ones, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(shifts)));
+        __m256i highMask = _mm256_sllv_epi64(ones, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(shifts, 1)));
+
+        __m256i lowWords = _mm256_load_si256(reinterpret_cast<const __m256i*>(block.words));
+        __m256i highWords = _mm256_load_si256(reinterpret_cast<const __m256i*>(block.words + 4));
+        return _mm256_testc_si256(lowWords, lowMask) && _mm256_testc_si256(highWords, highMask);
+    }
+#endif
+
+    std::vector<Block> blocks;
+};
+
+/*
+**Cold Segments**
+
+A cold segment is a sequence of independently compressed blocks, each holding whole records, followed by a
+block index, the segment's bloom filter and a fixed-size footer:
+
+    [block 0] ... [block n-1]
+    [index: n * (offset, compressedSize, rawSize, recordCount, crc, firstSequence, firstTimestamp)] [filter]
+    [indexOffset, n, indexCrc, filterOffset, filterCrc, lastTimestamp, latestExpiry, lastSequence, magic]
+
+Only the index and the filter are kept in memory; a block is read, checked against its CRC32C and
+decompressed when a reader reaches it, then kept in the block cache. The first sequence number of every block
+and timestamp makes the index double as a sparse sequence and time index: a read from sequence X starts at the
+last block whose first sequence is at most X.
+*/
+
+constexpr uint32_t kColdSegmentMagic = 0x50444e43; // "PDNC"
+constexpr size_t kColdIndexEntrySize = 40;
+constexpr size_t kColdFooterSize = 56;
+
+// Segment::latestExpiry of a segment holding at least one record that never expires
+constexpr uint64_t kNeverExpires = UINT64_MAX;
+
+struct ColdBlock {
+    uint64_t offset = 0;
+    uint32_t compressedSize = 0;
+    uint32_t rawSize = 0;
+    uint32_t recordCount = 0;
+    uint32_t crc = 0; // Of the compressed bytes
+    uint64_t firstSequence = 0;
+    uint64_t firstTimestamp = 0;
+};
+
+class ColdSegmentWriter {
+public:
+    ColdSegmentWriter(int fd, size_t blockSize = 64 * 1024, int compressionLevel = 1)
+        : fd(fd), blockSize(blockSize), compressionLevel(compressionLevel) {}
+
+    bool add(const Record& record) {
+        if (pendingRecords == 0) {
+            pendingFirstSequence = record.sequence;
+            pendingFirstTimestamp = record.timestamp;
+        }
+        encodeRecord(record, pending);
+        pendingRecords++;
+        newestSequence = record.sequence;
+        newestTimestamp = std::max(newestTimestamp, record.timestamp);
+        keyHashes.push_back(hashKey(record.key));
+        latestExpiry = std::max(latestExpiry, record.expiresAt == 0 ? kNeverExpires : record.expiresAt);
+        if (pending.size() >= blockSize) {
+            return flushBlock();
+        }
+        return true;
+    }
+
+    bool finish() {
+        if (!pending.empty() && !flushBlock()) {
+            return false;
+        }
+
+        std::string index;
+        for (const auto& block : blocks) {
+            putFixed64(index, block.offset);
+            putFixed32(index, block.compressedSize);
+            putFixed32(index, block.rawSize);
+            putFixed32(index, block.recordCount);
+            putFixed32(index, block.crc);
+            putFixed64(index, block.firstSequence);
+            putFixed64(index, block.firstTimestamp);
+        }
+        uint32_t indexCrc = crc32c(index.data(), index.size());
+        uint64_t indexOffset = written;
+
+        filter = std::make_shared<BloomFilter>(keyHashes.size());
+        for (uint64_t hash : keyHashes) {
+            filter->add(hash);
+        }
+        size_t filterStart = index.size();
+        filter->serialize(index);
+        uint32_t filterCrc = crc32c(index.data() + filterStart, index.size() - filterStart);
+
+        putFixed64(index, indexOffset);
+        putFixed32(index, static_cast<uint32_t>(blocks.size()));
+        putFixed32(index, indexCrc);
+        putFixed64(index, indexOffset + filterStart);
+        putFixed32(index, filterCrc);
+        putFixed64(index, newestTimestamp);
+        putFixed64(index, latestExpiry);
+        putFixed64(index, newestSequence);
+        putFixed32(index, kColdSegmentMagic);
+        return append(index);
+    }
+
+    // Compressed bytes handed to the file so far
+    uint64_t bytesWritten() const { return written; }
+
+    // Filter over every key added, available after finish()
+    std::shared_ptr<const BloomFilter> keyFilter() const { return filter; }
+
+    uint64_t maxExpiry() const { return latestExpiry; }
+
+private:
+    bool flushBlock() {
+        uLongf compressedSize = compressBound(static_cast<uLong>(pending.size()));
+        compressed.resize(compressedSize);
+        if (compress2(reinterpret_cast<Bytef*>(&compressed[0]), &compressedSize,
+                      reinterpret_cast<const Bytef*>(pending.data()), static_cast<uLong>(pending.size()),
+                      compressionLevel) != Z_OK) {
+            return false;
+        }
+        compressed.resize(compressedSize);
+
+        ColdBlock block;
+        block.offset = written;
+        block.compressedSize = static_cast<uint32_t>(compressedSize);
+        block.rawSize = static_cast<uint32_t>(pending.size());
+        block.recordCount = pendingRecords;
+        block.crc = crc32c(compressed.data(), compressed.size());
+        block.firstSequence = pendingFirstSequence;
+        block.firstTimestamp = pendingFirstTimestamp;
+        blocks.push_back(block);
+
+        pending.clear();
+        pendingRecords = 0;
+        return append(compressed);
+    }
+
+    bool append(const std::string& bytes) {
+        if (!writeFully(fd, bytes.data(), bytes.size())) {
+            return false;
+        }
+        written += bytes.size();
+        return true;
+    }
+
+    int fd;
+    size_t blockSize;
+    int compressionLevel;
+    std::string pending;
+    uint32_t pendingRecords = 0;
+    uint64_t pendingFirstSequence = 0;
+    uint64_t pendingFirstTimestamp = 0;
+    uint64_t newestSequence = 0;
+    uint64_t newestTimestamp = 0;
+    std::string compressed;
+    std::vector<ColdBlock> blocks;
+    std::vector<uint64_t> keyHashes;
+    std::shared_ptr<BloomFilter> filter;
+    uint64_t latestExpiry = 0;
+    uint64_t written = 0;
+};
+
+class ColdSegment {
+public:
+    explicit ColdSegment(const std::string& path) : fd(::open(path.c_str(), O_RDONLY)) {
+        if (fd != -1 && !loadIndex()) {
+            std::cerr << "Error: Corrupt cold segment " << path << std::endl;
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    ~ColdSegment() {
+        if (fd != -1) {
+            ::close(fd);
+        }
+    }
+
+    ColdSegment(const ColdSegment&) = delete;
+    ColdSegment& operator=(const ColdSegment&) = delete;
+
+    bool isOpen() const { return fd != -1; }
+
+    const std::vector<ColdBlock>& blockIndex() const { return blocks; }
+
+    std::shared_ptr<const BloomFilter> keyFilter() const { return filter; }
+
+    uint64_t maxExpiry() const { return latestExpiry; }
+
+    uint64_t firstSequence() const { return blocks.empty() ? 0 : blocks.front().firstSequence; }
+
+    uint64_t firstTimestamp() const { return blocks.empty() ? 0 : blocks.front().firstTimestamp; }
+
+    uint64_t lastTimestamp() const { return newestTimestamp; }
+
+    uint64_t lastSequence() const { return newestSequence; }
+
+    // Index of the block a read from `sequence` has to start at
+    size_t blockFor(uint64_t sequence) const {
+        auto after = std::upper_bound(blocks.begin(), blocks.end(), sequence, [](uint64_t value, const ColdBlock& block) {
+            return value < block.firstSequence;
+        });
+        return after == blocks.begin() ? 0 : static_cast<size_t>(after - blocks.begin() - 1);
+    }
+
+    // A sequence number no later than that of the first record ingested at or after `millis`
+    uint64_t sequenceAtTime(uint64_t millis) const {
+        auto atOrAfter = std::partition_point(blocks.begin(), blocks.end(), [&](const ColdBlock& block) {
+            return block.firstTimestamp < millis;
+        });
+        if (atOrAfter == blocks.begin()) {
+            return firstSequence();
+        }
+        return (atOrAfter - 1)->firstSequence;
+    }
+
+    // Reads and decompresses one block into `raw`, returning the number of bytes read from disk (0 on error)
+    uint64_t readBlock(size_t blockIndex, std::string& raw) const {
+        const ColdBlock& block = blocks[blockIndex];
+        std::string compressed(block.compressedSize, '\0');
+        if (!readFully(fd, &compressed[0], compressed.size(), block.offset)) {
+            return 0;
+        }
+        if (crc32c(compressed.data(), compressed.size()) != block.crc) {
+            std::cerr << "Error: Checksum mismatch in cold block at offset " << block.offset << std::endl;
+            return 0;
+        }
+
+        raw.resize(block.rawSize);
+        uLongf rawSize = block.rawSize;
+        if (uncompress(reinterpret_cast<Bytef*>(&raw[0]), &rawSize,
+                       reinterpret_cast<const Bytef*>(compressed.data()), block.compressedSize) != Z_OK ||
+            rawSize != block.rawSize) {
+            return 0;
+        }
+        return block.compressedSize;
+    }
+
+private:
+    bool loadIndex() {
+        off_t fileSize = ::lseek(fd, 0, SEEK_END);
+        if (fileSize < static_cast<off_t>(kColdFooterSize)) {
+            return false;
+        }
+
+        char footer[kColdFooterSize];
+        if (!readFully(fd, footer, kColdFooterSize, static_cast<uint64_t>(fileSize) - kColdFooterSize)) {
+            return false;
+        }
+        uint64_t indexOffset = getFixed64(footer);
+        uint32_t blockCount = getFixed32(footer + 8);
+        uint64_t filterOffset = getFixed64(footer + 16);
+        uint64_t filterEnd = static_cast<uint64_t>(fileSize) - kColdFooterSize;
+        if (getFixed32(footer + 52) != kColdSegmentMagic ||
+            indexOffset + uint64_t(blockCount) * kColdIndexEntrySize != filterOffset || filterOffset >= filterEnd ||
+            (filterEnd - filterOffset) % BloomFilter::kBlockBytes != 0) {
+            return false;
+        }
+
+        std::string index(size_t(blockCount) * kColdIndexEntrySize, '\0');
+        if (blockCount > 0 && !readFully(fd, &index[0], index.size(), indexOffset)) {
+            return false;
+        }
+        if (crc32c(index.data(), index.size()) != getFixed32(footer + 12)) {
+            return false;
+        }
+        blocks.resize(blockCount);
+        for (uint32_t i = 0; i < blockCount; ++i) {
+            const char* entry = index.data() + size_t(i) * kColdIndexEntrySize;
+            blocks[i].offset = getFixed64(entry);
+            blocks[i].compressedSize = getFixed32(entry + 8);
+            blocks[i].rawSize = getFixed32(entry + 12);
+            blocks[i].recordCount = getFixed32(entry + 16);
+            blocks[i].crc = getFixed32(entry + 20);
+            blocks[i].firstSequence = getFixed64(entry + 24);
+            blocks[i].firstTimestamp = getFixed64(entry + 32);
+        }
+
+        std::string filterBytes(filterEnd - filterOffset, '\0');
+        if (!readFully(fd, &filterBytes[0], filterBytes.size(), filterOffset) ||
+            crc32c(filterBytes.data(), filterBytes.size()) != getFixed32(footer + 24)) {
+            return false;
+        }
+        filter = std::make_shared<BloomFilter>(filterBytes.data(), filterBytes.size());
+        newestTimestamp = getFixed64(footer + 28);
+        latestExpiry = getFixed64(footer + 36);
+        newestSequence = getFixed64(footer + 44);
+        return true;
+    }
+
+    int fd;
+    std::vector<ColdBlock> blocks;
+    std::shared_ptr<const BloomFilter> filter;
+    uint64_t newestTimestamp = 0;
+    uint64_t latestExpiry = kNeverExpires;
+    uint64_t newestSequence = 0;
+};
+
+/*
+**Block Cache**
+
+Decompressed cold blocks are kept in a sharded cache with a fixed byte budget. Each shard has its own lock and
+runs CLOCK (second chance) eviction. Admission is decided by TinyLFU: a small count-min sketch estimates how
+often each block was requested recently, and a new block only displaces the CLOCK victim if it is requested
+more often than the victim. One-off scans therefore cannot flush the blocks that are actually hot.
+
+Blocks are handed out as shared pointers. A block is pinned while anyone besides the cache holds it, for
+example while it is being sent to a client, and eviction skips pinned blocks.
+*/
+
+struct BlockKey {
+    uint64_t firstId = 0; // Segment ids are never reused, so (firstId, lastId) identifies one file
+    uint64_t lastId = 0;
+    uint64_t block = 0;
+
+    bool operator==(const BlockKey& other) const {
+        return firstId == other.firstId && lastId == other.lastId && block == other.block;
+    }
+};
+
+struct BlockKeyHash {
+    size_t operator()(const BlockKey& key) const {
+        uint64_t h = key.firstId * 0x9e3779b97f4a7c15ull;
+        h ^= (key.lastId + 0x632be59bd9b4e019ull) * 0xbf58476d1ce4e5b9ull;
+        h ^= (key.block + 0x2545f4914f6cdd1dull) * 0x94d049bb133111ebull;
+        return static_cast<size_t>(h ^ (h >> 31));
+    }
+};
+
+struct BlockCacheMetrics {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t rejections = 0; // Blocks TinyLFU decided were not worth caching
+    uint64_t usedBytes = 0;
+    uint64_t capacityBytes = 0;
+
+    double hitRatio() const {
+        uint64_t lookups = hits + misses;
+        return lookups == 0 ? 0.0 : static_cast<double>(hits) / static_cast<double>(lookups);
+    }
+};
+
+class BlockCache {
+public:
+    using Block = std::shared_ptr<const std::string>;
+
+    explicit BlockCache(uint64_t capacityBytes, size_t shardCount = 16) : shards(std::max<size_t>(shardCount, 1)) {
+        for (auto& shard : shards) {
+            shard.capacity = capacityBytes / shards.size();
+            // Around four counters per cached block at the default 64 KiB block size
+            shard.sketch.resize(std::max<uint64_t>(shard.capacity / (16 * 1024), 1024));
+        }
+    }
+
+    BlockCache(const BlockCache&) = delete;
+    BlockCache& operator=(const BlockCache&) = delete;
+
+    // Returns the cached block (pinned for as long as the caller keeps it) or nullptr
+    Block lookup(const BlockKey& key) {
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.sketch.increment(BlockKeyHash()(key));
+
+        auto found = shard.index.find(key);
+        if (found == shard.index.end()) {
+            shard.misses++;
+            return nullptr;
+        }
+        Slot& slot = shard.ring[found->second];
+        slot.referenced = true;
+        shard.hits++;
+        return slot.data;
+    }
+
+    // Offers a freshly read block to the cache; the caller keeps using `data` whether or not it is admitted
+    void insert(const BlockKey& key, Block data) {
+        Shard& shard = shardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (data->size() > shard.capacity || shard.index.count(key) != 0) {
+            return;
+        }
+
+        uint32_t frequency = shard.sketch.estimate(BlockKeyHash()(key));
+        if (!makeRoom(shard, data->size(), frequency)) {
+            shard.rejections++;
+            return;
+        }
+
+        size_t position;
+        if (!shard.freeSlots.empty()) {
+            position = shard.freeSlots.back();
+            shard.freeSlots.pop_back();
+        } else {
+            position = shard.ring.size();
+            shard.ring.emplace_back();
+        }
+
+        Slot& slot = shard.ring[position];
+        slot.key = key;
+        slot.data = std::move(data);
+        slot.referenced = false;
+        shard.usedBytes += slot.data->size();
+        totalUsed.fetch_add(slot.data->size(), std::memory_order_relaxed);
+        shard.index.emplace(key, position);
+    }
+
+    // Bytes of cached blocks, without taking any shard lock
+    uint64_t usedBytes() const { return totalUsed.load(std::memory_order_relaxed); }
+
+    BlockCacheMetrics metrics() const {
+        BlockCacheMetrics result;
+        for (const auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            result.hits += shard.hits;
+            result.misses += shard.misses;
+            result.evictions += shard.evictions;
+            result.rejections += shard.rejections;
+            result.usedBytes += shard.usedBytes;
+            result.capacityBytes += shard.capacity;
+        }
+        return result;
+    }
+
+private:
+    // Count-min sketch with four rows of saturating 4-bit counters, halved periodically so it tracks
+    // recent rather than all-time popularity
+    class FrequencySketch {
+    public:
+        void resize(uint64_t counters) {
+            size_t width = 1;
+            while (width < counters) {
+                width <<= 1;
+            }
+            table.assign(width, 0);
+            mask = width - 1;
+            sampleSize = 10 * width;
+        }
+
+        void increment(uint64_t hash) {
+            bool added = false;
+            for (int row = 0; row < 4; ++row) {
+                size_t index = indexOf(hash, row);
+                int shift = row * 4;
+                if (((table[index] >> shift) & 0xf) < 15) {
+                    table[index] += uint64_t(1) << shift;
+                    added = true;
+                }
+            }
+            if (added && ++samples >= sampleSize) {
+                for (auto& counters : table) {
+                    counters = (counters >> 1) & 0x7777777777777777ull;
+                }
+                samples /= 2;
+            }
+        }
+
+        uint32_t estimate(uint64_t hash) const {
+            uint32_t frequency = 15;
+            for (int row = 0; row < 4; ++row) {
+                frequency = std::min<uint32_t>(frequency, (table[indexOf(hash, row)] >> (row * 4)) & 0xf);
+            }
+            return frequency;
+        }
+
+    private:
+        size_t indexOf(uint64_t hash, int row) const {
+            static const uint64_t seeds[4] = {0xc3a5c85c97cb3127ull, 0xb492b66fbe98f273ull,
+                                              0x9ae16a3b2f90404full, 0xcbf29ce484222325ull};
+            uint64_t h = (hash + seeds[row]) * seeds[row];
+            return static_cast<size_t>((h ^ (h >> 32)) & mask);
+        }
+
+        std::vector<uint64_t> table; // Each word holds one counter per row
+        size_t mask = 0;
+        uint64_t sampleSize = 0;
+        uint64_t samples = 0;
+    };
+
+    struct Slot {
+        BlockKey key;
+        Block data; // Null for a free slot
+        bool referenced = false;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        std::unordered_map<BlockKey, size_t, BlockKeyHash> index;
+        std::vector<Slot> ring;
+        std::vector<size_t> freeSlots;
+        size_t hand = 0;
+        uint64_t usedBytes = 0;
+        uint64_t capacity = 0;
+        FrequencySketch sketch;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        uint64_t rejections = 0;
+    };
+
+    Shard& shardFor(const BlockKey& key) {
+        return shards[(BlockKeyHash()(key) >> 16) % shards.size()];
+    }
+
+    // Runs the CLOCK hand until `bytes` fit. Gives up if a victim is more popular than the candidate, or if
+    // a full sweep finds nothing evictable because everything is pinned.
+    bool makeRoom(Shard& shard, uint64_t bytes, uint32_t candidateFrequency) {
+        size_t steps = 0;
+        while (shard.usedBytes + bytes > shard.capacity) {
+            if (shard.ring.empty() || steps++ > 2 * shard.ring.size()) {
+                return false;
+            }
+
+            Slot& slot = shard.ring[shard.hand];
+            shard.hand = (shard.hand + 1) % shard.ring.size();
+            if (slot.data == nullptr || slot.data.use_count() > 1) {
+                continue; // Free, or pinned by a reader
+            }
+            if (slot.referenced) {
+                slot.referenced = false;
+                continue;
+            }
+            if (shard.sketch.estimate(BlockKeyHash()(slot.key)) >= candidateFrequency) {
+                return false;
+            }
+
+            shard.usedBytes -= slot.data->size();
+            totalUsed.fetch_sub(slot.data->size(), std::memory_order_relaxed);
+            shard.index.erase(slot.key);
+            slot.data = nullptr;
+            shard.freeSlots.push_back(static_cast<size_t>(&slot - shard.ring.data()));
+            shard.evictions++;
+        }
+        return true;
+    }
+
+    std::vector<Shard> shards;
+    std::atomic<uint64_t> totalUsed{0};
+};
+
+/*
+**Segment Log**
+
+Every appended record gets the next value of a global 64-bit sequence number, so "everything since X" is well
+defined no matter how segments are later merged or dropped. Each raw segment keeps a sparse index with one
+(sequence, file offset) pair per few KiB of records, and cold segments keep the first sequence of every block.
+Reading from a sequence is a binary search over the segments, a binary search inside the first one, and then
+a sequential scan.
+
+Records are also stamped with their ingest time. The log never lets the stamp go backwards, even if the wall
+clock does, so time order and sequence order agree: every segment knows its first and last timestamp, every
+index entry carries the timestamp of its record, and a time range is turned into a sequence range with the
+same two binary searches.
+
+Readers never take the log's lock. The list of segments they see is an immutable snapshot that every roll,
+compaction and drop replaces, and old snapshots are reclaimed by epoch (see pdn_containers.h).
+*/
+
+// One raw segment index entry per this many bytes of records
+constexpr uint64_t kSequenceIndexInterval = 4096;
+
+struct SequenceIndexEntry {
+    uint64_t sequence = 0;
+    uint64_t timestamp = 0;
+    uint64_t offset = 0; // Where the record with that sequence starts
+};
+
+struct Segment {
+    uint64_t firstId = 0;
+    uint64_t lastId = 0;
+    std::string path;
+    uint64_t sizeBytes = 0;
+    uint64_t recordCount = 0;
+    bool cold = false; // Block-compressed, see ColdSegment
+    std::shared_ptr<const BloomFilter> keyFilter; // Null only while the segment is active
+    uint64_t firstTimestamp = 0;                   // Ingest times of the oldest and newest record
+    uint64_t lastTimestamp = 0;
+    uint64_t latestExpiry = 0;                     // Largest expiresAt, or kNeverExpires
+    std::shared_ptr<const ColdSegment> coldFile;   // Open handle with the resident block index, if cold
+    uint64_t firstSequence = 0;                    // Sequence numbers of the oldest and newest record, 0 if empty
+    uint64_t lastSequence = 0;
+    SnapshotVector<SequenceIndexEntry> sequenceIndex; // Raw segments only, cold ones use their block index
+
+    // Where a read from `sequence` has to start: a file offset for raw segments, a block index for cold ones.
+    // The active segment's index grows concurrently, so the caller must hold an EpochManager::Guard.
+    uint64_t positionFor(uint64_t sequence) const {
+        if (cold) {
+            return coldFile != nullptr ? coldFile->blockFor(sequence) : 0;
+        }
+        auto [entries, count] = sequenceIndex.snapshot();
+        const SequenceIndexEntry* after = std::upper_bound(entries, entries + count, sequence,
+                                                           [](uint64_t value, const SequenceIndexEntry& entry) {
+                                                               return value < entry.sequence;
+                                                           });
+        return after == entries ? 0 : (after - 1)->offset;
+    }
+
+    // A sequence number no later than that of the first record ingested at or after `millis`, or UINT64_MAX
+    // if the segment is empty. Same guard requirement as positionFor().
+    uint64_t sequenceAtTime(uint64_t millis) const {
+        if (cold) {
+            return coldFile != nullptr ? coldFile->sequenceAtTime(millis) : firstSequence;
+        }
+        auto [entries, count] = sequenceIndex.snapshot();
+        if (count == 0) {
+            return UINT64_MAX;
+        }
+        const SequenceIndexEntry* atOrAfter = std::partition_point(entries, entries + count,
+                                                                   [&](const SequenceIndexEntry& entry) {
+                                                                       return entry.timestamp < millis;
+                                                                   });
+        return atOrAfter == entries ? entries[0].sequence : (atOrAfter - 1)->sequence;
+    }
+
+    // Records the sequence number and timestamp of a record that starts at `offset`. Writer only.
+    void indexRecord(uint64_t sequence, uint64_t timestamp, uint64_t offset) {
+        if (firstSequence == 0) {
+            firstSequence = sequence;
+            firstTimestamp = timestamp;
+        }
+        lastSequence = sequence;
+        lastTimestamp = std::max(lastTimestamp, timestamp);
+        auto [entries, count] = sequenceIndex.snapshot();
+        if (count == 0 || offset >= entries[count - 1].offset + kSequenceIndexInterval) {
+            sequenceIndex.push_back({sequence, timestamp, offset});
+        }
+    }
+};
+
+// Streams the records of one segment, raw or cold. Raw segments go through a bounded read buffer; cold blocks
+// are decoded in place, straight out of the block cache when one is given.
+class SegmentReader {
+public:
+    explicit SegmentReader(const Segment& segment, BlockCache* cache = nullptr, size_t bufferSize = 64 * 1024)
+        : path(segment.path), firstId(segment.firstId), lastId(segment.lastId), cache(cache) {
+        if (segment.cold) {
+            cold = segment.coldFile != nullptr ? segment.coldFile : std::make_shared<ColdSegment>(segment.path);
+        } else {
+            fd = ::open(path.c_str(), O_RDONLY);
+            buffer.resize(bufferSize);
+        }
+    }
+
+    ~SegmentReader() {
+        if (fd != -1) {
+            ::close(fd);
+        }
+    }
+
+    SegmentReader(const SegmentReader&) = delete;
+    SegmentReader& operator=(const SegmentReader&) = delete;
+
+    bool isOpen() const { return cold != nullptr ? cold->isOpen() : fd != -1; }
+
+    // Bytes pulled from disk so far, used by the compactor for rate limiting
+    uint64_t bytesRead() const { return totalRead; }
+
+    // Offset just past the last record returned by next(), for raw segments
+    uint64_t validBytes() const { return fileOffset - (end - begin); }
+
+    // Whether next() stopped at a record that failed its checksum rather than at the end of the file
+    bool corrupt() const { return corrupted; }
+
+    // Skips ahead to a position from Segment::positionFor(); must be called before the first next()
+    void seek(uint64_t position) {
+        if (cold != nullptr) {
+            nextBlock = static_cast<size_t>(position);
+        } else {
+            fileOffset = position;
+        }
+    }
+
+    bool next(Record& record) {
+        while (!corrupted) {
+            const char* data = cold != nullptr ? (block != nullptr ? block->data() : nullptr) : buffer.data();
+            size_t consumed = end > begin ? decodeRecord(data + begin, end - begin, record, corrupted) : 0;
+            if (consumed > 0) {
+                begin += consumed;
+                return true;
+            }
+            if (corrupted) {
+                std::cerr << "Error: Corrupt record in " << path << " at offset " << validBytes() << std::endl;
+                return false;
+            }
+            if (!(cold != nullptr ? fillFromBlock() : fill())) {
+                return false; // End of file, or a torn record at the tail
+            }
+        }
+        return false;
+    }
+
+private:
+    bool fill() {
+        if (fd == -1) {
+            return false;
+        }
+
+        // Move the unread tail to the front and grow the buffer if a single record does not fit
+        size_t pending = end - begin;
+        std::memmove(buffer.data(), buffer.data() + begin, pending);
+        begin = 0;
+        end = pending;
+        if (end == buffer.size()) {
+            buffer.resize(buffer.size() * 2);
+        }
+
+        ssize_t bytesRead = ::pread(fd, buffer.data() + end, buffer.size() - end, static_cast<off_t>(fileOffset));
+        if (bytesRead <= 0) {
+            return false;
+        }
+        end += static_cast<size_t>(bytesRead);
+        fileOffset += static_cast<uint64_t>(bytesRead);
+        totalRead += static_cast<uint64_t>(bytesRead);
+        return true;
+    }
+
+    // Blocks hold whole records, so the previous block is always fully consumed at this point. The current
+    // block stays pinned in the cache until the reader moves past it.
+    bool fillFromBlock() {
+        if (!cold->isOpen() || nextBlock >= cold->blockIndex().size()) {
+            return false;
+        }
+
+        BlockKey key{firstId, lastId, nextBlock++};
+        block = cache != nullptr ? cache->lookup(key) : nullptr;
+        if (block == nullptr) {
+            auto raw = std::make_shared<std::string>();
+            uint64_t bytesRead = cold->readBlock(key.block, *raw);
+            if (bytesRead == 0) {
+                corrupted = true;
+                return false;
+            }
+            totalRead += bytesRead;
+            block = std::move(raw);
+            if (cache != nullptr) {
+                cache->insert(key, block);
+            }
+        }
+        begin = 0;
+        end = block->size();
+        return true;
+    }
+
+    std::string path;
+    uint64_t firstId;
+    uint64_t lastId;
+    BlockCache* cache;
+    int fd = -1;
+    std::shared_ptr<const ColdSegment> cold;
+    BlockCache::Block block;
+    bool corrupted = false;
+    size_t nextBlock = 0;
+    std::vector<char> buffer;
+    size_t begin = 0;
+    size_t end = 0;
+    uint64_t fileOffset = 0;
+    uint64_t totalRead = 0;
+};
+
+class SegmentLog {
+public:
+    explicit SegmentLog(std::string directory, uint64_t maxSegmentBytes = 64ull << 20)
+        : directory(std::move(directory)), maxSegmentBytes(maxSegmentBytes) {}
+
+    ~SegmentLog() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closeActive();
+        delete published.load(std::memory_order_relaxed);
+    }
+
+    SegmentLog(const SegmentLog&) = delete;
+    SegmentLog& operator=(const SegmentLog&) = delete;
+
+    // Scans the directory, discards leftovers of interrupted compactions and opens a fresh active segment
+    bool open() {
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+        if (error) {
+            std::cerr << "Error: Cannot create " << directory << ": " << error.message() << std::endl;
+            return false;
+        }
+
+        std::vector<std::shared_ptr<Segment>> found;
+        for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+            std::string name = entry.path().filename().string();
+            if (endsWith(name, ".tmp")) {
+                std::filesystem::remove(entry.path(), error); // Unfinished compaction output
+                continue;
+            }
+
+            unsigned long long first = 0;
+            unsigned long long last = 0;
+            bool cold = endsWith(name, ".cold");
+            if ((!cold && !endsWith(name, ".log")) || std::sscanf(name.c_str(), "seg-%llu-%llu.", &first, &last) != 2) {
+                continue;
+            }
+
+            if (entry.file_size() == 0) {
+                std::filesystem::remove(entry.path(), error); // Active segment that never received a record
+                continue;
+            }
+
+            auto segment = std::make_shared<Segment>();
+            segment->firstId = first;
+            segment->lastId = last;
+            segment->path = entry.path().string();
+            segment->sizeBytes = entry.file_size();
+            segment->cold = cold;
+            found.push_back(segment);
+        }
+
+        std::sort(found.begin(), found.end(), [](const auto& a, const auto& b) {
+            return a->firstId != b->firstId ? a->firstId < b->firstId : a->lastId > b->lastId;
+        });
+
+        std::lock_guard<std::mutex> lock(mutex);
+        sealed.clear();
+        for (const auto& segment : found) {
+            if (!sealed.empty() && segment->lastId <= sealed.back()->lastId) {
+                // Covered by a compacted segment that was renamed into place before its inputs were removed
+                std::filesystem::remove(segment->path, error);
+                continue;
+            }
+            sealed.push_back(segment);
+            nextId = segment->lastId + 1;
+        }
+
+        // Cold segments carry their bloom filter; raw ones are scanned to rebuild it. Only the segment that
+        // was active when we stopped can end in a torn write, the rest were fsynced when they were sealed.
+        for (const auto& segment : sealed) {
+            if (segment->cold) {
+                auto cold = std::make_shared<ColdSegment>(segment->path);
+                segment->keyFilter = cold->keyFilter();
+                segment->firstTimestamp = cold->firstTimestamp();
+                segment->lastTimestamp = cold->lastTimestamp();
+                segment->latestExpiry = cold->isOpen() ? cold->maxExpiry() : kNeverExpires;
+                segment->firstSequence = cold->firstSequence();
+                segment->lastSequence = cold->lastSequence();
+                segment->coldFile = std::move(cold);
+            } else {
+                scanRawSegment(*segment, segment == sealed.back());
+            }
+            nextSequence = std::max(nextSequence, segment->lastSequence + 1);
+            lastTimestamp = std::max(lastTimestamp, segment->lastTimestamp);
+        }
+
+        // Retention may have dropped every segment, so the floor file keeps sequences from going backwards
+        nextSequence = std::max(nextSequence, readSequenceFloor());
+        return saveSequenceFloor() && openActive();
+    }
+
+    // `segmentId` and `sequence`, if given, receive the id of the segment the record was written to and the
+    // sequence number it was assigned. The record's own sequence and timestamp fields are ignored.
+    bool append(const Record& record, uint64_t* segmentId = nullptr, uint64_t* sequence = nullptr) {
+        return appendBatch(&record, 1, segmentId, sequence);
+    }
+
+    // Appends `count` records with one lock acquisition and one write(). They all land in the same segment, so
+    // a segment can overshoot the size limit by up to one batch. `firstSequence`, if given, receives the
+    // sequence number of records[0]; the others follow consecutively.
+    bool appendBatch(const Record* records, size_t count, uint64_t* segmentId = nullptr,
+                     uint64_t* firstSequence = nullptr) {
+        size_t totalSize = 0;
+        for (size_t i = 0; i < count; ++i) {
+            totalSize += kRecordHeaderSize + records[i].key.size() + records[i].data.size();
+        }
+        std::string encoded;
+        encoded.reserve(totalSize);
+        for (size_t i = 0; i < count; ++i) {
+            encodeRecord(records[i], encoded);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (rollPending && !finishRoll()) {
+            return false;
+        }
+        if (activeFd == -1) {
+            return false;
+        }
+
+        // Sequence numbers and timestamps follow the log order, so they can only be handed out under the write
+        // lock. A clock that stepped back is held at the last timestamp given out.
+        lastTimestamp = std::max(lastTimestamp, nowMillis());
+        size_t offset = 0;
+        for (size_t i = 0; i < count; ++i) {
+            size_t length = kRecordHeaderSize + records[i].key.size() + records[i].data.size();
+            stampRecord(&encoded[offset], length, nextSequence + i, lastTimestamp);
+            offset += length;
+        }
+        if (!writeFully(activeFd, encoded.data(), encoded.size())) {
+            std::cerr << "Error: Write to " << active->path << " failed" << std::endl;
+            // Part of the batch may have reached the file. Cut it off so the next batch does not land behind
+            // torn bytes; if even that fails, stop writing until recovery truncates the torn tail on restart.
+            if (::ftruncate(activeFd, static_cast<off_t>(active->sizeBytes)) != 0) {
+                std::cerr << "Error: Cannot truncate " << active->path << ", no more writes" << std::endl;
+                ::close(activeFd);
+                activeFd = -1;
+            }
+            return false;
+        }
+
+        if (firstSequence != nullptr) {
+            *firstSequence = nextSequence;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            const Record& record = records[i];
+            active->indexRecord(nextSequence++, lastTimestamp, active->sizeBytes);
+            active->sizeBytes += kRecordHeaderSize + record.key.size() + record.data.size();
+            active->recordCount++;
+            activeKeyHashes.push_back(hashKey(record.key));
+            active->latestExpiry = std::max(active->latestExpiry,
+                                            record.expiresAt == 0 ? kNeverExpires : record.expiresAt);
+        }
+        foregroundBytes.fetch_add(encoded.size(), std::memory_order_relaxed);
+        if (segmentId != nullptr) {
+            *segmentId = active->firstId;
+        }
+
+        // The batch is written either way; if the roll fails, the next append retries it and fails instead
+        if (active->sizeBytes >= maxSegmentBytes) {
+            roll();
+        }
+        return true;
+    }
+
+    // Makes everything appended so far durable. Segments are synced when they are sealed, so only the active
+    // one is left.
+    bool sync() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (activeFd != -1 && ::fdatasync(activeFd) != 0) {
+            std::cerr << "Error: Cannot sync " << active->path << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Seals the active segment even if it has not reached the size limit yet
+    bool flush() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (rollPending) {
+            return finishRoll();
+        }
+        if (active == nullptr || active->recordCount == 0) {
+            return true;
+        }
+        return roll();
+    }
+
+    // Sealed segments, oldest first. The returned pointers stay valid after compaction replaces them.
+    std::vector<std::shared_ptr<Segment>> sealedSegments() const {
+        EpochManager::Guard guard;
+        const SegmentList* list = published.load(std::memory_order_acquire);
+        return list != nullptr ? list->sealed : std::vector<std::shared_ptr<Segment>>();
+    }
+
+    // Segments, the active one included, that may hold records with a sequence number of at least
+    // `fromSequence`, oldest first. `startPosition` receives where to start reading the first of them.
+    std::vector<std::shared_ptr<Segment>> segmentsSince(uint64_t fromSequence, uint64_t& startPosition) const {
+        EpochManager::Guard guard;
+        const SegmentList* list = published.load(std::memory_order_acquire);
+        startPosition = 0;
+        if (list == nullptr) {
+            return {};
+        }
+
+        auto first = std::partition_point(list->sealed.begin(), list->sealed.end(), [&](const auto& segment) {
+            return segment->lastSequence < fromSequence;
+        });
+        std::vector<std::shared_ptr<Segment>> result(first, list->sealed.end());
+        if (list->active != nullptr) {
+            result.push_back(list->active); // Its sequence range is still moving, so it is always included
+        }
+        if (!result.empty()) {
+            startPosition = result.front()->positionFor(fromSequence);
+        }
+        return result;
+    }
+
+    // A sequence number no later than that of the first record ingested at or after `millis`, or UINT64_MAX if
+    // no such record exists yet. Timestamps rise with sequence numbers, so a read from here that stops at the
+    // first record past the end of a time range covers exactly that range.
+    uint64_t sequenceAtTime(uint64_t millis) const {
+        EpochManager::Guard guard;
+        const SegmentList* list = published.load(std::memory_order_acquire);
+        if (list == nullptr) {
+            return UINT64_MAX;
+        }
+
+        auto first = std::partition_point(list->sealed.begin(), list->sealed.end(), [&](const auto& segment) {
+            return segment->lastTimestamp < millis;
+        });
+        if (first != list->sealed.end()) {
+            return (*first)->sequenceAtTime(millis);
+        }
+        return list->active != nullptr ? list->active->sequenceAtTime(millis) : UINT64_MAX;
+    }
+
+    // Sequence number the next append will get
+    uint64_t nextSequenceNumber() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return nextSequence;
+    }
+
+    // Sealed segments compaction may rewrite: those entirely below the horizon set by the hot tier
+    std::vector<std::shared_ptr<Segment>> compactableSegments() const {
+        uint64_t horizon = compactionHorizon.load(std::memory_order_acquire);
+        EpochManager::Guard guard;
+        const SegmentList* list = published.load(std::memory_order_acquire);
+        std::vector<std::shared_ptr<Segment>> result;
+        if (list == nullptr) {
+            return result;
+        }
+        for (const auto& segment : list->sealed) {
+            if (segment->lastId >= horizon) {
+                break;
+            }
+            result.push_back(segment);
+        }
+        return result;
+    }
+
+    // Removes one sealed segment from the log and from disk
+    void dropSegment(const std::shared_ptr<Segment>& segment) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = std::find(sealed.begin(), sealed.end(), segment);
+            if (found == sealed.end()) {
+                return;
+            }
+            sealed.erase(found);
+            publish();
+        }
+        std::error_code error;
+        std::filesystem::remove(segment->path, error);
+    }
+
+    // Bytes on disk across all segments, including the active one
+    uint64_t totalBytes() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t total = active != nullptr ? active->sizeBytes : 0;
+        for (const auto& segment : sealed) {
+            total += segment->sizeBytes;
+        }
+        return total;
+    }
+
+    void setCompactionHorizon(uint64_t segmentId) {
+        compactionHorizon.store(segmentId, std::memory_order_release);
+    }
+
+    // Swaps a run of the oldest sealed segments for their compacted replacement (nullptr if nothing survived)
+    void replaceSegments(const std::vector<std::shared_ptr<Segment>>& inputs, std::shared_ptr<Segment> merged) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto first = std::find(sealed.begin(), sealed.end(), inputs.front());
+            if (first == sealed.end()) {
+                return;
+            }
+            auto position = sealed.erase(first, first + static_cast<std::ptrdiff_t>(inputs.size()));
+            if (merged != nullptr) {
+                sealed.insert(position, std::move(merged));
+            }
+            publish();
+        }
+
+        // Unlink outside the lock. If we crash half way, open() recognises the rest as covered by `merged`.
+        std::error_code error;
+        for (const auto& input : inputs) {
+            std::filesystem::remove(input->path, error);
+        }
+    }
+
+    std::string segmentPath(uint64_t firstId, uint64_t lastId, bool cold = false) const {
+        return directory + "/seg-" + std::to_string(firstId) + "-" + std::to_string(lastId) + (cold ? ".cold" : ".log");
+    }
+
+    uint64_t totalForegroundBytes() const { return foregroundBytes.load(std::memory_order_relaxed); }
+
+    // Id of the segment appends currently go to
+    uint64_t activeSegmentId() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return active != nullptr ? active->firstId : 0;
+    }
+
+private:
+    bool openActive() {
+        active = std::make_shared<Segment>();
+        active->firstId = nextId;
+        active->lastId = nextId;
+        active->path = segmentPath(nextId, nextId);
+        nextId++;
+
+        activeFd = ::open(active->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        publish();
+        if (activeFd == -1) {
+            std::cerr << "Error: Cannot open segment " << active->path << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void closeActive() {
+        if (activeFd != -1) {
+            ::fsync(activeFd);
+            ::close(activeFd);
+            activeFd = -1;
+        }
+    }
+
+    void scanRawSegment(Segment& segment, bool truncateTornTail) {
+        SegmentReader reader(segment);
+        std::vector<uint64_t> keyHashes;
+        Record record;
+        uint64_t offset = 0;
+        while (reader.next(record)) {
+            segment.indexRecord(record.sequence, record.timestamp, offset);
+            offset = reader.validBytes();
+            keyHashes.push_back(hashKey(record.key));
+            segment.latestExpiry = std::max(segment.latestExpiry,
+                                            record.expiresAt == 0 ? kNeverExpires : record.expiresAt);
+        }
+        segment.recordCount = keyHashes.size();
+        segment.keyFilter = buildFilter(keyHashes);
+
+        if (truncateTornTail && reader.validBytes() < segment.sizeBytes) {
+            std::cerr << "Warning: Truncating " << segment.path << " from " << segment.sizeBytes << " to "
+                      << reader.validBytes() << " bytes" << std::endl;
+            if (::truncate(segment.path.c_str(), static_cast<off_t>(reader.validBytes())) == 0) {
+                segment.sizeBytes = reader.validBytes();
+            }
+        }
+    }
+
+    static std::shared_ptr<const BloomFilter> buildFilter(const std::vector<uint64_t>& keyHashes) {
+        auto filter = std::make_shared<BloomFilter>(keyHashes.size());
+        for (uint64_t hash : keyHashes) {
+            filter->add(hash);
+        }
+        return filter;
+    }
+
+    bool roll() {
+        closeActive();
+        active->keyFilter = buildFilter(activeKeyHashes);
+        activeKeyHashes.clear();
+        sealed.push_back(active);
+        return finishRoll();
+    }
+
+    // The part of a roll that can fail once the old segment is sealed. Until it succeeds no record is written.
+    bool finishRoll() {
+        rollPending = !(saveSequenceFloor() && openActive());
+        return !rollPending;
+    }
+
+    // Replaces the list lock-free readers see. Caller holds mutex.
+    void publish() {
+        auto* list = new SegmentList{sealed, active};
+        EpochManager::instance().retire(published.exchange(list, std::memory_order_acq_rel));
+    }
+
+    std::string sequenceFloorPath() const { return directory + "/sequence"; }
+
+    uint64_t readSequenceFloor() const {
+        unsigned long long floor = 0;
+        if (FILE* file = std::fopen(sequenceFloorPath().c_str(), "r")) {
+            if (std::fscanf(file, "%llu", &floor) != 1) {
+                floor = 0;
+            }
+            std::fclose(file);
+        }
+        return floor;
+    }
+
+    // Written on every roll, so it never lags the sealed segments. Replaced atomically through a rename.
+    bool saveSequenceFloor() const {
+        std::string tmpPath = sequenceFloorPath() + ".tmp";
+        std::string contents = std::to_string(nextSequence) + "\n";
+        int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool ok = fd != -1 && writeFully(fd, contents.data(), contents.size()) && ::fsync(fd) == 0;
+        if (fd != -1) {
+            ::close(fd);
+        }
+        if (!ok || std::rename(tmpPath.c_str(), sequenceFloorPath().c_str()) != 0) {
+            std::cerr << "Error: Cannot save " << sequenceFloorPath() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    std::string directory;
+    uint64_t maxSegmentBytes;
+
+    // What readers see instead of `sealed` and `active`: an immutable copy, replaced whenever either changes
+    struct SegmentList {
+        std::vector<std::shared_ptr<Segment>> sealed;
+        std::shared_ptr<Segment> active;
+    };
+
+    mutable std::mutex mutex; // Serialises writers; readers go through `published`
+    std::vector<std::shared_ptr<Segment>> sealed;
+    std::shared_ptr<Segment> active;
+    std::atomic<const SegmentList*> published{nullptr};
+    std::vector<uint64_t> activeKeyHashes;
+    int activeFd = -1;
+    bool rollPending = false; // The active segment was sealed, but saving the floor or opening the next failed
+    uint64_t nextId = 1;
+    uint64_t nextSequence = 1; // 0 is never assigned, so it can stand for "no record"
+    uint64_t lastTimestamp = 0;
+    std::atomic<uint64_t> foregroundBytes{0};
+    std::atomic<uint64_t> compactionHorizon{UINT64_MAX};
+};
+
+/*
+**Rate Limiter**
+*/
+
+// Token bucket measured in bytes. Requests larger than the bucket are allowed to drive it negative, so a
+// single large write is paced by the following ones instead of blocking forever.
+class RateLimiter {
+public:
+    explicit RateLimiter(uint64_t bytesPerSecond, uint64_t burstBytes = 0)
+        : bytesPerSecond(bytesPerSecond),
+          burstBytes(burstBytes != 0 ? burstBytes : std::max<uint64_t>(bytesPerSecond / 10, 1)),
+          tokens(static_cast<double>(this->burstBytes)),
+          lastRefill(std::chrono::steady_clock::now()) {}
+
+    void acquire(uint64_t bytes) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (bytesPerSecond == 0) {
+            return; // Unlimited
+        }
+
+        refill();
+        tokens -= static_cast<double>(bytes);
+        if (tokens < 0) {
+            auto wait = std::chrono::duration<double>(-tokens / static_cast<double>(bytesPerSecond));
+            lock.unlock();
+            std::this_thread::sleep_for(wait);
+        }
+    }
+
+    void setRate(uint64_t newBytesPerSecond) {
+        std::lock_guard<std::mutex> lock(mutex);
+        refill();
+        bytesPerSecond = newBytesPerSecond;
+    }
+
+private:
+    void refill() {
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - lastRefill).count();
+        lastRefill = now;
+        tokens = std::min(static_cast<double>(burstBytes), tokens + elapsed * static_cast<double>(bytesPerSecond));
+    }
+
+    std::mutex mutex;
+    uint64_t bytesPerSecond;
+    uint64_t burstBytes;
+    double tokens;
+    std::chrono::steady_clock::time_point lastRefill;
+};
+
+/*
+**Retention**
+*/
+
+struct RetentionPolicy {
+    uint64_t maxAgeMillis = 0;   // Drop segments whose newest record is older than this, 0 keeps forever
+    uint64_t maxTotalBytes = 0;  // Drop the oldest segments while the log is larger than this, 0 is unlimited
+    uint64_t defaultTtlMillis = 0;                                // TTL of keys not listed below, 0 is none
+    std::unordered_map<std::string, uint64_t> keyTtlMillis;       // Per-key TTL overrides
+
+    // expiresAt for a record of `key` appended at `now` that did not ask for an expiry itself
+    uint64_t expiryFor(const std::string& key, uint64_t now) const {
+        auto found = keyTtlMillis.find(key);
+        uint64_t ttl = found != keyTtlMillis.end() ? found->second : defaultTtlMillis;
+        return ttl == 0 ? 0 : now + ttl;
+    }
+};
+
+/*
+**Compaction**
+*/
+
+struct CompactionOptions {
+    uint64_t bytesPerSecond = 16ull << 20; // Combined read and write budget, 0 disables the limit
+    size_t minSegmentsToMerge = 4;
+    size_t maxSegmentsToMerge = 16;
+    uint64_t tierRatio = 4; // Segments merged together differ in size by at most this factor
+    std::chrono::milliseconds checkInterval{1000};
+    bool lowerPriority = true;
+    size_t coldBlockBytes = 64 * 1024; // Uncompressed size of one block in a cold segment
+    int compressionLevel = 1;
+    RetentionPolicy retention;         // Enforced by the same thread, before each compaction
+};
+
+struct CompactionMetrics {
+    uint64_t foregroundBytes = 0;
+    uint64_t compactionBytesRead = 0;
+    uint64_t compactionBytesWritten = 0;
+    uint64_t compactionsRun = 0;
+    uint64_t recordsDropped = 0;
+    uint64_t compactionDebtBytes = 0; // Bytes of sealed segments the policy wants merged but has not yet
+    uint64_t segmentsDropped = 0;     // Whole segments removed by retention
+    uint64_t bytesDropped = 0;
+
+    // Bytes written to disk per byte appended by clients
+    double writeAmplification() const {
+        if (foregroundBytes == 0) {
+            return 1.0;
+        }
+        return static_cast<double>(foregroundBytes + compactionBytesWritten) / static_cast<double>(foregroundBytes);
+    }
+};
+
+class CompactionScheduler {
+public:
+    explicit CompactionScheduler(SegmentLog& log, CompactionOptions options = {})
+        : log(log), options(options), limiter(options.bytesPerSecond) {}
+
+    ~CompactionScheduler() { stop(); }
+
+    CompactionScheduler(const CompactionScheduler&) = delete;
+    CompactionScheduler& operator=(const CompactionScheduler&) = delete;
+
+    void start() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (worker.joinable()) {
+            return;
+        }
+        stopping = false;
+        worker = std::thread([this] { run(); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    // Drops whole segments that fell out of the retention window. Each drop is O(1): an unlink and a list
+    // removal, regardless of how many records the segment holds.
+    void enforceRetention() {
+        const RetentionPolicy& policy = options.retention;
+        uint64_t now = nowMillis();
+        uint64_t totalBytes = log.totalBytes();
+
+        std::vector<std::shared_ptr<Segment>> segments = log.compactableSegments();
+        size_t droppedCount = 0;
+        for (size_t i = 0; i < segments.size(); ++i) {
+            const auto& segment = segments[i];
+
+            // Age and size limits only ever remove a prefix of the log, oldest first
+            bool prefix = droppedCount == i;
+            bool tooOld = policy.maxAgeMillis != 0 && segment->lastTimestamp + policy.maxAgeMillis <= now;
+            bool overBudget = policy.maxTotalBytes != 0 && totalBytes > policy.maxTotalBytes;
+            bool allExpired = segment->latestExpiry != kNeverExpires && segment->latestExpiry <= now;
+
+            if ((prefix && (tooOld || overBudget)) || allExpired) {
+                log.dropSegment(segment);
+                droppedCount++;
+                totalBytes -= segment->sizeBytes;
+                segmentsDropped.fetch_add(1, std::memory_order_relaxed);
+                bytesDropped.fetch_add(segment->sizeBytes, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Merges one run of segments if the policy asks for it. Returns false if there was nothing to do.
+    bool compactOnce() {
+        std::vector<std::shared_ptr<Segment>> segments = log.compactableSegments();
+        std::vector<std::shared_ptr<Segment>> inputs = pickInputs(segments);
+        if (inputs.empty()) {
+            return false;
+        }
+
+        // Copy the unexpired records into a block-compressed cold segment
+        auto merged = std::make_shared<Segment>();
+        merged->firstId = inputs.front()->firstId;
+        merged->lastId = inputs.back()->lastId;
+        merged->cold = true;
+        merged->firstSequence = inputs.front()->firstSequence;
+        merged->lastSequence = inputs.back()->lastSequence;
+        merged->firstTimestamp = inputs.front()->firstTimestamp;
+        merged->lastTimestamp = inputs.back()->lastTimestamp;
+        merged->path = log.segmentPath(merged->firstId, merged->lastId, true);
+        std::string tmpPath = merged->path + ".tmp";
+
+        int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            std::cerr << "Error: Cannot create " << tmpPath << std::endl;
+            return false;
+        }
+
+        ColdSegmentWriter writer(fd, options.coldBlockBytes, options.compressionLevel);
+        uint64_t now = nowMillis();
+        uint64_t dropped = 0;
+        uint64_t writeAccounted = 0;
+        bool ok = true;
+        for (const auto& input : inputs) {
+            SegmentReader reader(*input);
+            Record record;
+            uint64_t accounted = 0;
+            while (ok && reader.next(record)) {
+                accounted = throttleRead(reader.bytesRead(), accounted);
+                if (record.expiresAt != 0 && record.expiresAt <= now) {
+                    dropped++;
+                    continue;
+                }
+
+                ok = writer.add(record);
+                merged->recordCount++;
+                writeAccounted = throttleWrite(writer.bytesWritten(), writeAccounted);
+            }
+            if (ok && (!reader.isOpen() || reader.corrupt())) {
+                // Never install an output built from a segment we could not fully verify; its inputs would be
+                // deleted afterwards
+                std::cerr << "Error: Skipping compaction of unreadable segment " << input->path << std::endl;
+                ok = false;
+            }
+        }
+        if (ok) {
+            ok = writer.finish();
+            throttleWrite(writer.bytesWritten(), writeAccounted);
+        }
+        if (ok) {
+            ok = ::fsync(fd) == 0;
+        }
+        ::close(fd);
+
+        std::error_code error;
+        if (!ok) {
+            std::cerr << "Error: Compaction of " << merged->path << " failed" << std::endl;
+            std::filesystem::remove(tmpPath, error);
+            return false;
+        }
+
+        if (merged->recordCount == 0) {
+            std::filesystem::remove(tmpPath, error);
+            merged = nullptr;
+        } else {
+            merged->sizeBytes = std::filesystem::file_size(tmpPath, error);
+            merged->keyFilter = writer.keyFilter();
+            merged->latestExpiry = writer.maxExpiry();
+            std::filesystem::rename(tmpPath, merged->path, error);
+            if (error) {
+                std::cerr << "Error: Cannot install " << merged->path << ": " << error.message() << std::endl;
+                std::filesystem::remove(tmpPath, error);
+                return false;
+            }
+            merged->coldFile = std::make_shared<ColdSegment>(merged->path);
+        }
+
+        log.replaceSegments(inputs, merged);
+        compactionsRun.fetch_add(1, std::memory_order_relaxed);
+        recordsDropped.fetch_add(dropped, std::memory_order_relaxed);
+        return true;
+    }
+
+    const RetentionPolicy& retention() const { return options.retention; }
+
+    CompactionMetrics metrics() const {
+        CompactionMetrics result;
+        result.foregroundBytes = log.totalForegroundBytes();
+        result.compactionBytesRead = bytesRead.load(std::memory_order_relaxed);
+        result.compactionBytesWritten = bytesWritten.load(std::memory_order_relaxed);
+        result.compactionsRun = compactionsRun.load(std::memory_order_relaxed);
+        result.recordsDropped = recordsDropped.load(std::memory_order_relaxed);
+        result.segmentsDropped = segmentsDropped.load(std::memory_order_relaxed);
+        result.bytesDropped = bytesDropped.load(std::memory_order_relaxed);
+        for (const auto& segment : pickInputs(log.compactableSegments())) {
+            result.compactionDebtBytes += segment->sizeBytes;
+        }
+        return result;
+    }
+
+private:
+    void run() {
+        if (options.lowerPriority) {
+            lowerThreadPriority();
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            lock.unlock();
+            enforceRetention();
+            bool didWork = compactOnce();
+            lock.lock();
+
+            // Keep going while there is debt, otherwise sleep until the next check
+            if (!didWork) {
+                wakeup.wait_for(lock, options.checkInterval, [this] { return stopping; });
+            }
+        }
+    }
+
+    static void lowerThreadPriority() {
+#ifdef __linux__
+        // Nice value and I/O class are per thread on Linux, so this leaves the ingest threads untouched
+        pid_t tid = static_cast<pid_t>(::syscall(SYS_gettid));
+        ::setpriority(PRIO_PROCESS, static_cast<id_t>(tid), 19);
+
+        const int ioprioWhoProcess = 1;
+        const int ioprioClassIdle = 3;
+        ::syscall(SYS_ioprio_set, ioprioWhoProcess, tid, ioprioClassIdle << 13);
+#endif
+    }
+
+    // Size-tiered selection: the oldest run of at least minSegmentsToMerge adjacent segments whose sizes are
+    // within `tierRatio` of each other. A large merged output is left alone until its neighbours have grown to
+    // its size, so the retained prefix is not rewritten every few rolls.
+    std::vector<std::shared_ptr<Segment>> pickInputs(const std::vector<std::shared_ptr<Segment>>& segments) const {
+        size_t minimum = std::max<size_t>(options.minSegmentsToMerge, 2);
+        for (size_t start = 0; start + minimum <= segments.size(); ++start) {
+            uint64_t smallest = std::max<uint64_t>(segments[start]->sizeBytes, 1);
+            uint64_t largest = smallest;
+            size_t end = start + 1;
+            while (end < segments.size() && end - start < options.maxSegmentsToMerge) {
+                uint64_t size = std::max<uint64_t>(segments[end]->sizeBytes, 1);
+                if (std::max(largest, size) > std::min(smallest, size) * std::max<uint64_t>(options.tierRatio, 1)) {
+                    break;
+                }
+                smallest = std::min(smallest, size);
+                largest = std::max(largest, size);
+                end++;
+            }
+            if (end - start >= minimum) {
+                return std::vector<std::shared_ptr<Segment>>(segments.begin() + static_cast<std::ptrdiff_t>(start),
+                                                             segments.begin() + static_cast<std::ptrdiff_t>(end));
+            }
+        }
+        return {};
+    }
+
+    uint64_t throttleRead(uint64_t readSoFar, uint64_t accounted) {
+        if (readSoFar > accounted) {
+            limiter.acquire(readSoFar - accounted);
+            bytesRead.fetch_add(readSoFar - accounted, std::memory_order_relaxed);
+        }
+        return readSoFar;
+    }
+
+    uint64_t throttleWrite(uint64_t writtenSoFar, uint64_t accounted) {
+        if (writtenSoFar > accounted) {
+            limiter.acquire(writtenSoFar - accounted);
+            bytesWritten.fetch_add(writtenSoFar - accounted, std::memory_order_relaxed);
+        }
+        return writtenSoFar;
+    }
+
+    SegmentLog& log;
+    CompactionOptions options;
+    RateLimiter limiter;
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::thread worker;
+    bool stopping = false;
+
+    std::atomic<uint64_t> bytesRead{0};
+    std::atomic<uint64_t> bytesWritten{0};
+    std::atomic<uint64_t> compactionsRun{0};
+    std::atomic<uint64_t> recordsDropped{0};
+    std::atomic<uint64_t> segmentsDropped{0};
+    std::atomic<uint64_t> bytesDropped{0};
+};
+
+/*
+**Tiered Storage**
+
+Memory is accounted in bytes actually allocated: arena chunks (payloads and the overflow of long per-key
+histories), hash table slots and out-of-line keys, plus the decompressed blocks in the cache. When the total exceeds the
+global budget the oldest hot segments are spilled, which only means forgetting them, since every record was
+written to its segment file before it was acknowledged. If the active segment alone is over budget it is
+sealed early so it can be spilled too. Ingest therefore slows down to disk speed instead of running out of
+memory.
+
+Keys are grouped into namespaces by the part before their first '/'. The bytes of keys, payloads and entries
+are also attributed to their namespace; chunk and table overhead is only accounted per hot segment.
+*/
+
+struct TieringOptions {
+    uint64_t memoryBudgetBytes = 320ull << 20; // Hot segments and block cache together
+    uint64_t blockCacheBytes = 64ull << 20;    // Upper bound for decompressed cold blocks, within the budget
+    size_t blockCacheShards = 16;
+    // The active segment is only sealed early once it holds this many bytes of records, so a budget below the
+    // fixed cost of a hot segment cannot turn every append into a roll
+    uint64_t minForcedRollBytes = 1ull << 20;
+};
+
+struct HotSegmentMemory {
+    uint64_t segmentId = 0;
+    uint64_t arenaBytes = 0; // Payload and long-history chunks, used or not
+    uint64_t indexBytes = 0; // Hash table, keys and inline histories
+};
+
+struct NamespaceMemory {
+    std::string name;
+    uint64_t bytes = 0;
+};
+
+struct MemoryMetrics {
+    uint64_t budgetBytes = 0;
+    uint64_t hotBytes = 0;
+    uint64_t blockCacheBytes = 0;
+    uint64_t segmentsSpilled = 0; // Hot segments dropped from memory to get back under the budget
+    uint64_t forcedRolls = 0;     // Active segments sealed early because they alone exceeded the budget
+    std::vector<HotSegmentMemory> segments;
+    std::vector<NamespaceMemory> namespaces;
+};
+
+// Everything before the first '/', or the empty default namespace
+inline std::string keyNamespace(const std::string& key) {
+    size_t slash = key.find('/');
+    return slash == std::string::npos ? std::string() : key.substr(0, slash);
+}
+
+struct TieringMetrics {
+    uint64_t hotBytes = 0;
+    uint64_t hotSegments = 0;
+    uint64_t coldSegmentsRead = 0;
+    uint64_t diskBytesRead = 0;
+    uint64_t segmentsSkipped = 0; // Ruled out by their bloom filter without touching the disk
+};
+
+// Serves the recent segments from memory and everything older from the (mostly cold) segment files
+class TieredStore {
+public:
+    explicit TieredStore(SegmentLog& log, TieringOptions options = {})
+        : log(log), options(options), cache(options.blockCacheBytes, options.blockCacheShards) {}
+
+    ~TieredStore() {
+        const HotList* list = hotList.load(std::memory_order_relaxed);
+        if (list != nullptr) {
+            for (HotSegment* segment : list->segments) {
+                delete segment;
+            }
+            delete list;
+        }
+    }
+
+    TieredStore(const TieredStore&) = delete;
+    TieredStore& operator=(const TieredStore&) = delete;
+
+    // Safe to call from many threads. Appends to different keys only meet on the log's write lock; appends to
+    // the same key are serialised by a key stripe so the in-memory order always matches the log order.
+    // `sequence`, if given, receives the sequence number the record was assigned.
+    bool append(const Record& record, uint64_t* sequence = nullptr) {
+        return appendBatch(&record, 1, sequence);
+    }
+
+    // Appends `count` records with a single log write. The key stripes of all of them are held until the batch
+    // is in memory too. `firstSequence`, if given, receives the sequence number of records[0].
+    bool appendBatch(const Record* records, size_t count, uint64_t* firstSequence = nullptr) {
+        uint64_t stripeMask = 0;
+        for (size_t i = 0; i < count; ++i) {
+            stripeMask |= uint64_t(1) << (hashKey(records[i].key) % kAppendStripes);
+        }
+        StripeLocks stripes(appendStripes, stripeMask);
+
+        uint64_t segmentId = 0;
+        if (!log.appendBatch(records, count, &segmentId, firstSequence)) {
+            return false;
+        }
+
+        bool arenaFull = false;
+        {
+            EpochManager::Guard guard;
+            HotSegment* segment = findHot(hotList.load(std::memory_order_acquire), segmentId);
+            if (segment == nullptr) {
+                addHot(segmentId);
+                segment = findHot(hotList.load(std::memory_order_acquire), segmentId);
+                if (segment == nullptr) {
+                    return true; // The segment was already evicted, so these records are served from disk
+                }
+            }
+
+            for (size_t i = 0; i < count; ++i) {
+                const Record& record = records[i];
+
+                // Copy the payload into the segment's arena outside the shard lock
+                Arena::Handle payload;
+                if (record.type != RecordType::Tombstone) {
+                    std::string expiry;
+                    putFixed64(expiry, record.expiresAt);
+                    payload = segment->payloads.store(expiry, record.data);
+                }
+                arenaFull = payload.failed();
+                if (arenaFull) {
+                    break;
+                }
+                segment->transactions.upsert(record.key, hashKey(record.key), [&](KeyHistory& history) {
+                    if (record.type == RecordType::Tombstone) {
+                        history.tombstoned = true;
+                        history.clear();
+                    } else {
+                        arenaFull = !history.push_back({payload}, segment->payloads);
+                    }
+                });
+                if (arenaFull) {
+                    break;
+                }
+
+                std::string name = keyNamespace(record.key);
+                uint64_t attributed = record.key.size() + record.data.size() + kHotExpiryBytes + sizeof(HotEntry);
+                segment->namespaceBytes.upsert(name, hashKey(name), [&](uint64_t& bytes) { bytes += attributed; });
+                segment->recordBytes.fetch_add(attributed, std::memory_order_relaxed);
+            }
+        }
+
+        // The batch is in the log, so it is not failed; the segment's records are read from disk instead
+        if (arenaFull) {
+            dropIncomplete(segmentId);
+        }
+        if (memoryBytes() > options.memoryBudgetBytes) {
+            spill();
+        }
+        return true;
+    }
+
+    // Makes every transaction appended so far durable. One call covers all the batches written before it.
+    bool sync() { return log.sync(); }
+
+    // Every live transaction of `key`, oldest first. `asOf`, if given, receives a sequence number such that
+    // the result holds every transaction of the key up to it and none after it.
+    std::vector<std::string> history(const std::string& key, uint64_t* asOf = nullptr) {
+        // Copy the hot part inside an epoch, then read the disk part below the hot horizon. Payloads live in
+        // the hot segments' arenas, which eviction frees once the epoch is left, so they are copied out first.
+        // The key's append stripe keeps a transaction from being in the log but not yet in the hot tier.
+        uint64_t hash = hashKey(key);
+        uint64_t now = nowMillis();
+        uint64_t horizon = UINT64_MAX;
+        bool hotTombstone = false;
+        std::vector<std::string> hotPart;
+        {
+            StripeLocks stripe(appendStripes, asOf != nullptr ? uint64_t(1) << (hash % kAppendStripes) : 0);
+            if (asOf != nullptr) {
+                *asOf = log.nextSequenceNumber() - 1;
+            }
+            EpochManager::Guard guard;
+            const HotList* list = hotList.load(std::memory_order_acquire);
+            if (list != nullptr && !list->segments.empty()) {
+                horizon = list->segments.front()->segmentId;
+            }
+            for (const HotSegment* segment : list != nullptr ? list->segments : noSegments) {
+                segment->transactions.find(key, hash, [&](const KeyHistory& history) {
+                    if (history.tombstoned) {
+                        hotTombstone = true;
+                        hotPart.clear();
+                    }
+                    history.forEach([&](const HotEntry& entry) {
+                        std::string_view stored = segment->payloads.view(entry.data);
+                        uint64_t expiresAt = getFixed64(stored.data());
+                        if (expiresAt == 0 || expiresAt > now) {
+                            hotPart.emplace_back(stored.substr(kHotExpiryBytes));
+                        }
+                    });
+                });
+            }
+        }
+
+        std::vector<std::string> result;
+        if (!hotTombstone) {
+            readDisk(key, horizon, now, result);
+        }
+        result.insert(result.end(), std::make_move_iterator(hotPart.begin()), std::make_move_iterator(hotPart.end()));
+        return result;
+    }
+
+    // Records with a sequence number of at least `fromSequence`, in sequence order, at most `maxRecords` of
+    // them and at most `maxBytes` as counted by `sizeOf` (keys and payloads if not given). The first record is
+    // returned even if it alone is over `maxBytes`, so a read always makes progress. Tombstones are included so
+    // a reader can apply deletes; expired records are not. Continue from the last returned sequence plus one.
+    std::vector<Record> readSince(uint64_t fromSequence, size_t maxRecords, uint64_t maxBytes = UINT64_MAX,
+                                  const RecordSize& sizeOf = nullptr) {
+        return readRange(fromSequence, 0, UINT64_MAX, maxRecords, maxBytes, sizeOf);
+    }
+
+    // Records ingested between `fromMillis` and `toMillis`, both inclusive, with the same limits as
+    // readSince(). To continue, pass the last returned sequence plus one as `fromSequence`.
+    std::vector<Record> readBetween(uint64_t fromMillis, uint64_t toMillis, uint64_t fromSequence, size_t maxRecords,
+                                    uint64_t maxBytes = UINT64_MAX, const RecordSize& sizeOf = nullptr) {
+        uint64_t start = log.sequenceAtTime(fromMillis);
+        if (start == UINT64_MAX || fromMillis > toMillis) {
+            return {};
+        }
+        return readRange(std::max(start, fromSequence), fromMillis, toMillis, maxRecords, maxBytes, sizeOf);
+    }
+
+    // readSince() for readers that have to know how far they got, such as a snapshot build. `resumeAt` is where
+    // the next page starts: past every record looked at, the expired ones included, and past the end of the
+    // log once all of it was read. It stays at `fromSequence` if the log could not be read from there.
+    std::vector<Record> scanSince(uint64_t fromSequence, size_t maxRecords, uint64_t& resumeAt) {
+        return readRange(fromSequence, 0, UINT64_MAX, maxRecords, UINT64_MAX, nullptr, &resumeAt);
+    }
+
+    // Sequence number of the newest transaction in the log, 0 if there is none
+    uint64_t lastSequence() const {
+        return log.nextSequenceNumber() - 1;
+    }
+
+    // Every transaction up to this sequence number is durable and was acknowledged to its writer. Later ones
+    // may still be waiting for their batch's sync on another ingest shard, so readers that pass transactions
+    // on stop here.
+    uint64_t committedSequence() const {
+        return committed.load(std::memory_order_acquire);
+    }
+
+    // The `count` transactions from `first` on are done. Batches of different shards finish out of order; the
+    // committed sequence only moves past contiguous runs of finished ones.
+    void markCommitted(uint64_t first, uint64_t count) {
+        if (count == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(commitMutex);
+        uint64_t through = committed.load(std::memory_order_relaxed);
+        if (first > through + 1) {
+            finishedAhead.emplace(first, first + count - 1);
+            return;
+        }
+        through = std::max(through, first + count - 1);
+        auto next = finishedAhead.begin();
+        while (next != finishedAhead.end() && next->first <= through + 1) {
+            through = std::max(through, next->second);
+            next = finishedAhead.erase(next);
+        }
+        committed.store(through, std::memory_order_release);
+    }
+
+    // readSince() that stops at committedSequence()
+    std::vector<Record> readCommitted(uint64_t fromSequence, size_t maxRecords, uint64_t maxBytes = UINT64_MAX,
+                                      const RecordSize& sizeOf = nullptr) {
+        uint64_t through = committedSequence();
+        if (fromSequence > through) {
+            return {};
+        }
+        std::vector<Record> records =
+            readSince(fromSequence, std::min<uint64_t>(maxRecords, through - fromSequence + 1), maxBytes, sizeOf);
+        dropUncommitted(records, through);
+        return records;
+    }
+
+    // Cuts a page read with readSince() or readBetween() off after `through`
+    static void dropUncommitted(std::vector<Record>& records, uint64_t through) {
+        while (!records.empty() && records.back().sequence > through) {
+            records.pop_back();
+        }
+    }
+
+    BlockCacheMetrics blockCacheMetrics() const {
+        return cache.metrics();
+    }
+
+    // Hot tier plus block cache, as compared against the budget
+    uint64_t memoryBytes() const {
+        return hotMemoryBytes() + cache.usedBytes();
+    }
+
+    MemoryMetrics memoryMetrics() const {
+        MemoryMetrics result;
+        result.budgetBytes = options.memoryBudgetBytes;
+        result.blockCacheBytes = cache.usedBytes();
+        result.segmentsSpilled = segmentsSpilled.load(std::memory_order_relaxed);
+        result.forcedRolls = forcedRolls.load(std::memory_order_relaxed);
+
+        std::unordered_map<std::string, uint64_t> namespaces;
+        EpochManager::Guard guard;
+        const HotList* list = hotList.load(std::memory_order_acquire);
+        for (const HotSegment* segment : list != nullptr ? list->segments : noSegments) {
+            result.segments.push_back({segment->segmentId, segment->payloads.reservedBytes(), segment->indexBytes()});
+            result.hotBytes += segment->memoryBytes();
+            segment->namespaceBytes.forEach([&](const std::string& name, uint64_t bytes) {
+                namespaces[name] += bytes;
+            });
+        }
+        for (const auto& entry : namespaces) {
+            result.namespaces.push_back({entry.first, entry.second});
+        }
+        std::sort(result.namespaces.begin(), result.namespaces.end(), [](const auto& a, const auto& b) {
+            return a.bytes > b.bytes;
+        });
+        return result;
+    }
+
+    TieringMetrics metrics() const {
+        TieringMetrics result;
+        {
+            EpochManager::Guard guard;
+            const HotList* list = hotList.load(std::memory_order_acquire);
+            result.hotSegments = list != nullptr ? list->segments.size() : 0;
+        }
+        result.hotBytes = hotMemoryBytes();
+        result.coldSegmentsRead = coldSegmentsRead.load(std::memory_order_relaxed);
+        result.diskBytesRead = diskBytesRead.load(std::memory_order_relaxed);
+        result.segmentsSkipped = segmentsSkipped.load(std::memory_order_relaxed);
+        return result;
+    }
+
+private:
+    // The expiry is kept in the arena ahead of the payload, so an entry is only its 12-byte handle
+    static constexpr size_t kHotExpiryBytes = 8;
+
+    struct HotEntry {
+        Arena::Handle data; // Fixed64 expiresAt, then the payload
+    };
+
+    // Most keys see one to three transactions per segment, which then need no allocation of their own. The
+    // flag fits in the history's tail padding.
+    struct KeyHistory : SmallHistory<HotEntry, 3> {
+        bool tombstoned = false; // Earlier segments' entries for this key are deleted
+    };
+
+    // Evicting a hot segment releases its arena chunk by chunk, not entry by entry
+    struct HotSegment {
+        uint64_t segmentId = 0;
+        std::atomic<uint64_t> recordBytes{0}; // Keys, payloads and entries, as attributed to namespaces
+        ConcurrentHashMap<KeyHistory> transactions;
+        ConcurrentHashMap<uint64_t> namespaceBytes{16, 8};
+        Arena payloads;
+
+        // Histories that outgrew their inline entries keep the rest in `payloads`
+        uint64_t indexBytes() const { return transactions.memoryBytes() + namespaceBytes.memoryBytes(); }
+
+        uint64_t memoryBytes() const { return sizeof(HotSegment) + payloads.reservedBytes() + indexBytes(); }
+    };
+
+    // Oldest first. Never modified once published; adding or evicting a segment publishes a new list.
+    struct HotList {
+        std::vector<HotSegment*> segments;
+    };
+
+    // One bit per stripe in StripeLocks' mask
+    static constexpr size_t kAppendStripes = 64;
+
+    // Locks a set of key stripes in index order, so two batches with overlapping keys cannot deadlock
+    class StripeLocks {
+    public:
+        StripeLocks(std::mutex* stripes, uint64_t mask) : stripes(stripes), mask(mask) {
+            for (size_t i = 0; i < kAppendStripes; ++i) {
+                if ((mask >> i) & 1) {
+                    stripes[i].lock();
+                }
+            }
+        }
+
+        ~StripeLocks() {
+            for (size_t i = 0; i < kAppendStripes; ++i) {
+                if ((mask >> i) & 1) {
+                    stripes[i].unlock();
+                }
+            }
+        }
+
+        StripeLocks(const StripeLocks&) = delete;
+        StripeLocks& operator=(const StripeLocks&) = delete;
+
+    private:
+        std::mutex* stripes;
+        uint64_t mask;
+    };
+
+    uint64_t hotMemoryBytes() const {
+        EpochManager::Guard guard;
+        const HotList* list = hotList.load(std::memory_order_acquire);
+        uint64_t total = 0;
+        for (const HotSegment* segment : list != nullptr ? list->segments : noSegments) {
+            total += segment->memoryBytes();
+        }
+        return total;
+    }
+
+    // Caller holds an EpochManager::Guard
+    static HotSegment* findHot(const HotList* list, uint64_t segmentId) {
+        if (list == nullptr) {
+            return nullptr;
+        }
+        for (auto it = list->segments.rbegin(); it != list->segments.rend(); ++it) {
+            if ((*it)->segmentId == segmentId) {
+                return *it;
+            }
+        }
+        return nullptr;
+    }
+
+    // Caller holds hotMutex
+    void publishHot(HotList* list) {
+        EpochManager::instance().retire(hotList.exchange(list, std::memory_order_acq_rel));
+        if (!list->segments.empty()) {
+            log.setCompactionHorizon(list->segments.front()->segmentId);
+        }
+    }
+
+    void addHot(uint64_t segmentId) {
+        std::lock_guard<std::mutex> lock(hotMutex);
+        const HotList* current = hotList.load(std::memory_order_relaxed);
+        if (findHot(current, segmentId) != nullptr || segmentId < evictedBelow) {
+            return; // Another thread got here first, or the segment is already on the disk side of the horizon
+        }
+
+        // Appends racing across a roll can arrive slightly out of order, so keep the list sorted
+        auto* list = new HotList(current != nullptr ? *current : HotList());
+        auto* segment = new HotSegment();
+        segment->segmentId = segmentId;
+        auto position = std::find_if(list->segments.begin(), list->segments.end(), [&](const HotSegment* other) {
+            return other->segmentId > segmentId;
+        });
+        list->segments.insert(position, segment);
+        publishHot(list);
+    }
+
+    // A hot segment whose arena ran out of chunks lacks some of its records. Seals it, so the next append starts
+    // a new hot segment with a fresh arena, and drops it from memory with every older one: readers only go to
+    // disk below the oldest hot segment.
+    void dropIncomplete(uint64_t segmentId) {
+        std::cerr << "Error: Hot segment " << segmentId << " ran out of arena chunks, serving it from disk"
+                  << std::endl;
+        if (log.activeSegmentId() == segmentId && !log.flush()) {
+            return; // Not on the disk side yet; dropping it would hide its records altogether
+        }
+
+        std::lock_guard<std::mutex> lock(hotMutex);
+        const HotList* current = hotList.load(std::memory_order_relaxed);
+        if (current == nullptr || segmentId < evictedBelow) {
+            return;
+        }
+        auto* list = new HotList(*current);
+        auto keep = std::find_if(list->segments.begin(), list->segments.end(), [&](const HotSegment* segment) {
+            return segment->segmentId > segmentId;
+        });
+        std::vector<HotSegment*> evicted(list->segments.begin(), keep);
+        list->segments.erase(list->segments.begin(), keep);
+        evictedBelow = segmentId + 1;
+        publishHot(list);
+        for (HotSegment* segment : evicted) {
+            EpochManager::instance().retire(segment);
+        }
+        segmentsSpilled.fetch_add(evicted.size(), std::memory_order_relaxed);
+    }
+
+    // Drops the oldest hot segments from memory until the budget holds again; they are already sealed on disk.
+    // Readers that still look at an evicted segment keep it alive until they leave their epoch.
+    void spill() {
+        std::unique_lock<std::mutex> lock(hotMutex, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            return; // Someone else is spilling or adding a segment; they will re-check the budget
+        }
+        const HotList* current = hotList.load(std::memory_order_relaxed);
+        if (current == nullptr || current->segments.empty()) {
+            return;
+        }
+
+        uint64_t total = memoryBytes();
+        auto* list = new HotList(*current);
+        std::vector<HotSegment*> evicted;
+        while (total > options.memoryBudgetBytes && list->segments.size() > 1) {
+            HotSegment* oldest = list->segments.front();
+            total -= std::min(total, oldest->memoryBytes());
+            evictedBelow = oldest->segmentId + 1;
+            list->segments.erase(list->segments.begin());
+            evicted.push_back(oldest);
+        }
+
+        // The segment still being appended to is over budget by itself. Seal it, so the next append opens a
+        // new hot segment and this one can be spilled like any other.
+        const HotSegment* newest = list->segments.front();
+        if (total > options.memoryBudgetBytes && newest->segmentId == log.activeSegmentId() &&
+            newest->recordBytes.load(std::memory_order_relaxed) >= options.minForcedRollBytes) {
+            if (log.flush()) {
+                forcedRolls.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        if (evicted.empty()) {
+            delete list;
+            return;
+        }
+        publishHot(list);
+        for (HotSegment* segment : evicted) {
+            EpochManager::instance().retire(segment);
+        }
+        segmentsSpilled.fetch_add(evicted.size(), std::memory_order_relaxed);
+    }
+
+    // readSince() restricted to records ingested between `fromMillis` and `toMillis`
+    // `resumeAt`, if given, receives where the next page starts; see scanSince()
+    std::vector<Record> readRange(uint64_t fromSequence, uint64_t fromMillis, uint64_t toMillis, size_t maxRecords,
+                                  uint64_t maxBytes, const RecordSize& sizeOf, uint64_t* resumeAt = nullptr) {
+        std::vector<Record> result;
+        uint64_t bytes = 0;
+        uint64_t now = nowMillis();
+        uint64_t next = fromSequence;
+        auto stopAt = [&](uint64_t resume) {
+            if (resumeAt != nullptr) {
+                *resumeAt = resume;
+            }
+        };
+
+        // Compaction may unlink a segment between listing and opening it; carry on from the last record seen
+        for (int attempt = 0; attempt < 3; ++attempt) {
+            uint64_t end = log.nextSequenceNumber(); // Everything below it is in the segments listed next
+            uint64_t position = 0;
+            bool complete = true;
+            for (const auto& segment : log.segmentsSince(next, position)) {
+                SegmentReader reader(*segment, &cache);
+                if (!reader.isOpen()) {
+                    complete = false;
+                    break;
+                }
+                reader.seek(position);
+                position = 0;
+
+                Record record;
+                while (reader.next(record)) {
+                    if (record.sequence < next) {
+                        continue; // Between the index entry and the requested sequence
+                    }
+                    if (record.timestamp > toMillis) {
+                        diskBytesRead.fetch_add(reader.bytesRead(), std::memory_order_relaxed);
+                        stopAt(next);
+                        return result; // Everything after it is later still
+                    }
+                    next = record.sequence + 1;
+                    if (record.timestamp < fromMillis) {
+                        continue;
+                    }
+                    if (record.type != RecordType::Tombstone && record.expiresAt != 0 && record.expiresAt <= now) {
+                        continue;
+                    }
+                    // Checked before the record is taken, so a page never goes over its budget by a record
+                    uint64_t size = sizeOf ? sizeOf(record) : record.key.size() + record.data.size();
+                    if (!result.empty() && bytes + size > maxBytes) {
+                        diskBytesRead.fetch_add(reader.bytesRead(), std::memory_order_relaxed);
+                        stopAt(record.sequence);
+                        return result;
+                    }
+                    bytes += size;
+                    result.push_back(std::move(record));
+                    if (result.size() >= maxRecords || bytes >= maxBytes) {
+                        diskBytesRead.fetch_add(reader.bytesRead(), std::memory_order_relaxed);
+                        stopAt(next);
+                        return result;
+                    }
+                }
+                diskBytesRead.fetch_add(reader.bytesRead(), std::memory_order_relaxed);
+            }
+            if (complete) {
+                stopAt(std::max(next, end));
+                return result;
+            }
+        }
+        std::cerr << "Error: Segments kept changing while reading from sequence " << fromSequence << std::endl;
+        stopAt(next);
+        return result;
+    }
+
+    void readDisk(const std::string& key, uint64_t horizon, uint64_t now, std::vector<std::string>& result) {
+        uint64_t hash = hashKey(key);
+
+        // Compaction may unlink a segment between listing and opening it; list again if that happens
+        for (int attempt = 0; attempt < 3; ++attempt) {
+            result.clear();
+            bool complete = true;
+            for (const auto& segment : log.sealedSegments()) {
+                if (segment->lastId >= horizon) {
+                    break;
+                }
+                if (segment->keyFilter != nullptr && !segment->keyFilter->mayContain(hash)) {
+                    segmentsSkipped.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+
+                SegmentReader reader(*segment, &cache);
+                if (!reader.isOpen()) {
+                    complete = false;
+                    break;
+                }
+
+                Record record;
+                while (reader.next(record)) {
+                    if (record.key != key) {
+                        continue;
+                    }
+                    if (record.type == RecordType::Tombstone) {
+                        result.clear();
+                    } else if (record.expiresAt == 0 || record.expiresAt > now) {
+                        result.push_back(std::move(record.data));
+                    }
+                }
+                if (segment->cold) {
+                    coldSegmentsRead.fetch_add(1, std::memory_order_relaxed);
+                }
+                diskBytesRead.fetch_add(reader.bytesRead(), std::memory_order_relaxed);
+            }
+            if (complete) {
+                return;
+            }
+        }
+        std::cerr << "Error: Segments kept changing while reading history of " << key << std::endl;
+    }
+
+    SegmentLog& log;
+    TieringOptions options;
+    BlockCache cache;
+
+    std::mutex appendStripes[kAppendStripes];
+    inline static const std::vector<HotSegment*> noSegments;
+
+    std::mutex hotMutex; // Serialises changes to the hot list; readers only load `hotList`
+    std::atomic<const HotList*> hotList{nullptr};
+    uint64_t evictedBelow = 0; // Segments below this id have left memory for good
+    std::atomic<uint64_t> segmentsSpilled{0};
+    std::atomic<uint64_t> forcedRolls{0};
+
+    std::atomic<uint64_t> coldSegmentsRead{0};
+    std::atomic<uint64_t> diskBytesRead{0};
+    std::atomic<uint64_t> segmentsSkipped{0};
+
+    std::mutex commitMutex; // Guards `finishedAhead` and changes to `committed`
+    std::atomic<uint64_t> committed{0};
+    std::map<uint64_t, uint64_t> finishedAhead; // First and last sequence of batches finished past `committed`
+};
+
+/*
+**Ingest Queue**
+*/
+
+struct IngestOptions {
+    size_t shards = 4;              // Writer threads; a key always goes to the same one
+    size_t queueCapacity = 4096;    // Transactions waiting per shard before submit() has to wait
+    size_t maxBatchRecords = 512;   // Upper bound on records persisted by one log write
+    bool syncBatches = true;        // fdatasync() each batch before completing it; off trades durability for speed
+};
+
+struct IngestMetrics {
+    uint64_t recordsWritten = 0;
+    uint64_t batchesWritten = 0;
+    uint64_t queueFullWaits = 0; // Times a producer found its shard's ring full
+
+    double averageBatchRecords() const {
+        return batchesWritten == 0 ? 0.0 : static_cast<double>(recordsWritten) / static_cast<double>(batchesWritten);
+    }
+};
+
+class IngestQueue {
+public:
+    // Runs on the shard's writer thread once the transaction is persisted (or failed to be)
+    using Completion = std::function<void(bool stored, uint64_t sequence)>;
+
+    explicit IngestQueue(TieredStore& store, IngestOptions options = {}) : store(store), options(options) {
+        for (size_t i = 0; i < std::max<size_t>(options.shards, 1); ++i) {
+            shards.push_back(std::make_unique<Shard>(options.queueCapacity));
+        }
+    }
+
+    ~IngestQueue() { stop(); }
+
+    IngestQueue(const IngestQueue&) = delete;
+    IngestQueue& operator=(const IngestQueue&) = delete;
+
+    // Call once the log is open. Everything already in it was committed before this run.
+    void start() {
+        store.markCommitted(1, store.lastSequence());
+        for (auto& shard : shards) {
+            if (!shard->writer.joinable()) {
+                shard->stopping.store(false, std::memory_order_relaxed);
+                Shard* target = shard.get();
+                shard->writer = std::thread([this, target] { run(*target); });
+            }
+        }
+    }
+
+    // Writers drain their rings before they exit, so every accepted transaction is completed
+    void stop() {
+        for (auto& shard : shards) {
+            {
+                std::lock_guard<std::mutex> lock(shard->mutex);
+                shard->stopping.store(true, std::memory_order_relaxed);
+            }
+            shard->wakeup.notify_one();
+            if (shard->writer.joinable()) {
+                shard->writer.join();
+            }
+        }
+    }
+
+    // Hands a transaction to its shard's writer. Only waits, by yielding, while that shard's ring is full.
+    void submit(Record record, Completion done) {
+        Shard& shard = *shards[hashKey(record.key) % shards.size()];
+        Pending pending{std::move(record), std::move(done)};
+        if (!shard.ring.tryPush(std::move(pending))) {
+            shard.queueFullWaits.fetch_add(1, std::memory_order_relaxed);
+            do {
+                std::this_thread::yield();
+            } while (!shard.ring.tryPush(std::move(pending)));
+        }
+
+        // Pairs with the fence in run(): either the writer sees the new entry or we see that it is asleep
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (shard.sleeping.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.wakeup.notify_one();
+        }
+    }
+
+    IngestMetrics metrics() const {
+        IngestMetrics result;
+        for (const auto& shard : shards) {
+            result.recordsWritten += shard->recordsWritten.load(std::memory_order_relaxed);
+            result.batchesWritten += shard->batchesWritten.load(std::memory_order_relaxed);
+            result.queueFullWaits += shard->queueFullWaits.load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+
+private:
+    struct Pending {
+        Record record;
+        Completion done;
+    };
+
+    struct Shard {
+        explicit Shard(size_t capacity) : ring(capacity) {}
+
+        MpscRing<Pending> ring;
+        std::thread writer;
+        std::mutex mutex; // Only for sleeping and waking the writer
+        std::condition_variable wakeup;
+        std::atomic<bool> sleeping{false};
+        std::atomic<bool> stopping{false};
+        std::atomic<uint64_t> recordsWritten{0};
+        std::atomic<uint64_t> batchesWritten{0};
+        std::atomic<uint64_t> queueFullWaits{0};
+    };
+
+    void run(Shard& shard) {
+        std::vector<Pending> batch;
+        std::vector<Record> records;
+        while (true) {
+            batch.clear();
+            if (shard.ring.popBatch(batch, options.maxBatchRecords) == 0) {
+                if (shard.stopping.load(std::memory_order_relaxed)) {
+                    return;
+                }
+                std::unique_lock<std::mutex> lock(shard.mutex);
+                shard.sleeping.store(true, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (shard.ring.empty() && !shard.stopping.load(std::memory_order_relaxed)) {
+                    shard.wakeup.wait_for(lock, std::chrono::milliseconds(100));
+                }
+                shard.sleeping.store(false, std::memory_order_relaxed);
+                continue;
+            }
+
+            records.clear();
+            for (auto& pending : batch) {
+                records.push_back(std::move(pending.record));
+            }
+            uint64_t firstSequence = 0;
+            bool stored = store.appendBatch(records.data(), records.size(), &firstSequence);
+            // A group commit: one sync for the whole batch, and no transaction is acknowledged before it
+            if (stored && options.syncBatches) {
+                stored = store.sync();
+            }
+            // Readers of committed transactions may go past the batch before its writers hear back. A batch
+            // whose sync failed is passed too: it is in the log, and the next sync that succeeds covers it.
+            if (firstSequence != 0) {
+                store.markCommitted(firstSequence, records.size());
+            }
+            for (size_t i = 0; i < batch.size(); ++i) {
+                if (batch[i].done) {
+                    batch[i].done(stored, stored ? firstSequence + i : 0);
+                }
+            }
+            shard.recordsWritten.fetch_add(batch.size(), std::memory_order_relaxed);
+            shard.batchesWritten.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    TieredStore& store;
+    IngestOptions options;
+    std::vector<std::unique_ptr<Shard>> shards;
+};
+
+#endif // PDN_STORAGE_H
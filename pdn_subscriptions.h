@@ -0,0 +1,449 @@
+#ifndef PDN_SUBSCRIPTIONS_H
+#define PDN_SUBSCRIPTIONS_H
+
+/*
+Instead of asking over and over whether anything new has arrived, a client can subscribe once. From then on
+the server pushes every transaction that is appended to the store down the open connection, as soon as it has
+been persisted.
+
+1.  **The Log Is the Queue**: A subscriber is nothing more than a socket and the next sequence number it has
+not been sent yet. There is no per-subscriber copy of the data: whenever the subscriber can take more, the next
+page is read from the segment log. Recent pages are usually still in the page cache, while a subscriber that is
+far behind reads from disk. Reads stop at the store's committed sequence (see IngestQueue), since the log may
+already hold transactions of another shard's batch that is not synced yet.
+2.  **Flow Control**: A subscriber grants frame and byte credits when it subscribes and with every "credit"
+frame it sends afterwards (see pdn_protocol.h). Nothing is read for it while it holds no credit, so the
+network and the consumer never hold more than it granted. Pushes use non-blocking sends on top of that, and a
+subscriber has at most one frame waiting in user space; until the kernel has accepted all of it, nothing more
+is read for that subscriber. A slow consumer therefore only slows itself down and costs the server one frame
+of memory. One that accepts nothing at all for `stallTimeout` is disconnected, and can resubscribe from where
+it got to. Running out of credit is not a stall, since the consumer chose to pause.
+3.  **One Pusher, a Few Readers**: All sends are made by a single thread that sleeps in poll() until a
+transaction is committed, a page has been read, or a stalled socket becomes writable again. Pages are read and
+encoded by `readerThreads` reader threads, so a subscriber catching up from disk never holds up the pushes to
+everyone else. Each subscriber has at most one read queued, and the queue is served in order, so subscribers
+catching up take turns. Committing only bumps a counter and, if the pusher is not already awake, writes one
+byte to a pipe.
+
+Pushed frames carry the same payload as the answer to a "since" read, produced by the server's encoder.
+*/
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "pdn_protocol.h"
+#include "pdn_storage.h"
+
+struct SubscriptionOptions {
+    size_t maxRecordsPerPush = 1000;
+    uint64_t maxBytesPerPush = kMaxFrameSize / 2;  // Records per frame, as the hub's RecordSize counts them
+    std::chrono::milliseconds stallTimeout{30000}; // Without progress on a pending frame
+    size_t readerThreads = 2;                      // Read and encode pages off the pusher thread
+};
+
+struct SubscriptionMetrics {
+    uint64_t subscribers = 0;
+    uint64_t framesPushed = 0;
+    uint64_t recordsPushed = 0;
+    uint64_t slowDisconnects = 0; // Subscribers dropped for not reading
+    uint64_t creditWaits = 0;     // Times a subscriber had more to receive but no credit left
+};
+
+class SubscriptionHub {
+public:
+    // Turns a page of records into a frame payload; `next` is the sequence number to continue from
+    using Encoder = std::function<std::string(const std::vector<Record>& records, uint64_t next)>;
+
+    // Reads a credit grant out of a frame payload a subscriber sent; false if it is not one
+    using GrantDecoder = std::function<bool(const std::string& payload, FlowCredits& grant)>;
+
+    // `sizeOf` bounds what a record adds to the encoder's payload, so that a push of maxBytesPerPush fits a
+    // frame; keys and payloads are counted if it is not given
+    SubscriptionHub(TieredStore& store, Encoder encode, GrantDecoder decodeGrant, RecordSize sizeOf = nullptr,
+                    SubscriptionOptions options = {})
+        : store(store), encode(std::move(encode)), decodeGrant(std::move(decodeGrant)), sizeOf(std::move(sizeOf)),
+          options(options) {}
+
+    ~SubscriptionHub() { stop(); }
+
+    SubscriptionHub(const SubscriptionHub&) = delete;
+    SubscriptionHub& operator=(const SubscriptionHub&) = delete;
+
+    bool start() {
+        if (pusher.joinable()) {
+            return true;
+        }
+        if (::pipe(wakePipe) != 0) {
+            std::cerr << "Error: Cannot create subscription wakeup pipe" << std::endl;
+            return false;
+        }
+        ::fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+        ::fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+        stopping.store(false, std::memory_order_relaxed);
+        for (size_t i = 0; i < std::max<size_t>(options.readerThreads, 1); ++i) {
+            readers.emplace_back([this] { readPages(); });
+        }
+        pusher = std::thread([this] { run(); });
+        return true;
+    }
+
+    // Closes every subscriber's connection
+    void stop() {
+        if (!pusher.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(readMutex);
+            stopping.store(true, std::memory_order_relaxed);
+        }
+        readWakeup.notify_all();
+        wake();
+        pusher.join();
+        for (auto& reader : readers) {
+            reader.join();
+        }
+        readers.clear();
+        reads.clear();
+        readsDone.clear();
+        for (int& fd : wakePipe) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    // Takes over `socket`, which from now on receives every transaction from `fromSequence` on, as far as
+    // `credits` and later grants allow. `received` holds what was already read off the socket past the
+    // subscribe request, such as grants the peer sent right behind it.
+    void subscribe(int socket, uint64_t fromSequence, FlowCredits credits = FlowCredits(),
+                   FrameDecoder received = FrameDecoder()) {
+        ::fcntl(socket, F_SETFL, ::fcntl(socket, F_GETFL) | O_NONBLOCK);
+        Subscriber subscriber;
+        subscriber.id = nextSubscriberId.fetch_add(1, std::memory_order_relaxed);
+        subscriber.socket = socket;
+        subscriber.next = std::max<uint64_t>(fromSequence, 1);
+        subscriber.credits = credits;
+        subscriber.grants = std::move(received);
+        if (!applyGrants(subscriber)) {
+            ::close(socket);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(incomingMutex);
+            incoming.push_back(std::move(subscriber));
+        }
+        wake();
+    }
+
+    // Called once transactions have been persisted. Cheap enough to call for every one of them.
+    void notifyCommitted() {
+        commits.fetch_add(1, std::memory_order_seq_cst);
+        if (!wakePending.exchange(true, std::memory_order_seq_cst)) {
+            wake();
+        }
+    }
+
+    SubscriptionMetrics metrics() const {
+        SubscriptionMetrics result;
+        result.subscribers = subscriberCount.load(std::memory_order_relaxed);
+        result.framesPushed = framesPushed.load(std::memory_order_relaxed);
+        result.recordsPushed = recordsPushed.load(std::memory_order_relaxed);
+        result.slowDisconnects = slowDisconnects.load(std::memory_order_relaxed);
+        result.creditWaits = creditWaits.load(std::memory_order_relaxed);
+        return result;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Subscriber {
+        uint64_t id = 0;
+        int socket = -1;
+        uint64_t next = 1;            // First sequence number not yet read for it
+        std::string pending;          // Encoded frame not yet fully accepted by the kernel
+        size_t sent = 0;              // Bytes of `pending` already accepted
+        uint64_t idleAt = UINT64_MAX; // Commit count when a read last came back empty
+        bool reading = false;         // A reader is preparing its next frame
+        FlowCredits credits;          // What it is still willing to take
+        bool waitingForCredit = false;
+        FrameDecoder grants;          // Frames it sent, which can only be credit grants
+        Clock::time_point lastProgress = Clock::now();
+    };
+
+    // A page to read for a subscriber, and what came of it
+    struct PageRead {
+        uint64_t subscriberId = 0;
+        uint64_t from = 0;
+        uint64_t maxBytes = 0;
+        uint64_t commitCount = 0; // When it was asked for; an empty page means nothing was committed since
+        uint64_t next = 0;
+        size_t records = 0;
+        std::string frame; // Empty if there was nothing to read
+    };
+
+    // Grants are tiny, so this is plenty for one recv()
+    static constexpr size_t kGrantChunk = 4096;
+
+    void wake() {
+        char byte = 0;
+        ssize_t ignored = ::write(wakePipe[1], &byte, 1); // A full pipe already means a wakeup is pending
+        (void)ignored;
+    }
+
+    void run() {
+        std::vector<Subscriber> subscribers;
+        std::vector<pollfd> fds;
+        while (!stopping.load(std::memory_order_relaxed)) {
+            fds.clear();
+            fds.push_back({wakePipe[0], POLLIN, 0});
+            for (const auto& subscriber : subscribers) {
+                short events = POLLIN; // For credit grants, and to notice the peer closing the connection
+                if (subscriber.sent < subscriber.pending.size()) {
+                    events |= POLLOUT;
+                }
+                fds.push_back({subscriber.socket, events, 0});
+            }
+            // Stalls are checked at least once a second
+            if (::poll(fds.data(), fds.size(), subscribers.empty() ? -1 : 1000) < 0 && errno != EINTR) {
+                std::cerr << "Error: poll() failed for subscribers" << std::endl;
+                break;
+            }
+
+            // Clear the flag before draining, so a commit from now on writes to the pipe again
+            wakePending.store(false, std::memory_order_seq_cst);
+            char buffer[256];
+            while (::read(wakePipe[0], buffer, sizeof(buffer)) > 0) {
+            }
+            {
+                std::lock_guard<std::mutex> lock(incomingMutex);
+                subscribers.insert(subscribers.end(), incoming.begin(), incoming.end());
+                incoming.clear();
+            }
+            std::unordered_map<uint64_t, PageRead> pages; // Read for subscribers that may have gone since
+            {
+                std::lock_guard<std::mutex> lock(readMutex);
+                for (auto& page : readsDone) {
+                    pages.emplace(page.subscriberId, std::move(page));
+                }
+                readsDone.clear();
+            }
+
+            uint64_t commitCount = commits.load(std::memory_order_seq_cst);
+            Clock::time_point now = Clock::now();
+            size_t kept = 0;
+            for (size_t i = 0; i < subscribers.size(); ++i) {
+                Subscriber& subscriber = subscribers[i];
+                short revents = i + 1 < fds.size() ? fds[i + 1].revents : 0;
+                bool alive = !(revents & (POLLERR | POLLNVAL)) && (!(revents & POLLIN) || readGrants(subscriber));
+                auto page = pages.find(subscriber.id);
+                if (page != pages.end()) {
+                    takePage(subscriber, page->second, now);
+                }
+                if (alive) {
+                    alive = pump(subscriber, commitCount, now);
+                }
+                if (!alive) {
+                    ::close(subscriber.socket);
+                    continue;
+                }
+                if (kept != i) {
+                    subscribers[kept] = std::move(subscriber);
+                }
+                kept++;
+            }
+            subscribers.resize(kept);
+            subscriberCount.store(subscribers.size(), std::memory_order_relaxed);
+        }
+
+        for (const auto& subscriber : subscribers) {
+            ::close(subscriber.socket);
+        }
+        std::lock_guard<std::mutex> lock(incomingMutex);
+        for (const auto& subscriber : incoming) {
+            ::close(subscriber.socket);
+        }
+        incoming.clear();
+        subscriberCount.store(0, std::memory_order_relaxed);
+    }
+
+    // Adds up the credit grants that arrived. Returns false if the peer closed the connection or sent
+    // anything else, which ends the subscription too.
+    bool readGrants(Subscriber& subscriber) {
+        while (true) {
+            char* buffer = subscriber.grants.prepare(kGrantChunk);
+            ssize_t received = ::recv(subscriber.socket, buffer, kGrantChunk, MSG_DONTWAIT);
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return true;
+            }
+            if (received <= 0) {
+                return false;
+            }
+            subscriber.grants.commit(static_cast<size_t>(received));
+            if (!applyGrants(subscriber)) {
+                return false;
+            }
+        }
+    }
+
+    // Adds up the complete grants buffered in the subscriber's decoder. Returns false on anything else.
+    bool applyGrants(Subscriber& subscriber) const {
+        std::string payload;
+        uint64_t requestId = 0;
+        int status;
+        while ((status = subscriber.grants.next(payload, requestId)) == 1) {
+            FlowCredits grant;
+            if (!decodeGrant(payload, grant)) {
+                return false;
+            }
+            subscriber.credits.grant(grant);
+        }
+        return status == 0;
+    }
+
+    // Sends what the subscriber can take and asks for its next page once it has taken all of the last one.
+    // Returns false if it has to be disconnected.
+    bool pump(Subscriber& subscriber, uint64_t commitCount, Clock::time_point now) {
+        while (subscriber.sent < subscriber.pending.size()) {
+            ssize_t sent = ::send(subscriber.socket, subscriber.pending.data() + subscriber.sent,
+                                  subscriber.pending.size() - subscriber.sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (now - subscriber.lastProgress > options.stallTimeout) {
+                    slowDisconnects.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                return true; // Back-pressure: nothing more is read until poll() says it is writable
+            }
+            if (sent <= 0) {
+                return false;
+            }
+            subscriber.sent += static_cast<size_t>(sent);
+            subscriber.lastProgress = now;
+            if (subscriber.sent == subscriber.pending.size()) {
+                subscriber.pending.clear();
+                subscriber.sent = 0;
+                framesPushed.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        // Its next page is already being read, or nothing was committed since the last empty read
+        if (subscriber.reading || subscriber.idleAt == commitCount) {
+            return true;
+        }
+        if (subscriber.credits.exhausted()) {
+            if (!subscriber.waitingForCredit) {
+                subscriber.waitingForCredit = true;
+                creditWaits.fetch_add(1, std::memory_order_relaxed);
+            }
+            subscriber.lastProgress = now; // Waiting for credit is the consumer's choice, not a stall
+            return true;
+        }
+        subscriber.waitingForCredit = false;
+        subscriber.reading = true;
+        PageRead page;
+        page.subscriberId = subscriber.id;
+        page.from = subscriber.next;
+        page.maxBytes = std::min(options.maxBytesPerPush, subscriber.credits.bytes);
+        page.commitCount = commitCount;
+        {
+            std::lock_guard<std::mutex> lock(readMutex);
+            reads.push_back(std::move(page));
+        }
+        readWakeup.notify_one();
+        return true;
+    }
+
+    // Makes a page a reader prepared the subscriber's pending frame, to be sent by the next pump()
+    void takePage(Subscriber& subscriber, PageRead& page, Clock::time_point now) {
+        subscriber.reading = false;
+        subscriber.lastProgress = now;
+        if (page.frame.empty()) {
+            subscriber.idleAt = page.commitCount;
+            return;
+        }
+        subscriber.next = page.next;
+        subscriber.pending = std::move(page.frame);
+        subscriber.sent = 0;
+        subscriber.credits.spend(subscriber.pending.size());
+        recordsPushed.fetch_add(page.records, std::memory_order_relaxed);
+    }
+
+    // Reader thread: reads and encodes queued pages and hands them back to the pusher
+    void readPages() {
+        while (true) {
+            PageRead page;
+            {
+                std::unique_lock<std::mutex> lock(readMutex);
+                readWakeup.wait(lock, [this] { return stopping.load(std::memory_order_relaxed) || !reads.empty(); });
+                if (stopping.load(std::memory_order_relaxed)) {
+                    return;
+                }
+                page = std::move(reads.front());
+                reads.pop_front();
+            }
+
+            std::vector<Record> records =
+                store.readCommitted(page.from, options.maxRecordsPerPush, page.maxBytes, sizeOf);
+            if (!records.empty()) {
+                page.next = records.back().sequence + 1;
+                page.records = records.size();
+                page.frame = encodeFrame(encode(records, page.next));
+            }
+            {
+                std::lock_guard<std::mutex> lock(readMutex);
+                readsDone.push_back(std::move(page));
+            }
+            wake();
+        }
+    }
+
+    TieredStore& store;
+    Encoder encode;
+    GrantDecoder decodeGrant;
+    RecordSize sizeOf;
+    SubscriptionOptions options;
+
+    std::thread pusher;
+    std::vector<std::thread> readers;
+    std::atomic<bool> stopping{false};
+    int wakePipe[2] = {-1, -1};
+    std::atomic<bool> wakePending{false};
+    std::atomic<uint64_t> commits{0};
+
+    std::mutex incomingMutex; // Subscribers handed over but not yet picked up by the pusher
+    std::vector<Subscriber> incoming;
+    std::atomic<uint64_t> nextSubscriberId{1};
+
+    std::mutex readMutex; // Guards the two queues below
+    std::condition_variable readWakeup;
+    std::deque<PageRead> reads;       // Waiting for a reader, oldest first
+    std::vector<PageRead> readsDone;  // Waiting for the pusher
+
+    std::atomic<uint64_t> subscriberCount{0};
+    std::atomic<uint64_t> framesPushed{0};
+    std::atomic<uint64_t> recordsPushed{0};
+    std::atomic<uint64_t> slowDisconnects{0};
+    std::atomic<uint64_t> creditWaits{0};
+};
+
+#endif // PDN_SUBSCRIPTIONS_H
@@ -39,21 +39,20 @@ efficient lookup and storage of messages.
 Here is an example code snippet using Kademlia DHT to store and retrieve messages:
 *//
 
+#include <chrono>
 #include <kademlia/kademlia.h>
+#include "pdn_messages.h"
 
 // Create a Kademlia node with a specified ID and port
 KademliaNode node("my_node", 1234);
 
-// Define a message structure
-struct Message {
-    std::string sender;
-    std::string recipient;
-    std::string data;
-};
+// This node's own copy of the messages it stored, in columns, for scans by recipient, sender and time
+MessageStore localMessages;
 
 // Store a message in the DHT
 void storeMessage(const Message& message) {
     kademlia::add(node, message.sender, message.recipient, message.data);
+    localMessages.add(message);
 }
 
 // Retrieve a message from the DHT
@@ -66,8 +65,10 @@ int main() {
     KademliaNode node("my_node", 1234);
 
     // Define two messages
-    Message message1 = {"Alice", "Bob", "Hello, Bob!"};
-    Message message2 = {"Bob", "Charlie", "Hi, Charlie!"};
+    uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::system_clock::now().time_since_epoch()).count();
+    Message message1 = {"Alice", "Bob", now, "Hello, Bob!"};
+    Message message2 = {"Bob", "Charlie", now, "Hi, Charlie!"};
 
     // Store the messages in the DHT
     storeMessage(message1);
@@ -76,6 +77,10 @@ int main() {
     // Retrieve a message from the DHT
     std::string retrievedMessage = getMessage("Alice", "Bob");
 
+    // Scan the local copy: every message Bob received, and Alice's messages to him in the last hour
+    std::vector<Message> bobsInbox = localMessages.messagesTo("Bob");
+    std::vector<Message> recent = localMessages.conversation("Alice", "Bob", now - 3600 * 1000, now);
+
     return 0;
 }
 /*
@@ -16,56 +16,485 @@ Here's an example implementation using C++:
 **Server Side**
 */
 
+#include <atomic>
+#include <condition_variable>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <map>
 #include <json/json.h> // jsoncpp library
+#include "pdn_protocol.h"
+#include "pdn_snapshot.h"
+#include "pdn_storage.h"
+#include "pdn_subscriptions.h"
 
 class Server {
+    // Frames queued for one connection, written by its sender thread. The thread holds on to them after the
+    // connection is gone, so it can write what is left and then close the socket.
+    struct Outbound {
+        explicit Outbound(int socket) : socket(socket) {}
+
+        int socket;
+        std::mutex mutex; // Guards everything below
+        std::condition_variable changed;
+        std::string pending;   // Encoded frames the sender has not taken yet
+        bool writing = false;  // The sender is writing frames it took
+        bool finished = false; // The connection is gone: write what is left, then close the socket
+        bool failed = false;   // The socket is shut down; further frames are dropped
+    };
+
+    // Responses come from the connection's own thread and from the ingest writers. They only queue frames; the
+    // connection's sender thread writes them, so a slow client never holds up a shard writer.
+    struct Connection {
+        explicit Connection(int socket) : socket(socket), outbound(std::make_shared<Outbound>(socket)) {
+            std::thread([state = outbound] { writeOutbound(*state); }).detach();
+        }
+
+        ~Connection() {
+            {
+                std::lock_guard<std::mutex> lock(outbound->mutex);
+                outbound->finished = true;
+            }
+            outbound->changed.notify_all();
+        }
+
+        // Never waits for the socket. A client that lets kMaxOutboundBytes of responses pile up is dropped. A
+        // response over kMaxFrameSize, which the client could not take, is answered with an error instead.
+        void send(const std::string& response, uint64_t requestId) {
+            const std::string& payload = response.size() > kMaxFrameSize ? kResponseTooLarge : response;
+            {
+                std::lock_guard<std::mutex> lock(outbound->mutex);
+                if (outbound->socket == -1 || outbound->failed) {
+                    return;
+                }
+                if (outbound->pending.size() + payload.size() > kMaxOutboundBytes) {
+                    shutdown(outbound->socket, SHUT_RDWR); // Ends the reader too
+                    outbound->failed = true;
+                    outbound->pending.clear();
+                    std::cerr << "Error: Client not reading, connection dropped" << std::endl;
+                    return;
+                }
+                appendFrame(outbound->pending, payload, requestId);
+            }
+            outbound->changed.notify_all();
+        }
+
+        // Takes the socket away from the sender once it is between writes. Frames still queued are dropped.
+        int detach() {
+            std::unique_lock<std::mutex> lock(outbound->mutex);
+            outbound->changed.wait(lock, [this] { return !outbound->writing; });
+            int detached = outbound->socket;
+            outbound->socket = -1;
+            outbound->pending.clear();
+            socket = -1;
+            lock.unlock();
+            outbound->changed.notify_all();
+            return detached;
+        }
+
+        int socket; // Read by the connection's own thread only
+        std::shared_ptr<Outbound> outbound;
+    };
+
+    static void writeOutbound(Outbound& outbound) {
+        std::string frames;
+        std::unique_lock<std::mutex> lock(outbound.mutex);
+        while (true) {
+            outbound.changed.wait(lock, [&] {
+                return !outbound.pending.empty() || outbound.finished || outbound.socket == -1;
+            });
+            if (outbound.socket == -1) {
+                return; // Handed over to the subscription hub, which closes it
+            }
+            if (outbound.pending.empty()) {
+                break;
+            }
+
+            frames.swap(outbound.pending);
+            outbound.writing = true;
+            lock.unlock();
+            bool sent = sendAll(outbound.socket, frames.data(), frames.size());
+            frames.clear();
+            lock.lock();
+            outbound.writing = false;
+            if (!sent && !outbound.failed) {
+                shutdown(outbound.socket, SHUT_RDWR); // Ends the reader too
+                outbound.failed = true;
+                outbound.pending.clear();
+                std::cerr << "Error: Data not sent" << std::endl;
+            }
+            outbound.changed.notify_all();
+        }
+        close(outbound.socket);
+    }
+
 public:
     void start() {
         std::cout << "Server started." << std::endl;
 
-        // Establish connections with clients
+        // Recover the on-disk log and let compaction and retention clean it up in the background
+        if (!log.open()) {
+            std::cerr << "Error: Cannot open transaction log" << std::endl;
+            return;
+        }
+        compactor.start();
+        ingest.start();
+        subscriptions.start();
+
+        // Establish connections with clients. Each gets a thread that reads its requests, which may be pipelined.
         while (true) {
             int clientSocket = accept(AF_INET, NULL, 0);
             if (clientSocket == -1) {
                 std::cerr << "Error: Connection refused" << std::endl;
                 continue;
             }
+            auto connection = std::make_shared<Connection>(clientSocket);
+            std::thread([this, connection] { serve(connection); }).detach();
+        }
+    }
 
-            char buffer[1024];
-            int bytesRead = recv(clientSocket, buffer, 1024, 0);
-            if (bytesRead <= 0) {
-                close(clientSocket);
+    // Reads requests until the client disconnects. Responses carry the id of their request and may go out in a
+    // different order, since writes are answered by the ingest writers once persisted.
+    void serve(const std::shared_ptr<Connection>& connection) {
+        FrameDecoder decoder;
+        std::string payload;
+        uint64_t requestId = 0;
+        while (true) {
+            char* buffer = decoder.prepare(kReceiveChunk);
+            ssize_t received = recv(connection->socket, buffer, kReceiveChunk, 0);
+            if (received < 0 && errno == EINTR) {
                 continue;
             }
+            if (received <= 0) {
+                return;
+            }
+            decoder.commit(static_cast<size_t>(received));
+
+            // Frames that fail their checksum are dropped together with the connection
+            int status;
+            while ((status = decoder.next(payload, requestId)) == 1) {
+                if (!handleRequest(connection, Json::Reader().parse(payload), requestId, decoder)) {
+                    return;
+                }
+            }
+            if (status < 0) {
+                return;
+            }
+        }
+    }
+
+    // Returns false once the connection has been handed over to the subscription hub, together with whatever
+    // `decoder` read past the request
+    bool handleRequest(const std::shared_ptr<Connection>& connection, const Json::Value& request, uint64_t requestId,
+                       FrameDecoder& decoder) {
+        // A subscriber gets everything from "since" on pushed to it, now and as it is committed, as far as the
+        // credits it grants allow. From then on the hub owns the socket; responses to writes still in flight on
+        // it are dropped. A subscriber that grants no credits gets everything as fast as it reads.
+        if (request.isMember("subscribe")) {
+            FlowCredits credits;
+            readCredits(request, credits);
+            subscriptions.subscribe(connection->detach(), request.isMember("since") ? request["since"].asUInt64() : 1,
+                                    credits, std::move(decoder));
+            return false;
+        }
+
+        // Health checks from connection pools
+        if (request.isMember("ping")) {
+            sendResponse(*connection, requestId, "pong");
+            return true;
+        }
+
+        // A key's whole history, with the sequence number it is complete up to, for clients that cache it
+        if (request.isMember("history")) {
+            uint64_t asOf = 0;
+            Json::Value response;
+            response["history"] = Json::Value(Json::arrayValue);
+            for (const auto& data : transactions.history(request["history"].asString(), &asOf)) {
+                response["history"].append(data);
+            }
+            response["asOf"] = Json::UInt64(asOf);
+            connection->send(Json::FastWriter().write(response), requestId);
+            return true;
+        }
 
-            Json::Value request = Json::Reader().parse(buffer);
-            std::string data = request["data"].asString();
+        // New consumers start from a snapshot: its path for those on this host, its sequence number to sync on from.
+        // Until the first one is built they are answered "busy" and ask again after their backoff.
+        if (request.isMember("snapshot")) {
+            SnapshotInfo info;
+            Json::Value response;
+            if (snapshots.current(info)) {
+                response["path"] = info.path;
+                response["sequence"] = Json::UInt64(info.sequence);
+                response["bytes"] = Json::UInt64(info.bytes);
+            } else {
+                response["busy"] = true;
+            }
+            connection->send(Json::FastWriter().write(response), requestId);
+            return true;
+        }
+
+        // Consumers on other hosts download the snapshot a chunk at a time. The chunk is sent as is, not as JSON;
+        // an empty one before the end means the snapshot was replaced and the download has to start over.
+        if (request.isMember("snapshotChunk")) {
+            std::string chunk;
+            uint64_t maxBytes = std::min<uint64_t>(request["maxBytes"].asUInt64(), kMaxFrameSize / 2);
+            if (!snapshots.readChunk(request["snapshotChunk"].asString(), request["offset"].asUInt64(), maxBytes,
+                                     chunk)) {
+                chunk.clear();
+            }
+            connection->send(chunk, requestId);
+            return true;
+        }
+
+        // Reads may have to go to disk. After a restart every client catches up at once, so beyond
+        // kMaxConcurrentReads they are answered "busy" and retried after the client's backoff.
+        if (request.isMember("since") || (request.isMember("from") && request.isMember("to"))) {
+            if (readsInFlight.fetch_add(1, std::memory_order_acq_rel) >= kMaxConcurrentReads) {
+                readsInFlight.fetch_sub(1, std::memory_order_acq_rel);
+                readsRejected.fetch_add(1, std::memory_order_relaxed);
+                Json::Value response;
+                response["busy"] = true;
+                connection->send(Json::FastWriter().write(response), requestId);
+                return true;
+            }
+            serveRead(*connection, request, requestId);
+            readsInFlight.fetch_sub(1, std::memory_order_acq_rel);
+            return true;
+        }
 
-            // Add the new data to the map
-            transactions.push_back(data);
+        // A batch of writes from a client's WriteBatcher is answered once, when the last of them is persisted
+        if (request.isMember("batch")) {
+            submitBatch(connection, request["batch"], requestId);
+            return true;
+        }
 
-            sendResponse(clientSocket, "Data received successfully.");
+        // The transaction is acknowledged by its shard's writer thread once it has been persisted. One that would
+        // not fit a read page on its own is refused, since no reader could ever be sent it.
+        Record record = toRecord(request);
+        if (encodedSize(record) > kMaxPageBytes) {
+            sendResponse(*connection, requestId, "Error: Transaction too large.");
+            return true;
         }
+        ingest.submit(std::move(record), [this, connection, requestId](bool stored, uint64_t sequence) {
+            if (!stored) {
+                sendResponse(*connection, requestId, "Error: Data not stored.");
+                return;
+            }
+            subscriptions.notifyCommitted();
+            sendResponse(*connection, requestId, "Data received successfully.", sequence);
+        });
+        return true;
     }
 
-    void sendResponse(int clientSocket, const std::string& message) {
+    // A "since" read or a time range read, once admitted
+    void serveRead(Connection& connection, const Json::Value& request, uint64_t requestId) {
+        // Reads return one page of at most "maxBytes" of encoded transactions, never more than fits a frame
+        uint64_t maxBytes = kMaxPageBytes;
+        if (request.isMember("maxBytes")) {
+            maxBytes = std::min<uint64_t>(std::max<uint64_t>(request["maxBytes"].asUInt64(), 1), maxBytes);
+        }
+
+        // A time range read names its bounds in milliseconds, and "since" to continue where it left off. Like
+        // pushes, reads stop at the last committed transaction.
+        if (request.isMember("from") && request.isMember("to")) {
+            uint64_t since = request.isMember("since") ? request["since"].asUInt64() : 0;
+            uint64_t committed = transactions.committedSequence();
+            std::vector<Record> records = transactions.readBetween(
+                request["from"].asUInt64(), request["to"].asUInt64(), since, kMaxRecordsPerRead, maxBytes, encodedSize);
+            TieredStore::dropUncommitted(records, committed);
+            sendTransactions(connection, requestId, since, records);
+            return;
+        }
+
+        // A read names the first sequence number it has not seen yet; only what follows it is sent
+        uint64_t since = request["since"].asUInt64();
+        sendTransactions(connection, requestId, since,
+                         transactions.readCommitted(since, kMaxRecordsPerRead, maxBytes, encodedSize));
+    }
+
+    Record toRecord(const Json::Value& write) {
+        Record record;
+        record.key = write["key"].asString();
+        record.data = write["data"].asString();
+        record.expiresAt = write.isMember("expiresAt") ? write["expiresAt"].asUInt64()
+                                                       : compactor.retention().expiryFor(record.key, nowMillis());
+        return record;
+    }
+
+    // The writes land on different shards and complete on different writer threads; whichever completes last
+    // sends the answer, with one sequence number per write in batch order (0 for one that was not stored)
+    void submitBatch(const std::shared_ptr<Connection>& connection, const Json::Value& writes, uint64_t requestId) {
+        struct Progress {
+            std::vector<uint64_t> sequences;
+            std::atomic<size_t> remaining{0};
+        };
+        auto progress = std::make_shared<Progress>();
+        progress->sequences.resize(writes.size());
+        progress->remaining.store(writes.size(), std::memory_order_relaxed);
+        if (writes.empty()) {
+            sendBatchResponse(*connection, requestId, progress->sequences);
+            return;
+        }
+
+        for (Json::ArrayIndex i = 0; i < writes.size(); ++i) {
+            auto done = [this, connection, requestId, progress, i](bool stored, uint64_t sequence) {
+                if (stored) {
+                    progress->sequences[i] = sequence;
+                    subscriptions.notifyCommitted();
+                }
+                if (progress->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    sendBatchResponse(*connection, requestId, progress->sequences);
+                }
+            };
+            Record record = toRecord(writes[i]);
+            if (encodedSize(record) > kMaxPageBytes) {
+                done(false, 0); // Too large for a read page, like a single write
+                continue;
+            }
+            ingest.submit(std::move(record), std::move(done));
+        }
+    }
+
+    void sendBatchResponse(Connection& connection, uint64_t requestId, const std::vector<uint64_t>& sequences) {
+        Json::Value response;
+        response["message"] = "Data received successfully.";
+        response["sequences"] = Json::Value(Json::arrayValue);
+        for (uint64_t sequence : sequences) {
+            response["sequences"].append(Json::UInt64(sequence));
+        }
+        connection.send(Json::FastWriter().write(response), requestId);
+    }
+
+    void sendResponse(Connection& connection, uint64_t requestId, const std::string& message, uint64_t sequence = 0) {
         Json::Value response;
         response["message"] = message;
+        if (sequence != 0) {
+            response["sequence"] = Json::UInt64(sequence);
+        }
+        connection.send(Json::FastWriter().write(response), requestId);
+    }
+
+    // One page of a read as one frame; the client asks again from "next" for the rest
+    void sendTransactions(Connection& connection, uint64_t requestId, uint64_t since,
+                          const std::vector<Record>& records) {
+        uint64_t next = records.empty() ? since : records.back().sequence + 1;
+        connection.send(encodeTransactions(records, next), requestId);
+    }
 
-        char buffer[1024];
-        int bytesWritten = send(clientSocket, &response, 1024 * sizeof(Json::Value), 0);
+    // The payload of read responses and subscription pushes alike
+    static std::string encodeTransactions(const std::vector<Record>& records, uint64_t next) {
+        Json::Value response;
+        response["transactions"] = Json::Value(Json::arrayValue);
+        for (const auto& record : records) {
+            Json::Value transaction;
+            transaction["sequence"] = Json::UInt64(record.sequence);
+            transaction["timestamp"] = Json::UInt64(record.timestamp);
+            transaction["key"] = record.key;
+            if (record.type == RecordType::Tombstone) {
+                transaction["deleted"] = true;
+            } else {
+                transaction["data"] = record.data;
+            }
+            response["transactions"].append(transaction);
+        }
+        response["next"] = Json::UInt64(next);
+        return Json::FastWriter().write(response);
+    }
 
-        if (bytesWritten <= 0) {
-            close(clientSocket);
-            std::cerr << "Error: Data not sent" << std::endl;
+    // An upper bound on what a record adds to encodeTransactions(). FastWriter escapes quotes, backslashes and
+    // control characters, and writes non-ASCII characters as \u escapes of up to six bytes per input byte.
+    static uint64_t encodedSize(const Record& record) {
+        return kRecordJsonOverhead + escapedSize(record.key) + escapedSize(record.data);
+    }
+
+    static uint64_t escapedSize(const std::string& text) {
+        uint64_t size = 0;
+        for (unsigned char c : text) {
+            size += c == '"' || c == '\\' ? 2 : c < 0x20 || c >= 0x80 ? 6 : 1;
+        }
+        return size;
+    }
+
+    // Credits in a subscribe request or a later {"credit": true, "frames": ..., "bytes": ...} grant. A kind of
+    // credit that is left out is not limited.
+    static void readCredits(const Json::Value& message, FlowCredits& credits) {
+        if (message.isMember("frames")) {
+            credits.frames = message["frames"].asUInt64();
+        }
+        if (message.isMember("bytes")) {
+            credits.bytes = message["bytes"].asUInt64();
+        }
+    }
+
+    static bool decodeGrant(const std::string& payload, FlowCredits& grant) {
+        Json::Value message = Json::Reader().parse(payload);
+        if (!message.isMember("credit")) {
+            return false;
         }
+        grant = FlowCredits{0, 0};
+        readCredits(message, grant);
+        return true;
+    }
+
+    // Write amplification and outstanding compaction work, for monitoring
+    CompactionMetrics compactionMetrics() const {
+        return compactor.metrics();
+    }
+
+    // Hot tier size and how often reads had to go to cold segments
+    TieringMetrics tieringMetrics() const {
+        return transactions.metrics();
+    }
+
+    // Bytes held in memory per hot segment and per key namespace, against the global budget
+    MemoryMetrics memoryMetrics() const {
+        return transactions.memoryMetrics();
+    }
+
+    // How well writes are being batched
+    IngestMetrics ingestMetrics() const {
+        return ingest.metrics();
+    }
+
+    // Hit ratio and occupancy of the cache in front of cold segment reads
+    BlockCacheMetrics blockCacheMetrics() const {
+        return transactions.blockCacheMetrics();
+    }
+
+    // Connected subscribers, what was pushed to them and how many were too slow to keep
+    SubscriptionMetrics subscriptionMetrics() const {
+        return subscriptions.metrics();
+    }
+
+    // Reads turned away because kMaxConcurrentReads were already being served
+    uint64_t readsRejectedCount() const {
+        return readsRejected.load(std::memory_order_relaxed);
     }
 
 private:
-    std::map<std::string, std::vector<std::string>> transactions;
+    static constexpr size_t kMaxRecordsPerRead = 1000;
+    static constexpr size_t kReceiveChunk = 256 << 10;
+    static constexpr size_t kMaxConcurrentReads = 16;
+    static constexpr size_t kMaxOutboundBytes = 4 * kMaxFrameSize; // Responses queued for a client not reading
+    static constexpr uint64_t kMaxPageBytes = kMaxFrameSize / 2;   // Encoded records per read response or push
+    static constexpr uint64_t kRecordJsonOverhead = 96; // Field names, quotes and numbers around a record's strings
+    static inline const std::string kResponseTooLarge = "{\"message\":\"Error: Response too large.\"}\n";
+
+    SegmentLog log{"pdn-data"};
+    CompactionScheduler compactor{log};
+    TieredStore transactions{log};
+    SubscriptionHub subscriptions{transactions, encodeTransactions, // Before `ingest`, whose writers notify it
+                                  [](const std::string& payload, FlowCredits& grant) {
+                                      return decodeGrant(payload, grant);
+                                  },
+                                  encodedSize};
+    IngestQueue ingest{transactions};
+    SnapshotManager snapshots{transactions};
+
+    std::atomic<size_t> readsInFlight{0};
+    std::atomic<uint64_t> readsRejected{0};
 };
 
 int main() {
@@ -78,65 +507,366 @@ int main() {
 /*
 **Client Side**
 */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
 #include <iostream>
+#include <thread>
 #include <json/json.h> // jsoncpp library
+#include "pdn_client.h"
+#include "pdn_protocol.h"
+#include "pdn_snapshot.h"
 
 class Client {
 public:
+    // With `cacheHistories`, history() serves repeated reads of a key locally, kept current by the subscription
+    explicit Client(std::vector<Endpoint> endpoints = {{"localhost", 8080}}, bool cacheHistories = false)
+        : endpoints(endpoints), pool(std::move(endpoints)),
+          writes([this](const std::string& request, AsyncClient::Callback done) {
+              return pool.submit(request, std::move(done));
+          }),
+          cache(cacheHistories ? std::make_unique<TransactionCache>() : nullptr) {}
+
+    // Writes are batched with others made within the linger time; `done` gets the transaction's sequence number
+    void write(const std::string& key, const std::string& data, WriteBatcher::Completion done) {
+        writes.write(key, data, std::move(done));
+    }
+
+    // Every live transaction of `key`, oldest first. The cache is only used while the subscription is live,
+    // since nothing else keeps it current.
+    std::vector<std::string> history(const std::string& key) {
+        bool cached = cache != nullptr && live.load();
+        std::vector<std::string> result;
+        if (cached && cache->lookup(key, result)) {
+            return result;
+        }
+        bool filling = cached && cache->beginFill(key);
+
+        Json::Value request;
+        request["history"] = key;
+        Response response = pool.submit(Json::FastWriter().write(request)).get();
+        if (!response.ok) {
+            if (filling) {
+                cache->abandonFill(key);
+            }
+            std::cerr << "Error: Cannot read " << key << std::endl;
+            return {};
+        }
+        Json::Value reply = Json::Reader().parse(response.payload);
+        for (const auto& data : reply["history"]) {
+            result.push_back(data.asString());
+        }
+        if (filling) {
+            cache->fill(key, result, reply["asOf"].asUInt64());
+        }
+        return result;
+    }
+
+    // Runs until the process ends. Whenever the subscription drops, it reconnects after a jittered backoff and
+    // resumes from the cursor, so nothing up to the last applied transaction is downloaded twice.
     void start() {
         std::cout << "Client started." << std::endl;
 
-        // Establish a connection with the server
-        int clientSocket = connect("localhost", 8080);
-
-        if (clientSocket == -1) {
+        // Requests are spread over a pool of connections to every server, which reconnects on its own
+        if (!pool.start()) {
             std::cerr << "Error: Connection refused" << std::endl;
-            return;
         }
+        writes.start();
 
-        char buffer[1024];
-        int bytesRead = recv(clientSocket, buffer, 1024, 0);
-        if (bytesRead <= 0) {
-            close(clientSocket);
-            std::cerr << "Error: No data received" << std::endl;
-            return;
+        // A consumer without a cursor starts from a snapshot rather than from the beginning of the log. One
+        // with a cursor maps the snapshot it started from again, if it had one, and starts over from a fresh
+        // snapshot if that is unreadable. Both are positions in one server's log, so that server is saved with
+        // the cursor and every later read goes to it.
+        if (!loadCursor()) {
+            cursor = 0;
+            server = reachable();
+        }
+        std::error_code error;
+        if (cursor == 0) {
+            bootstrap();
+        } else if (std::filesystem::exists(kSnapshotPath, error) && !snapshot.open(kSnapshotPath)) {
+            std::cerr << "Error: Cannot map " << kSnapshotPath << ", bootstrapping again" << std::endl;
+            bootstrap();
         }
 
-        Json::Value response = Json::Reader().parse(buffer);
+        Backoff backoff;
+        while (true) {
+            if (follow()) {
+                backoff.reset();
+            }
+            std::chrono::milliseconds wait = backoff.next();
+            std::cerr << "Error: Subscription lost at sequence " << cursor << ", reconnecting in " << wait.count()
+                      << " ms" << std::endl;
+            std::this_thread::sleep_for(wait);
+        }
+    }
+
+    // What this consumer started from, if it was bootstrapped from a snapshot
+    const SnapshotFile& startingSnapshot() const {
+        return snapshot;
+    }
+
+private:
+    static constexpr uint64_t kPageBytes = 1u << 20; // Encoded transactions per catch-up page
+    static constexpr uint64_t kWindowFrames = 8;      // Subscription pushes the server may have outstanding
+    static constexpr uint64_t kWindowBytes = 8u << 20;
+    static constexpr const char* kCursorPath = "pdn-client.cursor";
+    static constexpr const char* kSnapshotPath = "pdn-client.snapshot";
+
+    std::vector<Endpoint> endpoints;
+    ConnectionPool pool;
+    WriteBatcher writes; // After `pool`, which it sends through
+    std::unique_ptr<TransactionCache> cache;
+    std::atomic<bool> live{false}; // Whether the subscription is delivering pushes, so the cache is current
+    SnapshotFile snapshot;
+    Endpoint server;     // Where the snapshot and the transactions after it come from
+    uint64_t cursor = 0; // Sequence number of the last transaction applied, 0 before the first
 
-        // Get the latest transactions from the server
+    // Maps the server's current snapshot, in place if this host can see the server's file and from a downloaded
+    // copy otherwise, and moves the cursor to its sequence number. Either way the snapshot ends up under
+    // kSnapshotPath, so a restart maps the same one. Leaves the cursor alone on failure, so the catch-up simply
+    // starts from the cursor it had.
+    bool bootstrap() {
+        Json::Value request;
+        request["snapshot"] = true;
+        Json::Value info;
+        Backoff backoff;
         while (true) {
-            int bytesWritten = send(clientSocket, "Get latest transactions", 24);
-            if (bytesWritten <= 0) {
-                close(clientSocket);
-                std::cerr << "Error: No data sent" << std::endl;
-                return;
+            Response response = pool.submitTo(server, Json::FastWriter().write(request)).get();
+            if (!response.ok) {
+                return false;
+            }
+            info = Json::Reader().parse(response.payload);
+            if (!info.isMember("busy")) {
+                break;
             }
+            std::this_thread::sleep_for(backoff.next()); // The server is building its first snapshot
+        }
+        if (!info.isMember("path")) {
+            std::cerr << "Error: No snapshot to start from" << std::endl;
+            return false;
+        }
 
-            char buffer2[1024];
-            bytesRead = recv(clientSocket, buffer2, 1024, 0);
+        std::string path = info["path"].asString();
+        if (!snapshot.open(path) || snapshot.sequence() != info["sequence"].asUInt64() || !keep(path)) {
+            if (!download(path, info["bytes"].asUInt64()) || !snapshot.open(kSnapshotPath)) {
+                std::cerr << "Error: Cannot fetch snapshot " << path << std::endl;
+                return false;
+            }
+        }
+        std::cout << "Snapshot: " << snapshot.recordCount() << " transactions up to sequence " << snapshot.sequence()
+                  << std::endl;
+        cursor = snapshot.sequence();
+        saveCursor();
+        return true;
+    }
+
+    // Puts the server's snapshot, mapped in place, under kSnapshotPath as well: a hard link if both are on one
+    // filesystem, a copy otherwise. The server unlinks its file once a newer snapshot replaces it.
+    bool keep(const std::string& path) {
+        std::string tmpPath = std::string(kSnapshotPath) + ".tmp";
+        ::unlink(tmpPath.c_str());
+        std::error_code error;
+        bool ok = ::link(path.c_str(), tmpPath.c_str()) == 0 || std::filesystem::copy_file(path, tmpPath, error);
+        if (!ok || std::rename(tmpPath.c_str(), kSnapshotPath) != 0) {
+            std::cerr << "Error: Cannot keep snapshot " << path << " as " << kSnapshotPath << std::endl;
+            ::unlink(tmpPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Copies the server's snapshot to kSnapshotPath a page at a time
+    bool download(const std::string& path, uint64_t bytes) {
+        std::string tmpPath = std::string(kSnapshotPath) + ".tmp";
+        int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            return false;
+        }
+        bool ok = true;
+        for (uint64_t offset = 0; ok && offset < bytes;) {
+            Json::Value request;
+            request["snapshotChunk"] = path;
+            request["offset"] = Json::UInt64(offset);
+            request["maxBytes"] = Json::UInt64(kPageBytes);
+            Response chunk = pool.submitTo(server, Json::FastWriter().write(request)).get();
+            ok = chunk.ok && !chunk.payload.empty() && writeFully(fd, chunk.payload.data(), chunk.payload.size());
+            offset += chunk.payload.size();
+        }
+        ok = ok && ::fsync(fd) == 0;
+        ::close(fd);
+        if (!ok || std::rename(tmpPath.c_str(), kSnapshotPath) != 0) {
+            ::unlink(tmpPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Catches up from the cursor, then subscribes from there and applies pushes until the connection drops.
+    // Returns true if it got as far as receiving from the subscription, so the backoff can start over.
+    bool follow() {
+        // Fetch only what was committed since the cursor, a page at a time
+        if (!catchUp()) {
+            std::cerr << "Error: Cannot catch up from sequence " << cursor << std::endl;
+            return false;
+        }
+
+        // A subscription is a stream of its own, so it gets a dedicated connection
+        int clientSocket = connect();
+        if (clientSocket == -1) {
+            std::cerr << "Error: Connection refused" << std::endl;
+            return false;
+        }
+
+        // Subscribe once; from then on the server pushes new transactions as they are committed, but never more
+        // than the window granted here. What has been applied is granted again in batches of half the window.
+        Json::Value subscribe;
+        subscribe["subscribe"] = true;
+        subscribe["since"] = Json::UInt64(cursor + 1);
+        subscribe["frames"] = Json::UInt64(kWindowFrames);
+        subscribe["bytes"] = Json::UInt64(kWindowBytes);
+        if (!sendFrame(clientSocket, Json::FastWriter().write(subscribe))) {
+            close(clientSocket);
+            std::cerr << "Error: No data sent" << std::endl;
+            return false;
+        }
+        setLive(true);
+
+        bool received = false;
+        uint64_t consumedFrames = 0;
+        uint64_t consumedBytes = 0;
+        while (true) {
+            std::string payload2;
+            int bytesRead = recvFrame(clientSocket, payload2);
 
             if (bytesRead == -1 || bytesRead == 0) {
                 break;
             }
 
-            Json::Value latestTransactions = Json::Reader().parse(buffer2);
-            for (const auto& transaction : latestTransactions["transactions"]) {
-                std::cout << "Transaction: " << transaction << std::endl;
+            apply(Json::Reader().parse(payload2));
+            received = true;
+
+            consumedFrames++;
+            consumedBytes += static_cast<uint64_t>(bytesRead);
+            if (consumedFrames >= kWindowFrames / 2 || consumedBytes >= kWindowBytes / 2) {
+                Json::Value credit;
+                credit["credit"] = true;
+                credit["frames"] = Json::UInt64(consumedFrames);
+                credit["bytes"] = Json::UInt64(consumedBytes);
+                if (!sendFrame(clientSocket, Json::FastWriter().write(credit))) {
+                    break;
+                }
+                consumedFrames = 0;
+                consumedBytes = 0;
             }
         }
+        setLive(false);
+        close(clientSocket);
+        return received;
     }
 
-private:
-    int connect(const char* host, int port) {
-        // Establish a connection with the server
-        return socket(AF_INET, SOCK_STREAM, 0);
+    // Cached histories may have missed pushes while the subscription was down, and a read that started before
+    // it came back may fill in one that has, so the cache starts over on every change
+    void setLive(bool nowLive) {
+        live.store(false);
+        if (cache != nullptr) {
+            cache->clear();
+        }
+        live.store(nowLive);
     }
 
-    int send(int clientSocket, const char* message, int length) {
-        // Send data to the client
-        return send(clientSocket, message, length, 0);
+    // Pages through everything after the cursor until the server has nothing more. Fails if the server is
+    // busy serving other catch-ups, so the caller backs off.
+    bool catchUp() {
+        while (true) {
+            Json::Value request;
+            request["since"] = Json::UInt64(cursor + 1);
+            request["maxBytes"] = Json::UInt64(kPageBytes);
+            Response page = pool.submitTo(server, Json::FastWriter().write(request)).get();
+            if (!page.ok) {
+                return false;
+            }
+            Json::Value transactions = Json::Reader().parse(page.payload);
+            if (transactions.isMember("busy")) {
+                return false;
+            }
+            if (!transactions.isMember("transactions")) {
+                std::cerr << "Error: " << transactions["message"].asString() << std::endl;
+                return false;
+            }
+            if (transactions["transactions"].empty()) {
+                return true;
+            }
+            apply(transactions);
+        }
+    }
+
+    // Handles one page of transactions and moves the cursor past it
+    void apply(const Json::Value& page) {
+        for (const auto& transaction : page["transactions"]) {
+            std::cout << "Transaction: " << transaction << std::endl;
+            if (cache != nullptr) {
+                cache->apply(transaction["key"].asString(), transaction["sequence"].asUInt64(),
+                             transaction.isMember("deleted"), transaction["data"].asString());
+            }
+        }
+        uint64_t next = page["next"].asUInt64();
+        if (next > cursor + 1) {
+            cursor = next - 1;
+            saveCursor();
+        }
+    }
+
+    // The cursor and the server it belongs to, as saved by saveCursor(). Returns false if there is none, or
+    // if that server is no longer one of the endpoints.
+    bool loadCursor() {
+        unsigned long long saved = 0;
+        char host[256];
+        int port = 0;
+        bool ok = false;
+        if (FILE* file = std::fopen(kCursorPath, "r")) {
+            ok = std::fscanf(file, "%llu %255s %d", &saved, host, &port) == 3;
+            std::fclose(file);
+        }
+        ok = ok && std::any_of(endpoints.begin(), endpoints.end(), [&](const Endpoint& endpoint) {
+            return endpoint.host == host && endpoint.port == port;
+        });
+        if (ok) {
+            cursor = saved;
+            server = Endpoint{host, port};
+        }
+        return ok;
+    }
+
+    // Replaced through a rename, so a crash leaves either the old or the new cursor
+    void saveCursor() const {
+        std::string tmpPath = std::string(kCursorPath) + ".tmp";
+        std::string contents = std::to_string(cursor) + " " + server.host + " " + std::to_string(server.port) + "\n";
+        int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool ok = fd != -1 && writeFully(fd, contents.data(), contents.size()) && ::fsync(fd) == 0;
+        if (fd != -1) {
+            ::close(fd);
+        }
+        if (!ok || std::rename(tmpPath.c_str(), kCursorPath) != 0) {
+            std::cerr << "Error: Cannot save " << kCursorPath << std::endl;
+        }
     }
+
+    // The first endpoint that accepts a connection, or the first endpoint if none does yet
+    Endpoint reachable() const {
+        for (const auto& endpoint : endpoints) {
+            int probe = connectTo(endpoint.host, endpoint.port);
+            if (probe != -1) {
+                close(probe);
+                return endpoint;
+            }
+        }
+        return endpoints.empty() ? Endpoint{} : endpoints.front();
+    }
+
+    int connect() { return connectTo(server.host, server.port); }
 };
 
 int main() {
@@ -149,90 +879,161 @@ int main() {
 **Consensus Algorithm**
 
 To ensure that previous transactions match across all clients in the network, you can implement a consensus
-algorithm like Paxos. Here's an example implementation:
+algorithm like Paxos. Here the replicas run Multi-Paxos (see pdn_consensus.h): a stable leader runs phase 1
+once and then commits every transaction with one phase-2 round trip to a majority, and every replica feeds the
+chosen transactions into its own store in log order.
 */
 #include <iostream>
 #include <vector>
 #include <map>
+#include <json/json.h> // jsoncpp library
+#include "pdn_consensus.h"
+#include "pdn_protocol.h"
+#include "pdn_snapshot.h"
+#include "pdn_storage.h"
 
 class ConsensusAlgorithm {
 public:
+    // `nodeId` is this replica's id, unique and below 256; `peers` are the other replicas
+    ConsensusAlgorithm(uint32_t nodeId, const std::vector<Endpoint>& peers)
+        : log("pdn-consensus-" + std::to_string(nodeId)),
+          snapshots(transactions, snapshotOptions(nodeId)),
+          paxos(nodeId, peers, "pdn-consensus-" + std::to_string(nodeId) + ".paxos",
+                [this](uint64_t slot, const std::string& value) { return applyChosen(slot, value); },
+                PaxosCheckpoint{
+                    [this](uint64_t minSlot, SnapshotInfo& info) { return snapshots.current(info, minSlot); },
+                    [this](const std::string& path, uint64_t offset, uint64_t maxBytes, std::string& chunk) {
+                        return snapshots.readChunk(path, offset, maxBytes, chunk);
+                    },
+                    [this](const std::string& path, uint64_t throughSlot) {
+                        return installSnapshot(path, throughSlot);
+                    }}) {}
+
     void start() {
         std::cout << "Consensus algorithm started." << std::endl;
 
-        // Initialize the current proposal and vote count
-        currentProposal = 0;
-        voteCount = 0;
+        if (!log.open() || !paxos.start()) {
+            std::cerr << "Error: Cannot open consensus state" << std::endl;
+            return;
+        }
 
+        // Other replicas connect to exchange Paxos messages; each connection gets a thread
         while (true) {
-            // Propose a new value
-            int proposalNumber = incrementProposal();
-
-            // Send the proposal to all clients
-            sendProposal(proposalNumber);
-
-            // Wait for votes from clients
-            waitForVotes(proposalNumber);
+            int peerSocket = accept(AF_INET, NULL, 0);
+            if (peerSocket == -1) {
+                std::cerr << "Error: Connection refused" << std::endl;
+                continue;
+            }
+            std::thread([this, peerSocket] { servePeer(peerSocket); }).detach();
         }
     }
 
-private:
-    void sendProposal(int proposalNumber) {
-        // Send the proposal to all clients
-        std::cout << "Sending proposal with value: " << proposalNumber << std::endl;
+    // Replicates a write. `done` gets Applied once a majority accepted it and it is in this replica's store.
+    // Only the leader takes writes; elsewhere `done` gets Rejected and the caller should retry at leaderId().
+    // Unknown means the leader stepped down first and the write may or may not show up later.
+    void replicate(const std::string& key, const std::string& data, std::function<void(ProposalOutcome)> done) {
+        Json::Value write;
+        write["key"] = key;
+        write["data"] = data;
+        paxos.propose(Json::FastWriter().write(write),
+                      [done](ProposalOutcome outcome, uint64_t) { done(outcome); });
     }
 
-    void waitForVotes(int proposalNumber) {
-        // Wait for votes from clients
-        std::cout << "Waiting for votes..." << std::endl;
+    uint32_t leaderId() const {
+        return paxos.leaderId();
+    }
 
-        // Get the latest transactions from each client
-        while (true) {
-            int bytesWritten = recvClientData();
-            if (bytesWritten == -1 || bytesWritten == 0) {
-                break;
-            }
+    PaxosMetrics metrics() const {
+        return paxos.metrics();
+    }
 
-            Json::Value response = Json::Reader().parse(buffer);
+private:
+    static SnapshotOptions snapshotOptions(uint32_t nodeId) {
+        SnapshotOptions options;
+        options.directory = "pdn-consensus-" + std::to_string(nodeId) + "-snapshots";
+        return options;
+    }
 
-            // Check if a majority of clients have voted for the proposal
-            if (response["majority"].asBool()) {
-                std::cout << "Proposal accepted with value: " << proposalNumber << std::endl;
+    // Chosen values arrive one at a time in slot order, so the store sees the same order on every replica.
+    // Every slot becomes exactly one record, a no-op an empty one, so a record's sequence number is its slot
+    // and a slot offered again after a restart is recognised as applied.
+    bool applyChosen(uint64_t slot, const std::string& value) {
+        uint64_t last = transactions.lastSequence();
+        if (slot <= last) {
+            return true;
+        }
+        if (slot != last + 1) {
+            std::cerr << "Error: Slot " << slot << " does not follow transaction " << last << std::endl;
+            return false;
+        }
+        Record record;
+        if (!value.empty()) {
+            Json::Value write = Json::Reader().parse(value);
+            record.key = write["key"].asString();
+            record.data = write["data"].asString();
+        }
+        if (!transactions.append(record)) {
+            std::cerr << "Error: Cannot store transaction of slot " << slot << std::endl;
+            return false;
+        }
+        return true;
+    }
 
-                // Update the current proposal and vote count
-                updateCurrentProposal(proposalNumber);
+    // Brings the store up to `throughSlot` from a snapshot the leader sent in place of slots it no longer keeps.
+    // Writes through consensus are appends only, so what the snapshot leaves out was never live here either;
+    // the records past this store's last one are appended at their own sequence numbers, the slots between
+    // them as empty records.
+    bool installSnapshot(const std::string& path, uint64_t throughSlot) {
+        SnapshotFile snapshot;
+        if (!snapshot.open(path) || snapshot.sequence() != throughSlot) {
+            std::cerr << "Error: Snapshot " << path << " does not cover slot " << throughSlot << std::endl;
+            return false;
+        }
+        bool ok = true;
+        auto fillTo = [&](uint64_t sequence) {
+            while (ok && transactions.lastSequence() < sequence) {
+                ok = transactions.append(Record());
+            }
+        };
+        bool intact = snapshot.forEach([&](const Record& record) {
+            if (!ok || record.sequence <= transactions.lastSequence()) {
                 return;
             }
+            fillTo(record.sequence - 1);
+            Record copy;
+            copy.key = record.key;
+            copy.data = record.data;
+            copy.expiresAt = record.expiresAt;
+            ok = ok && transactions.append(copy);
+        });
+        fillTo(throughSlot);
+        if (!intact || !ok) {
+            std::cerr << "Error: Cannot install snapshot " << path << std::endl;
+            return false;
         }
-
-        // If no majority is reached, reject the proposal
-        std::cout << "Proposal rejected." << std::endl;
-    }
-
-    int incrementProposal() {
-        // Increment the proposal number
-        return currentProposal++;
+        return true;
     }
 
-    void updateCurrentProposal(int proposalNumber) {
-        // Update the current proposal and vote count
-        currentProposal = proposalNumber;
-        voteCount = 0;
-
-        // Get the latest transactions from each client
-        for (auto& transaction : transactions) {
-            std::cout << "Transaction: " << transaction.second.back() << std::endl;
-            voteCount++;
+    // Answers every frame with the reply to the message in it, under the same request id
+    void servePeer(int peerSocket) {
+        while (true) {
+            std::string buffer;
+            uint64_t requestId = 0;
+            int bytesRead = recvFrame(peerSocket, buffer, &requestId);
+            if (bytesRead == -1 || bytesRead == 0) {
+                break;
+            }
+            if (!sendFrame(peerSocket, paxos.handle(buffer), requestId)) {
+                break;
+            }
         }
+        close(peerSocket);
     }
 
-private:
-    int recvClientData() {
-        // Receive data from a client
-        return 0; // Replace with actual implementation
-    }
-
-    std::map<std::string, std::vector<std::string>> transactions;
+    SegmentLog log;
+    TieredStore transactions{log};
+    SnapshotManager snapshots;
+    MultiPaxos paxos; // Last, since it applies to `transactions` until it is stopped
 };
 /*
 This is a basic example to illustrate the concept of consensus algorithms in distributed systems. In practice,